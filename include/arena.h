@@ -0,0 +1,118 @@
+#ifndef ARENA_H_INCLUDED
+#define ARENA_H_INCLUDED
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+// Bump allocator for the many small strings and arrays built while
+// loading.  Allocations are carved one after the other out of large
+// chunks and are never freed on their own, release() drops them all at
+// once, a delete per chunk.  Requests bigger than a quarter chunk get a
+// chunk of their own so the current chunk is not wasted.  Not thread
+// safe, threads allocate from arenas of their own.
+
+class Arena
+  {
+  private :
+
+  std::vector<char*> chunks ;
+  uint64_t chunksize ;
+  char* next ;                        // Free space left in the current chunk
+  uint64_t nleft ;
+  uint64_t nused ;
+  uint64_t nreserved ;
+
+  public :
+
+  explicit Arena( uint64_t size = 4ULL * 1024ULL * 1024ULL ) : chunksize( size ), next( NULL ), nleft( 0 ),
+                                                                nused( 0 ), nreserved( 0 )
+    {
+    }
+
+  Arena( const Arena & ) = delete ;
+  Arena &operator=( const Arena & ) = delete ;
+
+  Arena( Arena &&other ) noexcept : chunks( std::move( other.chunks ) ), chunksize( other.chunksize ),
+                                    next( other.next ), nleft( other.nleft ),
+                                    nused( other.nused ), nreserved( other.nreserved )
+    {
+    other.chunks.clear() ;
+    other.next = NULL ;
+    other.nleft = other.nused = other.nreserved = 0 ;
+    }
+
+  ~Arena()
+    {
+    release() ;
+    }
+
+  void* allocate( uint64_t n, uint64_t align = 8 )
+    {
+    uint64_t pad = ( align - ( uintptr_t( next ) & ( align - 1 ) ) ) & ( align - 1 ) ;
+    if( n + pad > nleft )
+      {
+      if( n > chunksize / 4 )
+        {
+        char* own = new char[ n ] ;
+        chunks.push_back( own ) ;
+        nused += n ;
+        nreserved += n ;
+        return( own ) ;
+        }
+      next = new char[ chunksize ] ;
+      nleft = chunksize ;
+      chunks.push_back( next ) ;
+      nreserved += chunksize ;
+      pad = 0 ;
+      }
+
+    char* p = next + pad ;
+    next += pad + n ;
+    nleft -= pad + n ;
+    nused += n ;
+    return( p ) ;
+    }
+
+  template<class T> inline T* allocatearray( uint64_t n )
+    {
+    return( ( T* ) allocate( n * sizeof( T ), alignof( T ) ) ) ;
+    }
+
+  // Copies len bytes of text and a terminating nul
+  inline char* copystring( const char* text, uint64_t len )
+    {
+    char* copy = ( char* ) allocate( len + 1, 1 ) ;
+    memcpy( copy, text, len ) ;
+    copy[ len ] = '\0' ;
+    return( copy ) ;
+    }
+
+  void release( void )
+    {
+    for( uint64_t i = 0 ; i < chunks.size() ; ++i )
+      delete [] chunks[ i ] ;
+    chunks.clear() ;
+    next = NULL ;
+    nleft = 0 ;
+    nused = 0 ;
+    nreserved = 0 ;
+    }
+
+  inline uint64_t bytesused( void ) const
+    {
+    return( nused ) ;
+    }
+
+  inline uint64_t bytesreserved( void ) const
+    {
+    return( nreserved ) ;
+    }
+
+  inline uint64_t nchunks( void ) const
+    {
+    return( chunks.size() ) ;
+    }
+  } ;
+
+#endif
@@ -0,0 +1,257 @@
+#ifndef BLOCKREADER_H_INCLUDED
+#define BLOCKREADER_H_INCLUDED
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <zlib.h>
+#ifdef _HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// Reads a corpus file, plain or compressed, as a plain byte stream.  The
+// format is told by the magic bytes at the start of the file, so
+// compressed data also works through stdin.  Concatenated gzip members
+// and zstd frames are read one after the other, like zcat does.  zstd
+// needs the build to define _HAVE_ZSTD and link -lzstd.
+
+class Blockreader
+  {
+  public :
+
+  enum Format_t { plainformat, gzipformat, zstdformat } ;
+
+  private :
+
+  static const uint64_t inbufsize = 1024UL * 1024UL ;
+  FILE *f ;
+  Format_t format ;
+  std::vector<unsigned char> inbuf ;  // Compressed input not yet decompressed
+  uint64_t inpos ;
+  uint64_t inlen ;
+  bool ineof ;
+  bool instream ;                     // Inside a gzip member or zstd frame
+  bool failed ;
+  z_stream zs ;
+  bool zsinit ;
+#ifdef _HAVE_ZSTD
+  ZSTD_DStream *zds ;
+#endif
+
+  // Tops up inbuf, false when the file has nothing more
+  bool fillinput( void )
+    {
+    if( inpos < inlen )
+      return( true ) ;
+    if( ineof )
+      return( false ) ;
+    inpos = 0 ;
+    inlen = fread( inbuf.data(), 1, inbufsize, f ) ;
+    if( inlen < inbufsize )
+      ineof = true ;
+    return( inlen > 0 ) ;
+    }
+
+  uint64_t readplain( char* dst, uint64_t max )
+    {
+    uint64_t n = 0 ;
+    if( inpos < inlen )                 // Bytes looked at for the magic
+      {
+      n = ( inlen - inpos < max ) ? inlen - inpos : max ;
+      memcpy( dst, &inbuf[ inpos ], n ) ;
+      inpos += n ;
+      }
+    if( n < max )
+      n += fread( dst + n, 1, max - n, f ) ;
+    return( n ) ;
+    }
+
+  uint64_t readgzip( char* dst, uint64_t max )
+    {
+    uint64_t n = 0 ;
+    while( ( n < max ) && fillinput() )
+      {
+      if( !instream )
+        {
+        inflateReset( &zs ) ;
+        instream = true ;
+        }
+      zs.next_in = &inbuf[ inpos ] ;
+      zs.avail_in = inlen - inpos ;
+      zs.next_out = ( Bytef* ) ( dst + n ) ;
+      zs.avail_out = ( max - n > UINT32_MAX ) ? UINT32_MAX : max - n ;
+      uint32_t availout = zs.avail_out ;
+      int status = inflate( &zs, Z_NO_FLUSH ) ;
+      n += availout - zs.avail_out ;
+      inpos = inlen - zs.avail_in ;
+      if( status == Z_STREAM_END )
+        instream = false ;
+      else if( ( status != Z_OK ) && ( status != Z_BUF_ERROR ) )
+        {
+        failed = true ;
+        break ;
+        }
+      }
+    if( instream && ( n < max ) && !failed )  // Input ended inside a member
+      failed = true ;
+    return( n ) ;
+    }
+
+#ifdef _HAVE_ZSTD
+  uint64_t readzstd( char* dst, uint64_t max )
+    {
+    uint64_t n = 0 ;
+    while( ( n < max ) && fillinput() )
+      {
+      ZSTD_inBuffer in = { &inbuf[ 0 ], inlen, inpos } ;
+      ZSTD_outBuffer out = { dst, max, n } ;
+      size_t status = ZSTD_decompressStream( zds, &out, &in ) ;
+      if( ZSTD_isError( status ) )
+        {
+        failed = true ;
+        break ;
+        }
+      instream = ( status != 0 ) ;
+      n = out.pos ;
+      inpos = in.pos ;
+      }
+    if( instream && ( n < max ) && !failed )
+      failed = true ;
+    return( n ) ;
+    }
+#endif
+
+  public :
+
+  Blockreader() : f( NULL ), format( plainformat ), inpos( 0 ), inlen( 0 ), ineof( false ),
+                  instream( false ), failed( false ), zsinit( false )
+    {
+#ifdef _HAVE_ZSTD
+    zds = NULL ;
+#endif
+    }
+
+  ~Blockreader()
+    {
+    close() ;
+    }
+
+  // "-" reads stdin.  false when the file cannot be opened or is in a
+  // format this build cannot read.
+  bool open( const std::string &filename )
+    {
+    close() ;
+    f = ( filename == "-" ) ? stdin : fopen( filename.c_str(), "rb" ) ;
+    if( f == NULL )
+      return( false ) ;
+
+    inbuf.resize( inbufsize ) ;
+    inpos = 0 ;
+    inlen = 0 ;
+    ineof = false ;
+    instream = false ;
+    failed = false ;
+    while( ( inlen < 4 ) && !ineof )  // Pipes may hand the magic over in pieces
+      {
+      uint64_t nread = fread( &inbuf[ inlen ], 1, 4 - inlen, f ) ;
+      if( nread == 0 )
+        ineof = true ;
+      inlen += nread ;
+      }
+
+    format = detectformat( inbuf.data(), inlen ) ;
+    if( format == gzipformat )
+      {
+      memset( &zs, 0, sizeof( zs ) ) ;
+      if( inflateInit2( &zs, 15 + 16 ) != Z_OK )  // gzip wrapper only
+        {
+        close() ;
+        return( false ) ;
+        }
+      zsinit = true ;
+      }
+    else if( format == zstdformat )
+      {
+#ifdef _HAVE_ZSTD
+      zds = ZSTD_createDStream() ;
+      if( ( zds == NULL ) || ZSTD_isError( ZSTD_initDStream( zds ) ) )
+        {
+        close() ;
+        return( false ) ;
+        }
+#else
+      std::cout << "Error:: zstd compressed input, rebuild with -D_HAVE_ZSTD and -lzstd" << std::endl ;
+      close() ;
+      return( false ) ;
+#endif
+      }
+    return( true ) ;
+    }
+
+  void close( void )
+    {
+    if( zsinit )
+      {
+      inflateEnd( &zs ) ;
+      zsinit = false ;
+      }
+#ifdef _HAVE_ZSTD
+    if( zds != NULL )
+      {
+      ZSTD_freeDStream( zds ) ;
+      zds = NULL ;
+      }
+#endif
+    if( ( f != NULL ) && ( f != stdin ) )
+      fclose( f ) ;
+    f = NULL ;
+    }
+
+  // Fills dst with up to max plain bytes, fewer only at the end of the
+  // data or on a corrupt stream
+  uint64_t read( char* dst, uint64_t max )
+    {
+    if( ( f == NULL ) || failed )
+      return( 0 ) ;
+    if( format == gzipformat )
+      return( readgzip( dst, max ) ) ;
+#ifdef _HAVE_ZSTD
+    if( format == zstdformat )
+      return( readzstd( dst, max ) ) ;
+#endif
+    return( readplain( dst, max ) ) ;
+    }
+
+  inline bool corrupt( void ) const
+    {
+    return( failed ) ;
+    }
+
+  inline Format_t fileformat( void ) const
+    {
+    return( format ) ;
+    }
+
+  static inline Format_t detectformat( const unsigned char* data, uint64_t len )
+    {
+    if( ( len >= 2 ) && ( data[ 0 ] == 0x1f ) && ( data[ 1 ] == 0x8b ) )
+      return( gzipformat ) ;
+    if( ( len >= 4 ) && ( data[ 0 ] == 0x28 ) && ( data[ 1 ] == 0xb5 ) && ( data[ 2 ] == 0x2f ) && ( data[ 3 ] == 0xfd ) )
+      return( zstdformat ) ;
+    return( plainformat ) ;
+    }
+
+  static inline const char* formatname( Format_t format )
+    {
+    if( format == gzipformat )
+      return( "gzip" ) ;
+    if( format == zstdformat )
+      return( "zstd" ) ;
+    return( "plain" ) ;
+    }
+  } ;
+
+#endif
@@ -4,6 +4,7 @@
 #include <iostream>
 #include <iomanip>
 #include <stdint.h>
+#include <math.h>
 #include <string>
 #include <vector>
 #include <map>
@@ -14,22 +15,36 @@
 #include <sys/time.h>
 #include <unordered_set>
 #include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
 #include <omp.h>
 #include "segmentedvector.h"
 #include "splitwords.h"
 #include "quadgramanchors.h"
+#include "topscores.h"
+#include "dotkernels.h"
+#include "queryhash.h"
+#include "blockreader.h"
+#include "arena.h"
+#include "vocabulary.h"
+#include "mappedarray.h"
+#include "snapshot.h"
+#include "entryformat.h"
 
 typedef struct Result_t
 	{
 	std::string part ;
 	double score ;
+	uint32_t row = 0 ;                  // Corpus row, rowline() gives its file line
 	}
 	Result_t ;
 
+// Offsets, not pointers, so the word list can live in a shared mapping
 typedef struct Wordform_t
   {
-  char* wordtext ;
-  uint32_t* rownnzs ;  // Rownnzs[ 0 ] -> the number of nonzero in this matrix row 
+  uint64_t wordtext ;  // Into wordtexts
+  uint64_t rownnzs ;   // Into wordnnzs, rownnzs[ 0 ] -> the number of nonzero in this matrix row 
   }
   Wordform_t ;
 
@@ -40,167 +55,435 @@ typedef struct Corpusform_t
   }
   Corpusform_t ;
 
+// Per query settings for the programmatic query API
+typedef struct Queryoptions_t
+  {
+  uint64_t maxresults = 200 ;         // k, number of best rows returned
+  double threshold = 0 ;              // Rows scoring below are not returned
+  bool tanimoto = false ;             // Tanimoto instead of cosine scoring
+  bool cleaninput = true ;            // Run the input through the cleaning tool
+  bool useanchorwords = true ;        // Restrict scoring to rows sharing a quadgram
+  uint32_t minoverlap = 1 ;           // Quadgrams a row must share with the input
+  uint64_t topnoverlap = 0 ;          // Keep only the n rows sharing most quadgrams, 0 -> all
+  bool derivedoverlap = false ;       // Derive minoverlap from threshold, ignore topnoverlap.  A heuristic
+                                      // that can drop rows scoring above threshold, see filteroverlap()
+  double overlapslack = 0.25 ;        // Scales the derived minoverlap
+  uint64_t batchgroupsize = 64 ;      // Queries scored together by batchquery
+  uint32_t compactnnzs = 64 ;         // Inputs with at most this many nonzeros may use the hashed query vector
+  uint64_t compactmincols = 1 << 22 ; // ... when the matrix has at least this many columns.  Off for every
+                                      // bundled corpus: up to ~2M columns the dense vector's hot columns stay
+                                      // cached and it measured as fast or faster, so this is no tuned speedup
+  }
+  Queryoptions_t ;
+
+// Per query counters, filled by every query
+typedef struct Querycounters_t
+  {
+  uint64_t inputnnzs = 0 ;            // Nonzeros in the input matrix row
+  uint64_t anchorquads = 0 ;          // Quadgrams generated from the input
+  uint64_t anchorrows = 0 ;           // Rows sharing at least one of them
+  uint32_t minoverlap = 0 ;           // Overlap a row needed to be scored
+  uint64_t rowsscored = 0 ;           // Row multiplications performed
+  uint64_t rowsabovethreshold = 0 ;   // Scored rows at or above threshold
+  double elapsed = 0 ;                // Wall time of the query in seconds
+  bool compactquery = false ;         // Scored against the hashed query vector
+  }
+  Querycounters_t ;
+
+typedef struct Queryresult_t
+  {
+  std::vector<Result_t> results ;     // Best first
+  Querycounters_t counters ;
+  }
+  Queryresult_t ;
+
+// Per query working state.  Everything a query writes lives here so that
+// any number of threads can score against one loaded corpus, each with
+// its own context.  A context is prepared by initquerycontext() and can be
+// reused for any number of queries against the same CosineHelper.  The
+// dense foldedcofs is only allocated by the first query that scatters
+// into it, a context whose queries all go compact never holds one.
+typedef struct Querycontext_t
+  {
+  int nthreads ;                      // OpenMP threads per query, 0 -> omp default
+  float inputrowmaginv ;
+  std::vector<float> foldedcofs ;     // Dense input row, tf * idf times the corpus side idf, empty until used
+  Queryhash compactcofs ;             // The same for small inputs, only their nonzero columns
+  std::vector<uint32_t> candidates ;  // Rows reachable from the input anchorwords, sorted
+  std::vector<uint32_t> colhead ;     // Batch only, first Batchweight_t of a column
+  std::vector<Topscores> threadtops ; // Top k rows per scoring thread ( and query of a batch )
+  }
+  Querycontext_t ;
+
+// One query column weight of a batch group, sorted by column
+typedef struct Batchweight_t
+  {
+  uint32_t column ;
+  uint32_t slot ;                     // Query position within the group
+  double weight ;
+  }
+  Batchweight_t ;
+
+// Switches taken when the corpus is loaded
+typedef struct Loadoptions_t
+  {
+  bool compiledrows = false ;         // Keep every row as contiguous merged nonzeros, more memory, faster scoring
+  bool bigrams = true ;               // Columns for the character bigrams of the words
+  bool trigrams = false ;             // ... and for their trigrams, 64 MB more while loading
+  uint32_t loadbuffers = 6 ;          // Blocks in flight between the load stages, at least 2
+  double idfrebase = 0.05 ;           // Inserts and deletes recompute idf once they changed this fraction of the rows
+  }
+  Loadoptions_t ;
+
+// One buffer of the load ring, handed from stage to stage in file order
+typedef struct Loadslot_t
+  {
+  std::string text ;                  // Streamed bytes, mapped blocks point into the map instead
+  const char* data = NULL ;
+  uint64_t len = 0 ;
+  bool last = false ;                 // No block follows
+  uint64_t nlines = 0 ;
+  std::vector<uint64_t> lines ;       // Begin, end pairs of the nonempty lines
+  std::vector<char*> entries ;        // Cleaned lines, in file order
+  uint32_t stage = 0 ;                // Stage the slot waits for, 0 when free for the reader
+  }
+  Loadslot_t ;
+
 typedef Segmentedvector<Corpusform_t, 1024ULL * 1024ULL> SV_corpusform ;
 typedef Segmentedvector<uint32_t, 1024ULL * 1024ULL> SV_corpusrowinfo ;
 
+// The index rewritten without its deleted rows, see preparecompaction().
+// Kept rows are renumbered in order, their file lines stay the same.
+typedef struct Compaction_t
+  {
+  uint64_t generation = 0 ;           // Of the index it was prepared from
+  SV_corpusform corpus ;
+  SV_corpusrowinfo corpusrowinfo ;
+  std::vector<uint64_t> emptylines ;  // The deleted rows' lines included
+  std::vector<uint64_t> csrrowstart ; // Compiled rows only
+  std::vector<Entry_t> csrentries ;
+  std::vector<uint32_t> quadcodes ;   // Anchor postings, see QuadgramAnchors::compacted()
+  std::vector<uint64_t> quadstarts ;
+  std::vector<Postingblock_t> quadblocks ;
+  std::vector<uint8_t> quadbytes ;
+  std::vector<uint32_t> freedwords ;  // Words no kept row uses, ascending
+  std::vector<Wordform_t> wordlist ;  // Without the freed words' texts and rows, only when some were freed
+  std::vector<char> wordtexts ;
+  std::vector<Entry_t> wordnnzs ;
+  }
+  Compaction_t ;
+
 class CosineHelper
 {
   const char* filename ;
-  float inputrowmaginv ;
   uint32_t nbigramcols ;
   uint32_t ntrigramcols ;
   uint32_t nwordcols ;
   uint32_t nmatrixcols ;
   uint64_t totalnnzs ;
+  uint64_t idfrows ;                  // Rows idf was last computed over
+  uint64_t rowschanged ;              // Rows inserted or deleted since
+  uint64_t ndeleted ;                 // Tombstoned rows, until compaction
+  uint64_t generation ;               // Bumped by every change a compaction must not miss
+  std::vector<uint64_t> tombstones ;  // Bit per deleted row, may be short of corpus.size()
+  std::vector<uint32_t> freewords ;   // Word ids no row uses, descending, addword() takes the last
 	struct timespec timetoload ;
   QuadgramAnchors anchorwords ;
   SV_corpusrowinfo corpusrowinfo ;
   SV_corpusform corpus ;
-  std::unordered_map<std::string, uint32_t> wordstolist ;
+  Vocabulary vocabulary ;             // Word ids, wordlist[ id ] is the word's matrix row
+  std::vector<std::vector<Wordtable> > wordpartials ;  // Each thread's words while collecting
   std::vector<char*> corpusdata ;
-  std::vector<Wordform_t> wordlist ;
-	std::vector<double> idf ;
-	std::vector<float> rowcofs ;
-	std::vector<uint32_t> bigramstodim ;
-  std::vector<uint32_t> trigramstodim ;
+  Mappedarray<uint64_t> emptylines ; // File lines that made no corpus row, ascending
+  std::vector<Arena> linearenas ;     // Cleaned lines of corpusdata, an arena per cleaning thread
+  Mappedarray<Wordform_t> wordlist ;
+  Mappedarray<char> wordtexts ;       // Wordlist texts, nul terminated, in word order
+  Mappedarray<Entry_t> wordnnzs ;     // Wordlist rownnzs, in word order
+	Mappedarray<double> idf ;
+  Mappedarray<uint32_t> idfcount ;    // Rows using each column, what idf is computed from
+	Mappedarray<uint32_t> bigramstodim ;
+  Mappedarray<uint32_t> trigramstodim ;
 	std::vector<uint32_t> quadgrams ;
   std::vector<uint32_t> quadgramcount ;
-  std::vector<uint8_t> anchormask ;   // When applying anchorwords
+  Querycontext_t defaultcontext ;     // Used by the interactive cosinematching
+  Mappedarray<uint64_t> csrrowstart ; // Compiled rows only, row i starts at csrentries[ csrrowstart[ i ] ]
+  Mappedarray<Entry_t> csrentries ;   // Per row a count then packed entries, like Wordform_t::rownnzs
+  Snapshotmap snapshot ;              // Mapped snapshot the arrays above are attached to, if any
 
 
 private:
 	// Loading Corpusdata
+  static const uint64_t loadreportinterval = 10000000ULL ;
+  static const uint64_t loadblocksize = 8ULL * 1024ULL * 1024ULL ;
   void loadcorpus( const char* filename ) ;
   void loadcorpus( const std::vector<std::string> &inputcorpus ) ;
-  bool readblockreadfile( FILE *f,
+  bool readblockreadfile( Blockreader &reader,
                    uint64_t preferredbufsize,
                        std::string &prereaddata,
                        std::string &buffer ) ;
   void extractpreread( std::string &preread, std::string &buffer ) ;
-  void processblock( uint64_t &nread, uint64_t &nlines,
-                       const std::string &buffer ) ;
-  void computestarts( const std::string &buf,
-                        std::vector<uint64_t> &bufstarts ) ;
-  FILE *openblockreadfile( const std::string &filename ) ;
-  void closeblockreadfile( FILE *f ) ;
-  void prepcorpus( const std::string &buf,
-                   std::vector<uint64_t> &bufstarts ) ;
+  bool mapcorpusfile( const char* filename,
+                      uint64_t &nbytesinfile,
+                      uint64_t &nlinesinfile ) ;
+  bool streamcorpusfile( const char* filename,
+                         uint64_t &nbytesinfile,
+                         uint64_t &nlinesinfile ) ;
+  void reportload( uint64_t nlinesinfile, uint64_t &nextreport ) ;
+  enum { readstage, splitstage, cleanstage, globalizestage, nloadstages } ;
+  void runloadpipeline( const std::function<void ( Loadslot_t &slot )> &fill,
+                        uint64_t &nbytesinfile,
+                        uint64_t &nlinesinfile ) ;
+  void splitblock( Loadslot_t &slot, uint64_t &nextline ) ;
+  void cleanblock( Loadslot_t &slot, int ncleaners ) ;
+  bool loadsnapshot( const char* path ) ;
   
   // Dimension words, and form data structures
   void dimensionwords() ;
+  void dimensionngrams( void ) ;
   void collectwords( ) ;
-  void formcorpus() ;
+  void formcorpus( std::vector<uint64_t> &sharestart ) ;
   
   // Form matrix rows, compute magnitudes and compute IDF
   void formmatrix( void ) ;
-  void formmatrixrow( const std::string &inputtext, std::vector<uint32_t> &sparserow ) ;
+  void formmatrixrow( const std::string &inputtext, std::vector<Entry_t> &sparserow ) const ;
   void formmatrixrow( const std::string &inputtext,
-                      std::vector<uint32_t> &sparserow,
+                      std::vector<Entry_t> &sparserow,
                       Splitwords &words,
                       std::vector<uint32_t> &bigrams ,
                       std::vector<uint32_t> &trigrams ,
                       std::vector<uint32_t> &bigramcount ,
                       std::vector<uint32_t> &trigramcount ,
                       std::vector<std::string> &uniqueword,
-                      std::vector<uint32_t> &wordcount ) ;
+                      std::vector<uint32_t> &wordcount ) const ;
   void computeidf( void ) ;
-  void idfDedup( const uint32_t* rownnzs,
+  void idfDedup( const Entry_t* rownnzs,
                  std::vector<bool> &termsusedthisrow,
                  std::vector<uint32_t> &theseterms
                  ) ;
   void computemagnitude( void ) ;
+  float rowmaginv( const std::vector<uint32_t> &unique,
+                   const std::vector<uint32_t> &count ) const ;
+  void mergerow( uint32_t rownum,
+                 std::vector<uint32_t> &unique,
+                 std::vector<uint32_t> &count ) const ;
+  void compilerows( void ) ;
+  void reportentryoverflow( const char* what, uint64_t nclamped ) const ;
+
+  // Appending rows
+  uint32_t takewordid( Wordform_t form ) ;
+  void addgramcolumns( const std::string &text ) ;
+  uint32_t addword( const char* text, uint32_t len ) ;
+  void insertrow( const char* text,
+                  std::vector<uint32_t> &unique,
+                  std::vector<uint32_t> &count ) ;
+  void rebaseifdue( void ) ;
 
   void uniquewords( const std::string &data,
                     char delim,
                     Splitwords &splitwords,
                     std::vector<std::string> &uniqueword,
-                    std::vector<uint32_t> &wordcount ) ;
+                    std::vector<uint32_t> &wordcount ) const ;
   void getuniquetrigrams( const std::string &data,
                     std::vector<uint32_t> &trigrams,
-                          std::vector<uint32_t> &trigramcount ) ;
+                          std::vector<uint32_t> &trigramcount ) const ;
   void getuniquebigrams( const std::string &data,
                            std::vector<uint32_t> &bigrams,
-                           std::vector<uint32_t> &bigramcount ) ;
+                           std::vector<uint32_t> &bigramcount ) const ;
 
   // Building anchorwords
   void buildanchorwords( void ) ;
   void generatequadgrams(  const std::string &data, 
-                            std::set<uint32_t> &myquads ) ;
+                            std::set<uint32_t> &myquads ) const ;
 
   // Cosine similarity:
-  std::vector<Result_t> score( const std::string inputtext, const std::vector<uint32_t> &inputnnzs,
-                               uint64_t maxresults, double threshold,
-                               const std::vector<uint32_t> selectedrows, bool tanimoto = false ) ;
-  double dotrow( const uint32_t* rowentries ) const ;
-  void addtotopscores( uint64_t newindex, 
-                         double newscore,
-                         std::vector<uint64_t> &rowindexes,
-                         std::vector<double> &rowscores ) const ;
-  void scatterweights( const std::vector<uint32_t> &rowentries, bool dozero ) ;
-  void scatteranchormasks( const std::string &inputtext, uint8_t value ) ;
+  std::vector<Result_t> score( const std::vector<Entry_t> &inputnnzs,
+                               const Queryoptions_t &options,
+                               const std::vector<uint32_t> &selectedrows,
+                               Querycontext_t &context,
+                               Querycounters_t &counters ) const ;
+  double dotrow( const Entry_t* rowentries, const float* foldedcofs ) const ;
+  bool scatterweights( const std::vector<Entry_t> &rowentries, bool dozero, bool compact,
+                       Querycontext_t &context ) const ;
+  int querythreads( const Querycontext_t &context ) const ;
+  double inputmaginv( const std::vector<Entry_t> &rowentries ) const ;
+  void gatheranchorrows( const std::string &inputtext,
+                         const Queryoptions_t &options,
+                         std::vector<uint32_t> &rows,
+                         Querycounters_t &counters ) const ;
+  void filteroverlap( const Queryoptions_t &options,
+                      uint64_t nanchorquads,
+                      std::vector<uint32_t> &rows,
+                      Querycounters_t &counters ) const ;
+  void batchdotrow( uint32_t rownum,
+                    const std::vector<Batchweight_t> &colweights,
+                    const uint32_t* colhead,
+                    double* dots ) const ;
+  void batchdotentries( const Entry_t* rowentries,
+                        const std::vector<Batchweight_t> &colweights,
+                        const uint32_t* colhead,
+                        double* dots ) const ;
+  void scoregroup( const std::vector<std::string> &inputs,
+                   uint64_t first,
+                   uint64_t ngroup,
+                   const Queryoptions_t &options,
+                   Querycontext_t &context,
+                   std::vector<Queryresult_t> &results ) const ;
 
   // Utilities
-  std::string getcorpustext( uint32_t index ) ;
+  std::string getcorpustext( uint32_t index ) const ;
   double f1score( Result_t cosine, Result_t tanimoto ) ;
   std::vector<Result_t> accumscores( std::vector< std::vector<Result_t> > &result, uint64_t maxresults ) ;
   std::string getquadgram( uint32_t anchorgram ) ;
-	std::vector<uint32_t> selectrows() ;
+	std::vector<uint32_t> selectrows() const ;
 	std::string getcorpusmatrixform( uint32_t rowinfoindex ) ;
 	std::string ( *cleaningtool ) ( const std::string &dirtystring ) ;
+  const Loadoptions_t loadoptions ;
+  const Dotkernel_t dotkernel ;       // Picked for the running CPU at construction
+  const Hashkernel_t hashkernel ;     // The same for the compact query vector
 	std::string defaultcleaningtool( const std::string &dirtystring ) ;
 	
+	inline const char* wordtext( uint32_t word ) const
+	  {
+	  return( wordtexts.data() + wordlist[ word ].wordtext ) ;
+	  }
+
+	inline const Entry_t* wordrow( uint32_t word ) const
+	  {
+	  return( wordnnzs.data() + wordlist[ word ].rownnzs ) ;
+	  }
+
+	inline bool isdeleted( uint32_t row ) const
+	  {
+	  return( ( ( row >> 6 ) < tombstones.size() ) && ( ( tombstones[ row >> 6 ] >> ( row & 63 ) ) & 1 ) ) ;
+	  }
+
+	inline static double idfof( uint32_t count, uint64_t nrows )
+	  {
+	  return( count > 0 ? pow( -log( count / ( double ) nrows ), 0.5 ) : 0 ) ;
+	  }
+
+	// Columns are laid out [ bigrams | trigrams | words ].  A family that is
+	// not enabled has no columns, and an enabled one only those of the grams
+	// some word of the corpus has, the others map to nocolumn.  Grams first
+	// brought in by inserted words get columns after the word columns,
+	// through textless word ids, see addgramcolumns().
+	static const uint32_t nocolumn = UINT32_MAX ;
+
 	inline uint32_t mapbigramtodim( uint32_t index ) const
 	  {
 	  const uint32_t bigramoffset = 0 ;
+	  uint32_t column = ( index < bigramstodim.size() ) ? bigramstodim[ index ] : nocolumn ;
 
-	  return( index < bigramstodim.size() ? bigramstodim[ index ] + bigramoffset : 0UL + bigramoffset ) ;
+	  return( ( column != nocolumn ) ? column + bigramoffset : nocolumn ) ;
 	  }
 
 	inline uint32_t maptrigramtodim( uint32_t index ) const
 	  {
 	  uint32_t trigramoffset = nbigramcols ;
+	  uint32_t column = ( index < trigramstodim.size() ) ? trigramstodim[ index ] : nocolumn ;
 
-	  return( index < trigramstodim.size() ? trigramstodim[ index ] + trigramoffset : 0UL + trigramoffset ) ;
+	  return( ( column != nocolumn ) ? column + trigramoffset : nocolumn ) ;
 	  }
 
 	inline uint32_t mapwordtodim( const std::string &word ) const
 	  {
 	  uint32_t wordoffset = nbigramcols + ntrigramcols ;
 
-	  std::unordered_map<std::string,uint32_t>::const_iterator it = wordstolist.find( word ) ;
-	  return( ( it != wordstolist.end() ) ? it->second + wordoffset : 0UL + wordoffset ) ;
+	  return( vocabulary.find( word ) + wordoffset ) ;
 	  }
 
-	inline static uint32_t entrycreate( uint32_t index, uint32_t weight )
+	inline static Entry_t entrycreate( uint32_t index, uint32_t weight )
 	  {
-	  if( weight > 0xff )
-	    weight = 0xff ;
-
-	  if( index > 0x00ffffff )
-	    index = 0x00ffffff ;
-
-	  return( ( weight << 24 ) | index ) ;
+	  return( Entryformat_t::create( index, weight ) ) ;
 	  }
 
-	inline static uint32_t entryindex( uint32_t entry )
+	inline static uint32_t entryindex( Entry_t entry )
 	  {
-	  return( entry & 0x00ffffff ) ;
+	  return( Entryformat_t::index( entry ) ) ;
 	  }
 
-	inline static uint32_t entryweight( uint32_t entry )
+	inline static uint32_t entryweight( Entry_t entry )
 	  {
-	  return( ( entry >> 24 ) & 0xff ) ;
+	  return( Entryformat_t::weight( entry ) ) ;
 	  }
 
 public:
 	CosineHelper() ;
 	CosineHelper( const char* file, 
-				  std::string ( *cleaner ) ( const std::string& ) ) ;
+				  std::string ( *cleaner ) ( const std::string& ),
+				  const Loadoptions_t &options = Loadoptions_t() ) ;
 	CosineHelper( const std::vector<std::string> &inputcorpus,
-                  std::string ( *cleaner ) ( const std::string& ) ) ;
+                  std::string ( *cleaner ) ( const std::string& ),
+                  const Loadoptions_t &options = Loadoptions_t() ) ;
 	~CosineHelper() ;
 	std::vector<std::vector<Result_t> > cosinematching( const std::string &input, uint64_t maxresults = 200, double threshold = 0 ) ;
+
+	// Reentrant query path, the corpus is only read.  Each concurrent caller
+	// must pass its own context, prepared once with initquerycontext().
+	// Neither call does any console I/O.
+	void initquerycontext( Querycontext_t &context, int nthreads = 0 ) const ;
+	std::vector<Result_t> cosinematching( const std::string &input,
+	                                      uint64_t maxresults,
+	                                      double threshold,
+	                                      Querycontext_t &context ) const ;
+	Queryresult_t query( const std::string &input,
+	                     const Queryoptions_t &options,
+	                     Querycontext_t &context ) const ;
+
+	// Scores many inputs per pass over the candidate rows.  Inputs are taken
+	// options.batchgroupsize at a time and every candidate row is walked once
+	// per group, against all queries of the group that reached it.
+	std::vector<Queryresult_t> batchquery( const std::vector<std::string> &inputs,
+	                                       const Queryoptions_t &options,
+	                                       Querycontext_t &context ) const ;
 	void stats( void ) ;
+	// Every dot kernel the CPU supports against the scalar one, returns the
+	// number that strayed, see check.cpp
+	int checkdotkernels( void ) const ;
+#ifdef _BENCHGRAMS
+	// Times the gram, word and row merging routines against their former
+	// versions, see bench.cpp
+	void benchgrams( void ) const ;
+#endif
+
+	// Corpus rows follow the lines of the corpus file in order, blank lines
+	// make no row.  Lines are counted from 0.  linerow() is false for a
+	// blank line or one past the end.
+	uint64_t rowline( uint32_t row ) const ;
+	bool linerow( uint64_t line, uint32_t &row ) const ;
+
+	// Writes the loaded index to path, see snapshot.h.  Constructing with a
+	// snapshot as the file maps it and uses it in place, without the four
+	// load steps, so processes serving the same snapshot share one copy.
+	// Deleted rows are compacted and rows changed since idf was computed
+	// rebased first.
+	bool savesnapshot( const char* path ) ;
+
+	// Appends each input as a row after the loaded ones, as if it were the
+	// next line of the corpus file, and returns the rows added.  New words
+	// get new columns, and so do grams no word had before.  Existing idf
+	// values are kept until the rows inserted and deleted since they were
+	// computed reach loadoptions.idfrebase of the rows, then rebaseidf()
+	// runs, so scores drift a little in between.  Nothing may query while
+	// rows are inserted.
+	uint64_t insertrows( const std::vector<std::string> &inputs ) ;
+	void rebaseidf( void ) ;
+
+	// Tombstones rows, no query returns them from then on, and returns the
+	// rows deleted.  Their idf counts go at once, their postings and
+	// storage at the next compaction.  Nothing may query meanwhile.
+	uint64_t deleterows( const std::vector<uint32_t> &rows ) ;
+
+	// Compaction drops the deleted rows from the rows, the compiled rows
+	// and the anchor postings, and frees the words no row uses any more
+	// for addword() to reuse.  Rows are renumbered, rowline() still gives
+	// each its file line.  preparecompaction() only reads and may run in
+	// a background thread while queries run.  applycompaction() swaps the
+	// result in, with no query running, and fails when rows were inserted
+	// or deleted since it was prepared.
+	void preparecompaction( Compaction_t &compaction ) const ;
+	bool applycompaction( Compaction_t &compaction ) ;
+	void compactrows( void ) ;
 } ;
 
 std::string stdcleaningtool( const std::string &dirtystring ) ;
@@ -0,0 +1,139 @@
+#ifndef DOTKERNELS_H_INCLUDED
+#define DOTKERNELS_H_INCLUDED
+
+#include <stdint.h>
+#include <immintrin.h>
+#include "entryformat.h"
+
+// Sparse-dense dot products of one packed matrix row against the folded
+// input row, foldedcofs[ column ] = input tf * idf[ column ] * idf[ column ].
+// rowentries[ 0 ] holds the number of entries, each following entry packs
+// a column and a term frequency, see entryformat.h.
+//
+// The vector kernels unpack 8 ( AVX2 ) or 16 ( AVX-512 ) entries at once,
+// gather their folded cofs and accumulate tf * cof in double lanes, so
+// they only differ from the scalar kernel in the order of the additions.
+// They are compiled with target attributes and picked once at run time,
+// the rest of the build does not need -mavx2.  They unpack the default
+// 24 + 8 bit entries, a _WIDEENTRIES build has the scalar kernel only.
+
+typedef double ( *Dotkernel_t ) ( const Entry_t* rowentries, const float* foldedcofs ) ;
+
+static inline double dotrowscalar( const Entry_t* rowentries, const float* foldedcofs )
+  {
+  double dot = 0 ;
+  uint32_t n = rowentries[ 0 ] ;
+  for( uint32_t i = 1 ; i <= n ; ++i )
+    dot += double( Entryformat_t::weight( rowentries[ i ] ) ) * foldedcofs[ Entryformat_t::index( rowentries[ i ] ) ] ;
+  return( dot ) ;
+  }
+
+#ifndef _WIDEENTRIES
+
+__attribute__(( target( "avx2,fma" ) ))
+static double dotrowavx2( const uint32_t* rowentries, const float* foldedcofs )
+  {
+  uint32_t n = rowentries[ 0 ] ;
+  const uint32_t* entries = rowentries + 1 ;
+  const __m256i indexmask = _mm256_set1_epi32( 0x00ffffff ) ;
+  __m256d sumlo = _mm256_setzero_pd() ;
+  __m256d sumhi = _mm256_setzero_pd() ;
+  uint32_t i = 0 ;
+
+  for( ; i + 8 <= n ; i += 8 )
+    {
+    __m256i packed = _mm256_loadu_si256( ( const __m256i* ) ( entries + i ) ) ;
+    __m256i index = _mm256_and_si256( packed, indexmask ) ;
+    __m256i tf = _mm256_srli_epi32( packed, 24 ) ;
+    __m256 cofs = _mm256_i32gather_ps( foldedcofs, index, 4 ) ;
+
+    sumlo = _mm256_fmadd_pd( _mm256_cvtepi32_pd( _mm256_castsi256_si128( tf ) ),
+                             _mm256_cvtps_pd( _mm256_castps256_ps128( cofs ) ), sumlo ) ;
+    sumhi = _mm256_fmadd_pd( _mm256_cvtepi32_pd( _mm256_extracti128_si256( tf, 1 ) ),
+                             _mm256_cvtps_pd( _mm256_extractf128_ps( cofs, 1 ) ), sumhi ) ;
+    }
+
+  double lanes[ 4 ] ;
+  _mm256_storeu_pd( lanes, _mm256_add_pd( sumlo, sumhi ) ) ;
+  double dot = ( lanes[ 0 ] + lanes[ 1 ] ) + ( lanes[ 2 ] + lanes[ 3 ] ) ;
+
+  for( ; i < n ; ++i )
+    dot += double( entries[ i ] >> 24 ) * foldedcofs[ entries[ i ] & 0x00ffffff ] ;
+  return( dot ) ;
+  }
+
+// GCC 12 leaves the undefined upper lanes of these intrinsics
+// uninitialized on purpose and warns about it under -Wall
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__(( target( "avx512f" ) ))
+static double dotrowavx512( const uint32_t* rowentries, const float* foldedcofs )
+  {
+  uint32_t n = rowentries[ 0 ] ;
+  const uint32_t* entries = rowentries + 1 ;
+  const __m512i indexmask = _mm512_set1_epi32( 0x00ffffff ) ;
+  __m512d sumlo = _mm512_setzero_pd() ;
+  __m512d sumhi = _mm512_setzero_pd() ;
+  uint32_t i = 0 ;
+
+  for( ; i + 16 <= n ; i += 16 )
+    {
+    __m512i packed = _mm512_loadu_si512( entries + i ) ;
+    __m512i index = _mm512_and_si512( packed, indexmask ) ;
+    __m512i tf = _mm512_srli_epi32( packed, 24 ) ;
+    __m512 cofs = _mm512_i32gather_ps( index, foldedcofs, 4 ) ;
+
+    sumlo = _mm512_fmadd_pd( _mm512_cvtepi32_pd( _mm512_castsi512_si256( tf ) ),
+                             _mm512_cvtps_pd( _mm512_castps512_ps256( cofs ) ), sumlo ) ;
+    sumhi = _mm512_fmadd_pd( _mm512_cvtepi32_pd( _mm512_extracti64x4_epi64( tf, 1 ) ),
+                             _mm512_cvtps_pd( _mm256_castpd_ps( _mm512_extractf64x4_pd( _mm512_castps_pd( cofs ), 1 ) ) ),
+                             sumhi ) ;
+    }
+
+  // Up to 15 entries left, finish them under a mask
+  if( i < n )
+    {
+    __mmask16 tail = __mmask16( ( 1U << ( n - i ) ) - 1 ) ;
+    __m512i packed = _mm512_maskz_loadu_epi32( tail, entries + i ) ;
+    __m512i index = _mm512_and_si512( packed, indexmask ) ;
+    __m512i tf = _mm512_srli_epi32( packed, 24 ) ;
+    __m512 cofs = _mm512_mask_i32gather_ps( _mm512_setzero_ps(), tail, index, foldedcofs, 4 ) ;
+
+    sumlo = _mm512_fmadd_pd( _mm512_cvtepi32_pd( _mm512_castsi512_si256( tf ) ),
+                             _mm512_cvtps_pd( _mm512_castps512_ps256( cofs ) ), sumlo ) ;
+    sumhi = _mm512_fmadd_pd( _mm512_cvtepi32_pd( _mm512_extracti64x4_epi64( tf, 1 ) ),
+                             _mm512_cvtps_pd( _mm256_castpd_ps( _mm512_extractf64x4_pd( _mm512_castps_pd( cofs ), 1 ) ) ),
+                             sumhi ) ;
+    }
+
+  return( _mm512_reduce_add_pd( _mm512_add_pd( sumlo, sumhi ) ) ) ;
+  }
+#pragma GCC diagnostic pop
+#endif
+
+// Widest kernel the running CPU supports
+static inline Dotkernel_t selectdotkernel( void )
+  {
+#ifndef _WIDEENTRIES
+  __builtin_cpu_init() ;
+  if( __builtin_cpu_supports( "avx512f" ) )
+    return( dotrowavx512 ) ;
+  if( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ) )
+    return( dotrowavx2 ) ;
+#endif
+  return( dotrowscalar ) ;
+  }
+
+static inline const char* dotkernelname( Dotkernel_t kernel )
+  {
+#ifndef _WIDEENTRIES
+  if( kernel == dotrowavx512 )
+    return( "avx512" ) ;
+  if( kernel == dotrowavx2 )
+    return( "avx2" ) ;
+#endif
+  return( "scalar" ) ;
+  }
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef ENTRYFORMAT_H_INCLUDED
+#define ENTRYFORMAT_H_INCLUDED
+
+#include <stdint.h>
+
+// A matrix nonzero packs its column and its term frequency into one
+// entry, Entry_t, and a matrix row is a count followed by its entries, all
+// of that type.  The default format keeps entries at 32 bits, a 24 bit
+// column and an 8 bit frequency, so columns stop at 16,777,215.  Built
+// with -D_WIDEENTRIES an entry takes 64 bits, a 32 bit column and a 16 bit
+// frequency, for vocabularies past that, at twice the memory for the
+// rows and with the scalar dot kernels only.  create() clamps what does
+// not fit, callers check maxindex and maxweight to report it.
+
+template<class E, unsigned indexbits, unsigned weightbits>
+struct Entryformat
+  {
+  typedef E Entry ;
+
+  static const uint32_t maxindex = uint32_t( ( uint64_t( 1 ) << indexbits ) - 1 ) ;
+  static const uint32_t maxweight = ( 1U << weightbits ) - 1 ;
+
+  static inline E create( uint32_t index, uint32_t weight )
+    {
+    if( weight > maxweight )
+      weight = maxweight ;
+    if( index > maxindex )
+      index = maxindex ;
+    return( ( E( weight ) << indexbits ) | E( index ) ) ;
+    }
+
+  static inline uint32_t index( E entry )
+    {
+    return( uint32_t( entry & E( maxindex ) ) ) ;
+    }
+
+  static inline uint32_t weight( E entry )
+    {
+    return( uint32_t( entry >> indexbits ) & maxweight ) ;
+    }
+  } ;
+
+#ifdef _WIDEENTRIES
+typedef Entryformat<uint64_t, 32, 16> Entryformat_t ;
+#else
+typedef Entryformat<uint32_t, 24, 8> Entryformat_t ;
+#endif
+typedef Entryformat_t::Entry Entry_t ;
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef MAPPEDARRAY_H_INCLUDED
+#define MAPPEDARRAY_H_INCLUDED
+
+#include <stddef.h>
+#include <vector>
+
+// A read mostly array that either owns its elements, like a std::vector,
+// or is attached to elements it does not own, typically a section of a
+// snapshot mapped read only and shared by every process that maps it.
+// Reading is the same either way, through a plain pointer.  Writing goes
+// through writable() or the vector like members, which first copy an
+// attached array into memory of its own, so a writer never touches the
+// mapping.  There is deliberately no non const operator[], reading from a
+// non const object must not copy.
+
+template<class T>
+class Mappedarray
+  {
+  private :
+
+  std::vector<T> owned ;
+  const T* items ;
+  size_t n ;
+  bool attached ;
+
+  inline void sync( void )
+    {
+    items = owned.data() ;
+    n = owned.size() ;
+    }
+
+  public :
+
+  Mappedarray() : items( NULL ), n( 0 ), attached( false )
+    {
+    }
+
+  Mappedarray( const Mappedarray &other ) : owned( other.owned ), items( other.items ),
+                                            n( other.n ), attached( other.attached )
+    {
+    if( !attached )
+      sync() ;
+    }
+
+  Mappedarray &operator=( const Mappedarray &rhs )
+    {
+    if( this != &rhs )
+      {
+      owned = rhs.owned ;
+      items = rhs.items ;
+      n = rhs.n ;
+      attached = rhs.attached ;
+      if( !attached )
+        sync() ;
+      }
+    return( *this ) ;
+    }
+
+  // Uses count elements at data in place, data must outlive the array
+  // or the next attach(), detach() or write
+  void attach( const T* data, size_t count )
+    {
+    std::vector<T>().swap( owned ) ;
+    items = data ;
+    n = count ;
+    attached = true ;
+    }
+
+  // Copies attached elements into memory of its own
+  void detach( void )
+    {
+    if( attached )
+      {
+      owned.assign( items, items + n ) ;
+      attached = false ;
+      sync() ;
+      }
+    }
+
+  inline bool mapped( void ) const
+    {
+    return( attached ) ;
+    }
+
+  inline const T &operator[] ( size_t i ) const
+    {
+    return( items[ i ] ) ;
+    }
+
+  inline const T* data( void ) const
+    {
+    return( items ) ;
+    }
+
+  inline const T* begin( void ) const
+    {
+    return( items ) ;
+    }
+
+  inline const T* end( void ) const
+    {
+    return( items + n ) ;
+    }
+
+  inline size_t size( void ) const
+    {
+    return( n ) ;
+    }
+
+  inline bool empty( void ) const
+    {
+    return( n == 0 ) ;
+    }
+
+  // The elements for writing, copied first when attached.  Once owned
+  // this changes nothing, threads may call it together.
+  inline T* writable( void )
+    {
+    detach() ;
+    return( owned.data() ) ;
+    }
+
+  void resize( size_t count, const T &val = T() )
+    {
+    detach() ;
+    owned.resize( count, val ) ;
+    sync() ;
+    }
+
+  void assign( size_t count, const T &val )
+    {
+    attached = false ;
+    owned.assign( count, val ) ;
+    sync() ;
+    }
+
+  template<class I> void assign( I first, I last )
+    {
+    attached = false ;
+    owned.assign( first, last ) ;
+    sync() ;
+    }
+
+  void push_back( const T &val )
+    {
+    detach() ;
+    owned.push_back( val ) ;
+    sync() ;
+    }
+
+  // Takes over a vector built elsewhere, handing back the old elements
+  // when they were owned
+  void swap( std::vector<T> &other )
+    {
+    if( attached )
+      std::vector<T>().swap( owned ) ;
+    owned.swap( other ) ;
+    attached = false ;
+    sync() ;
+    }
+
+  void clear( void )
+    {
+    std::vector<T>().swap( owned ) ;
+    attached = false ;
+    sync() ;
+    }
+
+  // Bytes held privately, nothing for an attached array
+  inline size_t bytesowned( void ) const
+    {
+    return( attached ? 0 : owned.capacity() * sizeof( T ) ) ;
+    }
+  } ;
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef POSTINGCODEC_H_INCLUDED
+#define POSTINGCODEC_H_INCLUDED
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <immintrin.h>
+
+// Compressed posting lists.  A sorted list of rows is cut into blocks of
+// postingblocksize rows.  The block header keeps the first row and where
+// the block's bytes start, so every block decodes on its own and a
+// reader can skip whole blocks.  The bytes are the gaps between the
+// following rows in StreamVByte layout: a control byte per 4 gaps, 2 bits
+// each giving a gap's length of 1 to 4 bytes, then the gaps' low bytes.
+// The 128 bit decoder turns the 4 gaps of a control byte into rows with
+// one shuffle and a prefix sum.  It reads 16 bytes at a time, so a byte
+// stream always ends in postingpadding zero bytes, see finishpostings().
+
+static const uint32_t postingblocksize = 128 ;
+static const uint32_t postingpadding = 16 ;
+
+typedef struct Postingblock_t
+  {
+  uint64_t bytes ;                    // Offset of the control bytes
+  uint32_t first ;                    // First row
+  uint32_t n ;                        // Rows, 1 to postingblocksize
+  }
+  Postingblock_t ;
+
+typedef void ( *Postingdecoder_t ) ( const uint8_t* bytes, uint32_t first, uint32_t n, uint32_t* rows ) ;
+
+static inline uint32_t postinggaplength( const uint8_t* control, uint32_t i )
+  {
+  return( ( ( control[ i >> 2 ] >> ( 2 * ( i & 3 ) ) ) & 3 ) + 1 ) ;
+  }
+
+// Bytes a block of n rows takes, control bytes included
+static inline uint64_t postingblocklength( const uint8_t* bytes, uint32_t n )
+  {
+  uint32_t ngaps = n - 1 ;
+  uint64_t length = ( ngaps + 3 ) / 4 ;
+  for( uint32_t i = 0 ; i < ngaps ; ++i )
+    length += postinggaplength( bytes, i ) ;
+  return( length ) ;
+  }
+
+// Appends the blocks of the n sorted rows
+static inline void encodepostings( const uint32_t* rows, uint64_t n,
+                                   std::vector<Postingblock_t> &blocks,
+                                   std::vector<uint8_t> &bytes )
+  {
+  for( uint64_t start = 0 ; start < n ; start += postingblocksize )
+    {
+    uint32_t m = ( n - start < postingblocksize ) ? n - start : postingblocksize ;
+    Postingblock_t block = { bytes.size(), rows[ start ], m } ;
+    blocks.push_back( block ) ;
+
+    uint64_t at = bytes.size() ;
+    bytes.resize( at + ( m + 2 ) / 4 + 4 * ( m - 1 ), 0 ) ;  // Trimmed to what the gaps take
+    uint8_t* control = bytes.data() + at ;
+    uint8_t* data = control + ( m + 2 ) / 4 ;
+    for( uint32_t i = 1 ; i < m ; ++i )
+      {
+      uint32_t gap = rows[ start + i ] - rows[ start + i - 1 ] ;
+      uint32_t length = ( gap < ( 1U << 8 ) ) ? 1 : ( gap < ( 1U << 16 ) ) ? 2 : ( gap < ( 1U << 24 ) ) ? 3 : 4 ;
+      control[ ( i - 1 ) / 4 ] |= ( length - 1 ) << ( 2 * ( ( i - 1 ) & 3 ) ) ;
+      for( uint32_t k = 0 ; k < length ; ++k )
+        *data++ = ( gap >> ( 8 * k ) ) & 0xff ;
+      }
+    bytes.resize( data - bytes.data() ) ;
+    }
+  }
+
+// Pads a finished byte stream for the vector decoder
+static inline void finishpostings( std::vector<uint8_t> &bytes )
+  {
+  bytes.resize( bytes.size() + postingpadding, 0 ) ;
+  }
+
+static void decodepostingsscalar( const uint8_t* bytes, uint32_t first, uint32_t n, uint32_t* rows )
+  {
+  const uint8_t* control = bytes ;
+  const uint8_t* data = bytes + ( n + 2 ) / 4 ;
+  uint32_t row = first ;
+  rows[ 0 ] = row ;
+  for( uint32_t i = 0 ; i + 1 < n ; ++i )
+    {
+    uint32_t length = postinggaplength( control, i ) ;
+    uint32_t gap = 0 ;
+    for( uint32_t k = 0 ; k < length ; ++k )
+      gap |= uint32_t( data[ k ] ) << ( 8 * k ) ;
+    data += length ;
+    row += gap ;
+    rows[ i + 1 ] = row ;
+    }
+  }
+
+// Shuffle that spreads the gaps of a control byte to 4 lanes, and the
+// bytes they take
+typedef struct Postingshuffles_t
+  {
+  uint8_t masks[ 256 ][ 16 ] ;
+  uint8_t lengths[ 256 ] ;
+
+  Postingshuffles_t()
+    {
+    for( uint32_t c = 0 ; c < 256 ; ++c )
+      {
+      uint32_t at = 0 ;
+      for( uint32_t lane = 0 ; lane < 4 ; ++lane )
+        {
+        uint32_t length = ( ( c >> ( 2 * lane ) ) & 3 ) + 1 ;
+        for( uint32_t k = 0 ; k < 4 ; ++k )
+          masks[ c ][ 4 * lane + k ] = ( k < length ) ? at + k : 0x80 ;
+        at += length ;
+        }
+      lengths[ c ] = at ;
+      }
+    }
+  }
+  Postingshuffles_t ;
+
+__attribute__(( target( "ssse3" ) ))
+static void decodepostingsssse3( const uint8_t* bytes, uint32_t first, uint32_t n, uint32_t* rows )
+  {
+  static const Postingshuffles_t shuffles ;
+  uint32_t ngaps = n - 1 ;
+  const uint8_t* control = bytes ;
+  const uint8_t* data = bytes + ( ngaps + 3 ) / 4 ;
+  __m128i previous = _mm_set1_epi32( first ) ;
+  rows[ 0 ] = first ;
+  uint32_t i = 0 ;
+
+  for( ; i + 4 <= ngaps ; i += 4 )
+    {
+    uint8_t c = control[ i >> 2 ] ;
+    __m128i gaps = _mm_shuffle_epi8( _mm_loadu_si128( ( const __m128i* ) data ),
+                                     _mm_loadu_si128( ( const __m128i* ) shuffles.masks[ c ] ) ) ;
+    data += shuffles.lengths[ c ] ;
+    gaps = _mm_add_epi32( gaps, _mm_slli_si128( gaps, 4 ) ) ;
+    gaps = _mm_add_epi32( gaps, _mm_slli_si128( gaps, 8 ) ) ;
+    previous = _mm_add_epi32( gaps, previous ) ;
+    _mm_storeu_si128( ( __m128i* ) ( rows + i + 1 ), previous ) ;
+    previous = _mm_shuffle_epi32( previous, 0xff ) ;
+    }
+
+  uint32_t row = rows[ i ] ;
+  for( ; i < ngaps ; ++i )
+    {
+    uint32_t length = postinggaplength( control, i ) ;
+    uint32_t gap = 0 ;
+    for( uint32_t k = 0 ; k < length ; ++k )
+      gap |= uint32_t( data[ k ] ) << ( 8 * k ) ;
+    data += length ;
+    row += gap ;
+    rows[ i + 1 ] = row ;
+    }
+  }
+
+static inline Postingdecoder_t selectpostingdecoder( void )
+  {
+  __builtin_cpu_init() ;
+  if( __builtin_cpu_supports( "ssse3" ) )
+    return( decodepostingsssse3 ) ;
+  return( decodepostingsscalar ) ;
+  }
+
+#endif
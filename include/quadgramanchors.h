@@ -5,6 +5,57 @@
 #include <mutex>
 #include <atomic>
 #include <memory>
+#include <unordered_set>
+#include <unordered_map>
+#include <malloc.h>
+#include "mappedarray.h"
+#include "postingcodec.h"
+
+// The rows of one quad, ascending, pointing into the anchors.  Lists of
+// the nested build and those rows were appended to are plain arrays,
+// rows is set.  Frozen lists are compressed blocks, see postingcodec.h.
+typedef struct Postinglist_t
+  {
+  const uint32_t* rows ;
+  uint64_t n ;
+  const Postingblock_t* blocks ;
+  uint64_t nblocks ;
+  const uint8_t* bytes ;
+  Postingdecoder_t decoder ;
+
+  inline uint64_t size( void ) const
+    {
+    return( n ) ;
+    }
+
+  // Appends the rows to out
+  void appendto( std::vector<uint32_t> &out ) const
+    {
+    if( rows != NULL )
+      {
+      out.insert( out.end(), rows, rows + n ) ;
+      return ;
+      }
+    uint64_t at = out.size() ;
+    out.resize( at + n ) ;
+    for( uint64_t b = 0 ; b < nblocks ; ++b )
+      {
+      decoder( bytes + blocks[ b ].bytes, blocks[ b ].first, blocks[ b ].n, out.data() + at ) ;
+      at += blocks[ b ].n ;
+      }
+    }
+  }
+  Postinglist_t ;
+
+// Quads are associated with rows in nested per slot vectors, then
+// freeze() moves the posting lists into flat arrays, every quad in
+// ascending order with a start into one array of compressed blocks, and
+// the blocks into one array of bytes.  Frozen arrays hold no pointers,
+// so they can be attached to a mapped snapshot and shared.
+// associaterow(), compactor() and sortrows() are for the nested build
+// only.  Rows appended later, appendrow(), go to a whole private copy of
+// each posting list they touch until fold() merges those back into the
+// flat arrays.
 
 class QuadgramAnchors
   {
@@ -16,6 +67,54 @@ class QuadgramAnchors
   std::vector<std::vector<std::vector<uint32_t> > > quadtorows ;  // indicates rows involving a particular quad
   std::unordered_set<uint32_t> discard ;
   const uint32_t thresh ;
+  bool frozen ;
+  Mappedarray<uint32_t> quadcodes ;   // Frozen, every quad ascending
+  Mappedarray<uint64_t> quadstarts ;  // Frozen, quadcodes.size() + 1, quad i's blocks start at quadblocks[ quadstarts[ i ] ]
+  Mappedarray<Postingblock_t> quadblocks ;
+  Mappedarray<uint8_t> quadbytes ;    // Frozen, every block's bytes, then the padding
+  Mappedarray<uint32_t> discards ;    // Frozen, ascending
+  std::vector<uint32_t> slotstart ;   // Frozen, first quad of each top slot and one more
+  std::unordered_map<uint32_t, std::vector<uint32_t> > grown ;  // Frozen, lists rows were appended to since fold()
+  const Postingdecoder_t decoder ;
+
+  Postinglist_t frozenrows( uint32_t quadcode ) const
+    {
+    uint32_t slot = quadcode >> 16 ;
+    Postinglist_t found = { NULL, 0, NULL, 0, NULL, decoder } ;
+    const uint32_t* first = quadcodes.data() + slotstart[ slot ] ;
+    const uint32_t* last = quadcodes.data() + slotstart[ slot + 1 ] ;
+    const uint32_t* it = std::lower_bound( first, last, quadcode ) ;
+    if( ( it != last ) && ( *it == quadcode ) )
+      {
+      uint64_t q = it - quadcodes.data() ;
+      found.blocks = quadblocks.data() + quadstarts[ q ] ;
+      found.nblocks = quadstarts[ q + 1 ] - quadstarts[ q ] ;
+      found.bytes = quadbytes.data() ;
+      if( found.nblocks > 0 )         // Discarded quads keep an empty list
+        found.n = ( found.nblocks - 1 ) * postingblocksize + found.blocks[ found.nblocks - 1 ].n ;
+      }
+    return( found ) ;
+    }
+
+  // Grown quads without a flat list, ascending
+  std::vector<uint32_t> newquads( void ) const
+    {
+    std::vector<uint32_t> codes ;
+    for( std::unordered_map<uint32_t, std::vector<uint32_t> >::const_iterator it = grown.begin() ; it != grown.end() ; ++it )
+      if( frozenrows( it->first ).blocks == NULL )
+        codes.push_back( it->first ) ;
+    std::sort( codes.begin(), codes.end() ) ;
+    return( codes ) ;
+    }
+
+  void indexslots( void )
+    {
+    slotstart.assign( ntopslots + 1, 0 ) ;
+    for( uint64_t q = 0 ; q < quadcodes.size() ; ++q )
+      ++slotstart[ ( quadcodes[ q ] >> 16 ) + 1 ] ;
+    for( uint32_t i = 0 ; i < ntopslots ; ++i )
+      slotstart[ i + 1 ] += slotstart[ i ] ;
+    }
 
 
   private:
@@ -61,7 +160,8 @@ class QuadgramAnchors
 
   public :
 
-  QuadgramAnchors( const uint32_t cutoff = UINT32_MAX ) : thresh( cutoff )
+  QuadgramAnchors( const uint32_t cutoff = UINT32_MAX ) : thresh( cutoff ), frozen( false ),
+                                                     decoder( selectpostingdecoder() )
     {
     for( uint32_t i = 0 ; i < ntopslots ; ++i )
       toplocks[ i ] = false ;
@@ -79,6 +179,8 @@ class QuadgramAnchors
 
   uint32_t size( void ) const
     {
+    if( frozen )
+      return quadcodes.size() + newquads().size() ;
     uint32_t sum = 0;
     for( uint32_t i = 0 ; i < ntopslots ; ++i )
       sum += quadsused[ i ].size() ;
@@ -87,6 +189,13 @@ class QuadgramAnchors
 
   std::vector<uint32_t> getusedvecs( void ) const 
     {
+    if( frozen )
+      {
+      std::vector<uint32_t> added = newquads() ;
+      std::vector<uint32_t> codes( quadcodes.size() + added.size() ) ;
+      std::merge( quadcodes.begin(), quadcodes.end(), added.begin(), added.end(), codes.begin() ) ;
+      return codes ;
+      }
     std::vector<uint32_t> usedvecs ;
     uint32_t quadsusedsize = quadsused.size() ;
     for( uint32_t i = 0 ; i < quadsusedsize ; ++i )
@@ -129,7 +238,7 @@ class QuadgramAnchors
 
   inline uint32_t getdiscardcount( void )
     {
-    return discard.size() ;
+    return frozen ? discards.size() : discard.size() ;
     }
 
   void compactor( void )
@@ -169,6 +278,19 @@ class QuadgramAnchors
     std::cout<<"Total capacity saved -> "<<total<<std::endl ;
     }
 
+  // Rows are associated from many threads, sort each posting list once
+  // built so candidate rows can be merged instead of masked
+  void sortrows( void )
+    {
+#pragma omp parallel for schedule( dynamic, 64 )
+    for( uint32_t i = 0 ; i < ntopslots ; ++i )
+      {
+      uint32_t level2size = quadtorows[ i ].size() ;
+      for( uint32_t j = 0 ; j < level2size ; ++j )
+        std::sort( quadtorows[ i ][ j ].begin(), quadtorows[ i ][ j ].end() ) ;
+      }
+    }
+
   void associaterow( uint32_t code, uint32_t rownum, bool force )
     {
     uint8_t c1 ;
@@ -185,21 +307,40 @@ class QuadgramAnchors
       }
     }
 
-  const std::vector<uint32_t> &getquadrows( uint8_t c1, uint8_t c2, uint8_t c3, uint8_t c4 )
+  Postinglist_t getquadrows( uint8_t c1, uint8_t c2, uint8_t c3, uint8_t c4 ) const
     {
     uint32_t slot = getslots( c1, c2, c3, c4 ) ;
-    static const std::vector<uint32_t> empty ;
-
     uint32_t quadcode = genquadcode( c1, c2, c3, c4 ) ;
-    // Find quad in the used quads (like a binary search)
-    std::vector<uint32_t>::iterator it = lower_bound( quadsused[ slot ].begin(),
-                                                      quadsused[ slot ].end(), quadcode ) ;
+    Postinglist_t found = { NULL, 0, NULL, 0, NULL, decoder } ;
+
+    if( frozen )
+      {
+      if( !grown.empty() )
+        {
+        std::unordered_map<uint32_t, std::vector<uint32_t> >::const_iterator it = grown.find( quadcode ) ;
+        if( it != grown.end() )
+          {
+          found.rows = it->second.data() ;
+          found.n = it->second.size() ;
+          return( found ) ;
+          }
+        }
+      return( frozenrows( quadcode ) ) ;
+      }
 
-    return( ( ( it == quadsused[ slot ].end() ) || ( *it != quadcode ) ) ? empty
-                : quadtorows[ slot ][ it - quadsused[ slot ].begin() ] ) ;
+    // Find quad in the used quads (like a binary search)
+    std::vector<uint32_t>::const_iterator it = lower_bound( quadsused[ slot ].begin(),
+                                                            quadsused[ slot ].end(), quadcode ) ;
+    if( ( it != quadsused[ slot ].end() ) && ( *it == quadcode ) )
+      {
+      const std::vector<uint32_t> &rows = quadtorows[ slot ][ it - quadsused[ slot ].begin() ] ;
+      found.rows = rows.data() ;
+      found.n = rows.size() ;
+      }
+    return( found ) ;
     }
 
-  const std::vector<uint32_t> &getquadrows( uint32_t code )
+  Postinglist_t getquadrows( uint32_t code ) const
     {
     uint8_t c1 ;
     uint8_t c2 ;
@@ -209,23 +350,228 @@ class QuadgramAnchors
     return getquadrows( c1, c2, c3, c4 ) ;
     }
 
+  // Moves the nested posting lists into the flat arrays, a slot at a
+  // time so the two are never both whole in memory
+  void freeze( void )
+    {
+    uint64_t nquads = 0 ;
+    uint64_t nrows = 0 ;
+    for( uint32_t i = 0 ; i < ntopslots ; ++i )
+      {
+      nquads += quadsused[ i ].size() ;
+      for( uint32_t j = 0 ; j < quadtorows[ i ].size() ; ++j )
+        nrows += quadtorows[ i ][ j ].size() ;
+      }
+
+    std::vector<uint32_t> codes ;
+    std::vector<uint64_t> starts ;
+    std::vector<Postingblock_t> blocks ;
+    std::vector<uint8_t> bytes ;
+    codes.reserve( nquads ) ;
+    starts.reserve( nquads + 1 ) ;
+    bytes.reserve( nrows + nrows / 4 ) ;  // Every gap takes a byte at least
+    starts.push_back( 0 ) ;
+    for( uint32_t i = 0 ; i < ntopslots ; ++i )
+      {
+      for( uint32_t j = 0 ; j < quadsused[ i ].size() ; ++j )
+        {
+        codes.push_back( quadsused[ i ][ j ] ) ;
+        encodepostings( quadtorows[ i ][ j ].data(), quadtorows[ i ][ j ].size(), blocks, bytes ) ;
+        starts.push_back( blocks.size() ) ;
+        }
+      std::vector<uint32_t>().swap( quadsused[ i ] ) ;
+      std::vector<std::vector<uint32_t> >().swap( quadtorows[ i ] ) ;
+      if( ( i + 1 ) % 4096 == 0 )
+        malloc_trim( 0 ) ;            // Hand the freed lists back as the flat ones fill
+      }
+
+    std::vector<uint32_t> sorteddiscards( discard.begin(), discard.end() ) ;
+    std::sort( sorteddiscards.begin(), sorteddiscards.end() ) ;
+    std::unordered_set<uint32_t>().swap( discard ) ;
+
+    finishpostings( bytes ) ;
+    quadcodes.swap( codes ) ;
+    quadstarts.swap( starts ) ;
+    quadblocks.swap( blocks ) ;
+    quadbytes.swap( bytes ) ;
+    discards.swap( sorteddiscards ) ;
+    indexslots() ;
+    frozen = true ;
+    }
+
+  // Uses frozen arrays kept elsewhere, as laid out by freeze(), in place
+  void attach( const uint32_t* codes, const uint64_t* starts, uint64_t nquads,
+               const Postingblock_t* blocks, uint64_t nblocks,
+               const uint8_t* bytes, uint64_t nbytes,
+               const uint32_t* discarded, uint64_t ndiscarded )
+    {
+    for( uint32_t i = 0 ; i < ntopslots ; ++i )
+      {
+      std::vector<uint32_t>().swap( quadsused[ i ] ) ;
+      std::vector<std::vector<uint32_t> >().swap( quadtorows[ i ] ) ;
+      }
+    std::unordered_set<uint32_t>().swap( discard ) ;
+
+    quadcodes.attach( codes, nquads ) ;
+    quadstarts.attach( starts, nquads + 1 ) ;
+    quadblocks.attach( blocks, nblocks ) ;
+    quadbytes.attach( bytes, nbytes ) ;
+    discards.attach( discarded, ndiscarded ) ;
+    indexslots() ;
+    frozen = true ;
+    }
+
+  inline bool isfrozen( void ) const
+    {
+    return( frozen ) ;
+    }
+
+  // Frozen only.  Posts rownum, past every row posted so far, under
+  // code unless the build discarded code and force is not set.  Lists
+  // are not cut at the cutoff any more, a rebuild applies it again.
+  bool appendrow( uint32_t code, uint32_t rownum, bool force )
+    {
+    if( !force && std::binary_search( discards.begin(), discards.end(), code ) )
+      return( false ) ;
+
+    std::unordered_map<uint32_t, std::vector<uint32_t> >::iterator it = grown.find( code ) ;
+    if( it == grown.end() )
+      {
+      it = grown.insert( std::make_pair( code, std::vector<uint32_t>() ) ).first ;
+      frozenrows( code ).appendto( it->second ) ;
+      }
+    it->second.push_back( rownum ) ;
+    return( true ) ;
+    }
+
+  // Posting lists appended to since the last fold()
+  inline uint64_t ngrown( void ) const
+    {
+    return( grown.size() ) ;
+    }
+
+  // The flat and the appended lists merged into new flat arrays.  When
+  // newrow is given rows are renumbered through it, those it maps to
+  // UINT32_MAX are left out and so are quads left without rows.  The
+  // renumbering must keep the rows in order.  Reads only.
+  void compacted( const uint32_t* newrow,
+                  std::vector<uint32_t> &codes,
+                  std::vector<uint64_t> &starts,
+                  std::vector<Postingblock_t> &blocks,
+                  std::vector<uint8_t> &bytes ) const
+    {
+    std::vector<uint32_t> added = newquads() ;
+    uint64_t nquads = quadcodes.size() + added.size() ;
+    codes.resize( nquads ) ;
+    std::merge( quadcodes.begin(), quadcodes.end(), added.begin(), added.end(), codes.begin() ) ;
+
+    starts.clear() ;
+    blocks.clear() ;
+    bytes.clear() ;
+    starts.reserve( nquads + 1 ) ;
+    blocks.reserve( quadblocks.size() ) ;
+    bytes.reserve( quadbytes.size() ) ;
+    starts.push_back( 0 ) ;
+    uint64_t nkept = 0 ;
+    std::vector<uint32_t> rows ;
+    for( uint64_t q = 0 ; q < nquads ; ++q )
+      {
+      std::unordered_map<uint32_t, std::vector<uint32_t> >::const_iterator it = grown.find( codes[ q ] ) ;
+      rows.clear() ;
+      if( it != grown.end() )
+        rows = it->second ;
+      else
+        frozenrows( codes[ q ] ).appendto( rows ) ;
+
+      if( newrow != NULL )
+        {
+        uint64_t n = 0 ;
+        for( uint64_t i = 0 ; i < rows.size() ; ++i )
+          if( newrow[ rows[ i ] ] != UINT32_MAX )
+            rows[ n++ ] = newrow[ rows[ i ] ] ;
+        rows.resize( n ) ;
+        }
+
+      if( !rows.empty() )
+        {
+        encodepostings( rows.data(), rows.size(), blocks, bytes ) ;
+        codes[ nkept++ ] = codes[ q ] ;
+        starts.push_back( blocks.size() ) ;
+        }
+      }
+    codes.resize( nkept ) ;
+    finishpostings( bytes ) ;
+    }
+
+  // Takes over arrays built by compacted(), the appended lists go
+  void replace( std::vector<uint32_t> &codes,
+                std::vector<uint64_t> &starts,
+                std::vector<Postingblock_t> &blocks,
+                std::vector<uint8_t> &bytes )
+    {
+    grown.clear() ;
+    quadcodes.swap( codes ) ;
+    quadstarts.swap( starts ) ;
+    quadblocks.swap( blocks ) ;
+    quadbytes.swap( bytes ) ;
+    indexslots() ;
+    }
+
+  // Merges the appended lists back into the flat arrays, which become
+  // private if they were attached
+  void fold( void )
+    {
+    if( grown.empty() )
+      return ;
+
+    std::vector<uint32_t> codes ;
+    std::vector<uint64_t> starts ;
+    std::vector<Postingblock_t> blocks ;
+    std::vector<uint8_t> bytes ;
+    compacted( NULL, codes, starts, blocks, bytes ) ;
+    replace( codes, starts, blocks, bytes ) ;
+    }
+
+  // The frozen arrays, for snapshots, without what fold() has not merged
+  inline const Mappedarray<uint32_t> &getquadcodes( void ) const
+    {
+    return( quadcodes ) ;
+    }
+
+  inline const Mappedarray<uint64_t> &getquadstarts( void ) const
+    {
+    return( quadstarts ) ;
+    }
+
+  inline const Mappedarray<Postingblock_t> &getquadblocks( void ) const
+    {
+    return( quadblocks ) ;
+    }
+
+  inline const Mappedarray<uint8_t> &getquadbytes( void ) const
+    {
+    return( quadbytes ) ;
+    }
+
+  inline const Mappedarray<uint32_t> &getdiscards( void ) const
+    {
+    return( discards ) ;
+    }
+
   void stats( void )
     {
     // should use locks here
+    std::vector<uint32_t> codes = getusedvecs() ;
     std::cout<<"\nTotal size of Quads -> "<<size()<<std::endl<<std::endl ;
-    for( uint32_t i = 0 ; i < ntopslots ; ++i )
+    for( uint64_t q = 0 ; q < codes.size() ; ++q )
       { 
-      uint32_t quadsize = quadsused[ i ].size() ;
-      for( uint32_t j = 0 ; j < quadsize ; ++j )
-        { 
-        std::cout<<"Quadgrams \"" ;
-        inversequadcodereadable(quadsused[ i ][ j ]) ;
-        std::cout<<"\""<<" nrows: "<<quadtorows[ i ][ j ].size()<<std::endl ;
-        // std::cout<<"QuadIndexes -> \t\t" ; 
-        // for( uint32_t k = 0 ; k < quadtorows[ i ][ j ].size() ; ++k )
-        //   std::cout<<quadtorows[ i ][ j ][ k ]<<" " ;
-        // std::cout<<std::endl ;
-        }
+      std::cout<<"Quadgrams \"" ;
+      inversequadcodereadable( codes[ q ] ) ;
+      std::cout<<"\""<<" nrows: "<<getquadrows( codes[ q ] ).size()<<std::endl ;
+      // std::cout<<"QuadIndexes -> \t\t" ; 
+      // for( uint32_t k = 0 ; k < quadtorows[ i ][ j ].size() ; ++k )
+      //   std::cout<<quadtorows[ i ][ j ][ k ]<<" " ;
+      // std::cout<<std::endl ;
       }
     }
   } ;
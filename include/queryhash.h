@@ -0,0 +1,257 @@
+#ifndef QUERYHASH_H_INCLUDED
+#define QUERYHASH_H_INCLUDED
+
+#include <vector>
+#include <stdint.h>
+#include <immintrin.h>
+#include "entryformat.h"
+
+// Compact query vector, a hash of the input's few dozen nonzero columns
+// to their folded cofs.  place() picks the multiplier and power of two
+// size so that every input column sits in its own home slot, a lookup is
+// then one probe: the column is in the input exactly when its home slot
+// holds it.  Tables start at 4 slots per column, so 32 nonzeros take 1KB,
+// and are capped at 32KB so they stay in L1 while a corpus row probes
+// them, where the dense foldedcofs spans every matrix column.  Inputs
+// that do not fit are left to the dense vector.
+
+class Queryhash
+  {
+  private :
+
+  static const uint32_t nmultipliers = 8 ;
+  static const uint32_t maxbits = 12 ;
+  std::vector<uint32_t> keys ;        // Column held by each slot, emptycolumn when unused
+  std::vector<float> values ;
+  std::vector<uint32_t> columns ;     // Input columns and cofs until placed
+  std::vector<float> cofs ;
+  uint32_t multiplier ;
+  uint32_t shift ;
+
+  static inline uint32_t multipliers( uint32_t i )
+    {
+    static const uint32_t odd[ nmultipliers ] = { 0x9e3779b1U, 0x85ebca6bU, 0xc2b2ae35U, 0x27d4eb2fU,
+                                                  0x165667b1U, 0xd3a2646dU, 0xfd7046c5U, 0xb55a4f09U } ;
+    return( odd[ i ] ) ;
+    }
+
+  public :
+
+  static const uint32_t emptycolumn = UINT32_MAX ;
+
+  Queryhash() : multiplier( 0 ), shift( 32 )
+    {
+    }
+
+  // Starts a new input, columns are added then place()d
+  void reset( void )
+    {
+    columns.clear() ;
+    cofs.clear() ;
+    }
+
+  // Adds to the cof of column, the input has few columns so a scan will do
+  inline void add( uint32_t column, float cof )
+    {
+    uint32_t n = columns.size() ;
+    for( uint32_t i = 0 ; i < n ; ++i )
+      if( columns[ i ] == column )
+        {
+        cofs[ i ] += cof ;
+        return ;
+        }
+    columns.push_back( column ) ;
+    cofs.push_back( cof ) ;
+    }
+
+  // Lays the added columns out collision free, growing the table until a
+  // multiplier separates them all.  false when the table would outgrow
+  // maxbits, the input is then better served by the dense vector.
+  bool place( void )
+    {
+    uint32_t n = columns.size() ;
+    uint32_t bits = 6 ;
+    while( ( 1U << bits ) < 4 * n )
+      ++bits ;
+
+    for( ; bits <= maxbits ; ++bits )
+      {
+      keys.assign( 1U << bits, uint32_t( emptycolumn ) ) ;
+      values.assign( 1U << bits, 0 ) ;
+      shift = 32 - bits ;
+      for( uint32_t m = 0 ; m < nmultipliers ; ++m )
+        {
+        multiplier = multipliers( m ) ;
+        uint32_t i ;
+        for( i = 0 ; i < n ; ++i )
+          {
+          uint32_t slot = home( columns[ i ] ) ;
+          if( keys[ slot ] != emptycolumn )
+            break ;
+          keys[ slot ] = columns[ i ] ;
+          values[ slot ] = cofs[ i ] ;
+          }
+        if( i == n )
+          return( true ) ;
+
+        for( uint32_t j = 0 ; j < i ; ++j )
+          {
+          keys[ home( columns[ j ] ) ] = emptycolumn ;
+          values[ home( columns[ j ] ) ] = 0 ;
+          }
+        }
+      }
+    return( false ) ;
+    }
+
+  inline uint32_t size( void ) const
+    {
+    return( columns.size() ) ;
+    }
+
+  inline uint32_t home( uint32_t column ) const
+    {
+    return( ( column * multiplier ) >> shift ) ;
+    }
+
+  inline uint32_t homemultiplier( void ) const
+    {
+    return( multiplier ) ;
+    }
+
+  inline uint32_t homeshift( void ) const
+    {
+    return( shift ) ;
+    }
+
+  inline const uint32_t* keydata( void ) const
+    {
+    return( keys.data() ) ;
+    }
+
+  inline const float* valuedata( void ) const
+    {
+    return( values.data() ) ;
+    }
+
+  inline float find( uint32_t column ) const
+    {
+    uint32_t slot = home( column ) ;
+    return( ( keys[ slot ] == column ) ? values[ slot ] : 0 ) ;
+    }
+  } ;
+
+// The dotrow kernels of dotkernels.h against the compact query vector.
+// The vector kernels gather the keys of the home slots of 8 ( AVX2 ) or
+// 16 ( AVX-512 ) entries, then the values of the slots holding their
+// column.  Most corpus entries miss the input, a step with no hit skips
+// the second gather.  As in dotkernels.h a _WIDEENTRIES build has the
+// scalar kernel only.
+
+typedef double ( *Hashkernel_t ) ( const Entry_t* rowentries, const Queryhash &cofs ) ;
+
+static inline double dotrowhashedscalar( const Entry_t* rowentries, const Queryhash &cofs )
+  {
+  double dot = 0 ;
+  uint32_t n = rowentries[ 0 ] ;
+  for( uint32_t i = 1 ; i <= n ; ++i )
+    dot += double( Entryformat_t::weight( rowentries[ i ] ) ) * cofs.find( Entryformat_t::index( rowentries[ i ] ) ) ;
+  return( dot ) ;
+  }
+
+#ifndef _WIDEENTRIES
+
+__attribute__(( target( "avx2,fma" ) ))
+static double dotrowhashedavx2( const uint32_t* rowentries, const Queryhash &cofs )
+  {
+  uint32_t n = rowentries[ 0 ] ;
+  const uint32_t* entries = rowentries + 1 ;
+  const int* keys = ( const int* ) cofs.keydata() ;
+  const float* values = cofs.valuedata() ;
+  const __m256i indexmask = _mm256_set1_epi32( 0x00ffffff ) ;
+  const __m256i multiplier = _mm256_set1_epi32( cofs.homemultiplier() ) ;
+  const __m128i shift = _mm_cvtsi32_si128( cofs.homeshift() ) ;
+  __m256d sumlo = _mm256_setzero_pd() ;
+  __m256d sumhi = _mm256_setzero_pd() ;
+  uint32_t i = 0 ;
+
+  for( ; i + 8 <= n ; i += 8 )
+    {
+    __m256i packed = _mm256_loadu_si256( ( const __m256i* ) ( entries + i ) ) ;
+    __m256i index = _mm256_and_si256( packed, indexmask ) ;
+    __m256i slot = _mm256_srl_epi32( _mm256_mullo_epi32( index, multiplier ), shift ) ;
+    __m256i hit = _mm256_cmpeq_epi32( _mm256_i32gather_epi32( keys, slot, 4 ), index ) ;
+    if( _mm256_testz_si256( hit, hit ) )
+      continue ;
+
+    __m256i tf = _mm256_srli_epi32( packed, 24 ) ;
+    __m256 cof = _mm256_mask_i32gather_ps( _mm256_setzero_ps(), values, slot, _mm256_castsi256_ps( hit ), 4 ) ;
+    sumlo = _mm256_fmadd_pd( _mm256_cvtepi32_pd( _mm256_castsi256_si128( tf ) ),
+                             _mm256_cvtps_pd( _mm256_castps256_ps128( cof ) ), sumlo ) ;
+    sumhi = _mm256_fmadd_pd( _mm256_cvtepi32_pd( _mm256_extracti128_si256( tf, 1 ) ),
+                             _mm256_cvtps_pd( _mm256_extractf128_ps( cof, 1 ) ), sumhi ) ;
+    }
+
+  double lanes[ 4 ] ;
+  _mm256_storeu_pd( lanes, _mm256_add_pd( sumlo, sumhi ) ) ;
+  double dot = ( lanes[ 0 ] + lanes[ 1 ] ) + ( lanes[ 2 ] + lanes[ 3 ] ) ;
+
+  for( ; i < n ; ++i )
+    dot += double( entries[ i ] >> 24 ) * cofs.find( entries[ i ] & 0x00ffffff ) ;
+  return( dot ) ;
+  }
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__(( target( "avx512f" ) ))
+static double dotrowhashedavx512( const uint32_t* rowentries, const Queryhash &cofs )
+  {
+  uint32_t n = rowentries[ 0 ] ;
+  const uint32_t* entries = rowentries + 1 ;
+  const uint32_t* keys = cofs.keydata() ;
+  const float* values = cofs.valuedata() ;
+  const __m512i indexmask = _mm512_set1_epi32( 0x00ffffff ) ;
+  const __m512i multiplier = _mm512_set1_epi32( cofs.homemultiplier() ) ;
+  const __m128i shift = _mm_cvtsi32_si128( cofs.homeshift() ) ;
+  __m512d sumlo = _mm512_setzero_pd() ;
+  __m512d sumhi = _mm512_setzero_pd() ;
+
+  for( uint32_t i = 0 ; i < n ; i += 16 )
+    {
+    __mmask16 live = ( n - i >= 16 ) ? __mmask16( 0xffff ) : __mmask16( ( 1U << ( n - i ) ) - 1 ) ;
+    __m512i packed = _mm512_maskz_loadu_epi32( live, entries + i ) ;
+    __m512i index = _mm512_and_si512( packed, indexmask ) ;
+    __m512i slot = _mm512_srl_epi32( _mm512_mullo_epi32( index, multiplier ), shift ) ;
+    __m512i found = _mm512_mask_i32gather_epi32( _mm512_set1_epi32( -1 ), live, slot, keys, 4 ) ;
+    __mmask16 hit = _mm512_mask_cmpeq_epi32_mask( live, found, index ) ;
+    if( hit == 0 )
+      continue ;
+
+    __m512i tf = _mm512_srli_epi32( packed, 24 ) ;
+    __m512 cof = _mm512_mask_i32gather_ps( _mm512_setzero_ps(), hit, slot, values, 4 ) ;
+    sumlo = _mm512_fmadd_pd( _mm512_cvtepi32_pd( _mm512_castsi512_si256( tf ) ),
+                             _mm512_cvtps_pd( _mm512_castps512_ps256( cof ) ), sumlo ) ;
+    sumhi = _mm512_fmadd_pd( _mm512_cvtepi32_pd( _mm512_extracti64x4_epi64( tf, 1 ) ),
+                             _mm512_cvtps_pd( _mm256_castpd_ps( _mm512_extractf64x4_pd( _mm512_castps_pd( cof ), 1 ) ) ),
+                             sumhi ) ;
+    }
+
+  return( _mm512_reduce_add_pd( _mm512_add_pd( sumlo, sumhi ) ) ) ;
+  }
+#pragma GCC diagnostic pop
+#endif
+
+static inline Hashkernel_t selecthashkernel( void )
+  {
+#ifndef _WIDEENTRIES
+  __builtin_cpu_init() ;
+  if( __builtin_cpu_supports( "avx512f" ) )
+    return( dotrowhashedavx512 ) ;
+  if( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ) )
+    return( dotrowhashedavx2 ) ;
+#endif
+  return( dotrowhashedscalar ) ;
+  }
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <initializer_list>
+#include <algorithm>
 
 // Implments a mini-container that is a "segmented vector".
 // The intention is that it act mostly like and STL std::vector
@@ -25,13 +26,54 @@
 // implementation can represent the perhaps very large vectors
 // as a collection of presumably much smaller sub-vectors.
 
+// Segments can also be attached to elements the vector does not own,
+// such as a section of a mapped snapshot, see attach().  Attached
+// segments are read only, a write through operator[] to one faults,
+// but the vector may still grow: the partly filled last segment is
+// copied before anything is appended to it.
+
 template<class T, size_t SEGSIZE >
 class Segmentedvector
   {
   private :
 
   size_t cursize ;
-  std::vector<std::vector<T> > segments ;
+  std::vector<std::vector<T> > segments ;  // Owned storage, empty for an attached segment
+  std::vector<T*> segmentdata ;       // Where each segment's elements are
+
+  void addsegments( size_t nsegs, const T &val = T() )
+    {
+    size_t curnsegs = segments.size() ;
+    if( nsegs > curnsegs )
+      {
+      segments.resize( nsegs ) ;
+      segmentdata.resize( nsegs ) ;
+      for( size_t i = curnsegs ; i < nsegs ; ++i )
+        {
+        segments[ i ].resize( SEGSIZE, val ) ;
+        segmentdata[ i ] = segments[ i ].data() ;
+        }
+      }
+    }
+
+  // Copies an attached segment, about to be written, into owned storage
+  void ownsegment( size_t i )
+    {
+    if( ( i < segments.size() ) && segments[ i ].empty() )
+      {
+      segments[ i ].resize( SEGSIZE ) ;
+      size_t n = ( cursize - i * SEGSIZE < SEGSIZE ) ? cursize - i * SEGSIZE : SEGSIZE ;
+      std::copy( segmentdata[ i ], segmentdata[ i ] + n, segments[ i ].begin() ) ;
+      segmentdata[ i ] = segments[ i ].data() ;
+      }
+    }
+
+  void pointsegments( const Segmentedvector &other )
+    {
+    segmentdata.resize( segments.size() ) ;
+    for( size_t i = 0 ; i < segments.size() ; ++i )
+      segmentdata[ i ] = segments[ i ].empty() ? other.segmentdata[ i ] : segments[ i ].data() ;
+    }
 
   public :
 
@@ -45,9 +87,7 @@ class Segmentedvector
     if( ( nsegs * SEGSIZE ) < n )
       ++nsegs ;
 
-    segments.resize( nsegs ) ;
-    for( size_t i = 0 ; i < nsegs ; ++i )
-      segments[ i ].resize( SEGSIZE ) ;
+    addsegments( nsegs ) ;
     }
 
   Segmentedvector( size_t n, const T &val ) : cursize( n )
@@ -56,14 +96,13 @@ class Segmentedvector
     if( ( nsegs * SEGSIZE ) < n )
       ++nsegs ;
 
-    segments.resize( nsegs ) ;
-    for( size_t i = 0 ; i < nsegs ; ++i )
-      segments[ i ].resize( SEGSIZE, val ) ;
+    addsegments( nsegs, val ) ;
     }
 
   Segmentedvector( const Segmentedvector &other ) : cursize( other.cursize ),
                                                     segments( other.segments )
     {
+    pointsegments( other ) ;
     }
 
   ~Segmentedvector()
@@ -76,6 +115,7 @@ class Segmentedvector
       {
       cursize = rhs.cursize ;
       segments = rhs.segments ;
+      pointsegments( rhs ) ;
       }
 
     return( *this ) ;
@@ -83,12 +123,12 @@ class Segmentedvector
 
   inline T &operator[] ( size_t n )
     {
-    return( segments[ ( n / SEGSIZE ) ][ n - SEGSIZE * ( n / SEGSIZE ) ] ) ;
+    return( segmentdata[ ( n / SEGSIZE ) ][ n - SEGSIZE * ( n / SEGSIZE ) ] ) ;
     }
 
   inline const T &operator[] ( size_t n ) const
     {
-    return( segments[ ( n / SEGSIZE ) ][ n - SEGSIZE * ( n / SEGSIZE ) ] ) ;
+    return( segmentdata[ ( n / SEGSIZE ) ][ n - SEGSIZE * ( n / SEGSIZE ) ] ) ;
     }
 
   void swap( Segmentedvector &other )
@@ -99,6 +139,7 @@ class Segmentedvector
     other.cursize = cursize ;
     cursize = sizetmp ;
     segments.swap( other.segments ) ;
+    segmentdata.swap( other.segmentdata ) ;
     }
 
   inline size_t size( void ) const
@@ -106,6 +147,57 @@ class Segmentedvector
     return( cursize ) ;
     }
 
+  // Contiguous pieces for bulk copies, segment i holds elements
+  // [ i * SEGSIZE, ( i + 1 ) * SEGSIZE ) as far as size()
+  inline size_t nsegments( void ) const
+    {
+    return( ( cursize + SEGSIZE - 1 ) / SEGSIZE ) ;
+    }
+
+  inline T* segment( size_t i )
+    {
+    return( segmentdata[ i ] ) ;
+    }
+
+  inline const T* segment( size_t i ) const
+    {
+    return( segmentdata[ i ] ) ;
+    }
+
+  inline size_t segmentsize( size_t i ) const
+    {
+    return( ( cursize - i * SEGSIZE < SEGSIZE ) ? cursize - i * SEGSIZE : SEGSIZE ) ;
+    }
+
+  // Uses n contiguous elements at data in place, data must outlive the
+  // vector or its next clear()
+  void attach( const T* data, size_t n )
+    {
+    clear() ;
+    cursize = n ;
+    size_t nsegs = nsegments() ;
+    segments.resize( nsegs ) ;
+    segmentdata.resize( nsegs ) ;
+    for( size_t i = 0 ; i < nsegs ; ++i )
+      segmentdata[ i ] = const_cast<T*>( data + i * SEGSIZE ) ;
+    }
+
+  // Whether any segment is attached rather than owned
+  bool mapped( void ) const
+    {
+    for( size_t i = 0 ; i < segments.size() ; ++i )
+      if( segments[ i ].empty() )
+        return( true ) ;
+    return( false ) ;
+    }
+
+  // Copies every attached segment into owned storage
+  void detach( void )
+    {
+    for( size_t i = 0 ; i < segments.size() ; ++i )
+      ownsegment( i ) ;
+    }
+
   inline size_t capacity( void ) const
     {
     return( SEGSIZE * segments.size() ) ;
@@ -117,13 +209,9 @@ class Segmentedvector
     if( ( nsegs * SEGSIZE ) < n )
       ++nsegs ;
 
-    size_t curnsegs = segments.size() ;
-    if( nsegs > curnsegs )
-      {
-      segments.resize( nsegs ) ;
-      for( size_t i = curnsegs ; i < nsegs ; ++i )
-        segments[ i ].resize( SEGSIZE ) ;
-      }
+    if( ( n > cursize ) && ( cursize % SEGSIZE != 0 ) )
+      ownsegment( cursize / SEGSIZE ) ;
+    addsegments( nsegs ) ;
     }
 
   void resize( size_t n )
@@ -134,13 +222,9 @@ class Segmentedvector
       if( ( nsegs * SEGSIZE ) < n )
         ++nsegs ;
 
-      size_t curnsegs = segments.size() ;
-      if( nsegs > curnsegs )
-        {
-        segments.resize( nsegs ) ;
-        for( size_t i = curnsegs ; i < nsegs ; ++i )
-          segments[ i ].resize( SEGSIZE ) ;
-        }
+      if( cursize % SEGSIZE != 0 )
+        ownsegment( cursize / SEGSIZE ) ;
+      addsegments( nsegs ) ;
       }
 
     cursize = n ;
@@ -160,6 +244,7 @@ class Segmentedvector
     {
     cursize = 0 ;
     std::vector<std::vector<T> >().swap( segments ) ;
+    std::vector<T*>().swap( segmentdata ) ;
     }
   } ;
 
@@ -0,0 +1,215 @@
+#ifndef SNAPSHOT_H_INCLUDED
+#define SNAPSHOT_H_INCLUDED
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+
+// On disk layout of a saved index.  A fixed header, then one section per
+// array, each starting on a 64 byte boundary and holding the array exactly
+// as it sits in memory, offsets and all, so a loaded index uses the
+// sections in place in the mapping with nothing to parse or copy.  The
+// header records every section's offset and size in bytes.  Snapshots are
+// only read back on machines of the byte order that wrote them, by builds
+// of the same entry format, and a reader refuses any other version.
+
+static const char snapshotmagic[ 8 ] = { 'C', 'O', 'S', 'S', 'N', 'A', 'P', '\0' } ;
+static const uint32_t snapshotversion = 6 ;
+static const uint32_t snapshotbyteorder = 0x01020304 ;
+static const uint64_t snapshotalign = 64 ;
+
+enum Snapshotsection_t
+  {
+  idfsection,                         // double per matrix column
+  idfcountsection,                    // uint32_t per matrix column, rows using it
+  bigramsection,                      // bigramstodim
+  trigramsection,                     // trigramstodim
+  wordsection,                        // Wordform_t per word
+  wordtextsection,                    // wordtexts
+  wordnnzsection,                     // wordnnzs
+  vocabularysection,                  // Flatword_t per slot, offsets into wordtexts
+  corpussection,                      // Corpusform_t per row
+  rowinfosection,                     // corpusrowinfo
+  quadcodesection,                    // Frozen anchors, see QuadgramAnchors
+  quadstartsection,
+  quadblocksection,                   // Compressed, see postingcodec.h
+  quadbytesection,
+  quaddiscardsection,
+  emptylinesection,                   // File lines that made no row
+  csrstartsection,                    // Compiled rows, when the index had them
+  csrentrysection,
+  nsnapshotsections
+  } ;
+
+typedef struct Snapshotheader_t
+  {
+  char magic[ 8 ] ;
+  uint32_t version ;
+  uint32_t byteorder ;
+  uint32_t entrybytes ;               // sizeof( Entry_t ) of the build that wrote it
+  uint32_t nbigramcols ;
+  uint32_t ntrigramcols ;
+  uint32_t nwordcols ;
+  uint32_t nmatrixcols ;
+  uint64_t totalnnzs ;
+  uint64_t nrows ;
+  uint64_t nwords ;                   // wordlist entries, the unknown word 0 included
+  uint64_t offsets[ nsnapshotsections ] ;
+  uint64_t sizes[ nsnapshotsections ] ;
+  }
+  Snapshotheader_t ;
+
+// Writes a snapshot section by section, each in as many pieces as needed.
+// The file is written next to path and renamed over it by close(), a
+// reader never sees half a snapshot.
+class Snapshotwriter
+  {
+  private :
+
+  FILE *f ;
+  std::string path ;
+  std::string tmppath ;
+  uint64_t at ;
+  bool failed ;
+  int current ;
+
+  public :
+
+  Snapshotheader_t header ;
+
+  Snapshotwriter() : f( NULL ), at( 0 ), failed( false ), current( -1 )
+    {
+    memset( &header, 0, sizeof( header ) ) ;
+    }
+
+  ~Snapshotwriter()
+    {
+    if( f != NULL )
+      {
+      fclose( f ) ;
+      remove( tmppath.c_str() ) ;
+      }
+    }
+
+  bool open( const char* filename, uint32_t entrybytes )
+    {
+    path = filename ;
+    tmppath = path + ".tmp" ;
+    f = fopen( tmppath.c_str(), "wb" ) ;
+    if( f == NULL )
+      return( false ) ;
+
+    memcpy( header.magic, snapshotmagic, sizeof( snapshotmagic ) ) ;
+    header.version = snapshotversion ;
+    header.byteorder = snapshotbyteorder ;
+    header.entrybytes = entrybytes ;
+    write( &header, sizeof( header ) ) ;      // Rewritten by close()
+    return( !failed ) ;
+    }
+
+  inline void write( const void* data, uint64_t n )
+    {
+    if( ( n > 0 ) && !failed && ( fwrite( data, 1, n, f ) != n ) )
+      failed = true ;
+    at += n ;
+    }
+
+  void beginsection( int section )
+    {
+    static const char zeros[ snapshotalign ] = { 0 } ;
+    write( zeros, ( snapshotalign - at % snapshotalign ) % snapshotalign ) ;
+    header.offsets[ section ] = at ;
+    current = section ;
+    }
+
+  void endsection( void )
+    {
+    header.sizes[ current ] = at - header.offsets[ current ] ;
+    current = -1 ;
+    }
+
+  template<class T> void section( int id, const T* data, uint64_t n )
+    {
+    beginsection( id ) ;
+    write( data, n * sizeof( T ) ) ;
+    endsection() ;
+    }
+
+  // false, and nothing at path touched, when any write failed
+  bool close( void )
+    {
+    if( !failed && ( fseek( f, 0, SEEK_SET ) == 0 ) )
+      {
+      at = 0 ;
+      write( &header, sizeof( header ) ) ;
+      }
+    else
+      failed = true ;
+
+    if( fclose( f ) != 0 )
+      failed = true ;
+    f = NULL ;
+
+    if( failed || ( rename( tmppath.c_str(), path.c_str() ) != 0 ) )
+      {
+      remove( tmppath.c_str() ) ;
+      return( false ) ;
+      }
+    return( true ) ;
+    }
+  } ;
+
+// A snapshot file mapped read only and shared, every process mapping it
+// reads the same page cache pages.  Sections are checked against the file
+// size before they are handed out.
+class Snapshotmap
+  {
+  private :
+
+  const char* base ;
+  uint64_t len ;
+
+  public :
+
+  const Snapshotheader_t* header ;
+
+  Snapshotmap() : base( NULL ), len( 0 ), header( NULL )
+    {
+    }
+
+  Snapshotmap( const Snapshotmap & ) = delete ;
+  Snapshotmap &operator=( const Snapshotmap & ) = delete ;
+
+  ~Snapshotmap()
+    {
+    close() ;
+    }
+
+  inline uint64_t size( void ) const
+    {
+    return( len ) ;
+    }
+
+  // Maps filename, false with the reason in error when it is not a
+  // snapshot this build, entries of entrybytes, can read
+  bool open( const char* filename, uint32_t entrybytes, std::string &error ) ;
+  void close( void ) ;
+
+  static bool issnapshot( const char* filename ) ;
+
+  // Section id as n elements of T, NULL when the header is inconsistent
+  template<class T> const T* section( int id, uint64_t &n ) const
+    {
+    uint64_t offset = header->offsets[ id ] ;
+    uint64_t size = header->sizes[ id ] ;
+    n = 0 ;
+    if( ( offset % snapshotalign != 0 ) || ( size % sizeof( T ) != 0 ) ||
+        ( offset > len ) || ( size > len - offset ) )
+      return( NULL ) ;
+    n = size / sizeof( T ) ;
+    return( ( const T* ) ( base + offset ) ) ;
+    }
+  } ;
+
+#endif
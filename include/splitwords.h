@@ -110,4 +110,20 @@ class Splitwords
     {}
   } ;
 
+// The next nonempty word of a nul terminated text, in place.  false at the
+// end of the text.
+static inline bool nextword( const char* &p, const char delim, const char* &word, size_t &len )
+  {
+  while( *p == delim )
+    ++p ;
+  if( *p == '\0' )
+    return( false ) ;
+
+  word = p ;
+  while( ( *p != delim ) && ( *p != '\0' ) )
+    ++p ;
+  len = p - word ;
+  return( true ) ;
+  }
+
 #endif
@@ -0,0 +1,110 @@
+#ifndef TOPSCORES_H_INCLUDED
+#define TOPSCORES_H_INCLUDED
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+// Keeps the k best scoring rows seen so far in a bounded min-heap, the
+// worst kept row sits at the front.  Adding a row is O(1) when it does
+// not beat the worst kept row and O(log k) otherwise, so the cost of a
+// query stays flat as k grows.  Ties on score keep the lower row number
+// so results do not depend on thread scheduling.
+
+static const uint64_t topscoresreserve = 4096 ;
+
+typedef struct Scoredrow_t
+  {
+  double score ;
+  uint64_t rownum ;
+  }
+  Scoredrow_t ;
+
+class Topscores
+  {
+  private :
+
+  std::vector<Scoredrow_t> heap ;
+  uint64_t k ;
+
+  // true when a ranks ahead of b
+  static inline bool better( const Scoredrow_t &a, const Scoredrow_t &b )
+    {
+    return( ( a.score > b.score ) || ( ( a.score == b.score ) && ( a.rownum < b.rownum ) ) ) ;
+    }
+
+  public :
+
+  Topscores( uint64_t maxresults = 0 ) : k( maxresults )
+    {
+    }
+
+  // Empties the heap, keeping its storage for the next query.  Storage is
+  // reserved for no more than the ncandidates rows that can be added, and
+  // at most topscoresreserve, past that the heap grows as rows come.
+  void reset( uint64_t maxresults, uint64_t ncandidates = topscoresreserve )
+    {
+    k = maxresults ;
+    heap.clear() ;
+    uint64_t n = std::min( std::min( k, ncandidates ), topscoresreserve ) ;
+    if( heap.capacity() < n )
+      heap.reserve( n ) ;
+    }
+
+  inline uint64_t size( void ) const
+    {
+    return( heap.size() ) ;
+    }
+
+  inline void add( uint64_t rownum, double score )
+    {
+    Scoredrow_t row ;
+    row.score = score ;
+    row.rownum = rownum ;
+
+    if( heap.size() < k )
+      {
+      heap.push_back( row ) ;
+      std::push_heap( heap.begin(), heap.end(), better ) ;
+      }
+    else if( ( k > 0 ) && better( row, heap.front() ) )
+      {
+      std::pop_heap( heap.begin(), heap.end(), better ) ;
+      heap.back() = row ;
+      std::push_heap( heap.begin(), heap.end(), better ) ;
+      }
+    }
+
+  void merge( const Topscores &other )
+    {
+    uint64_t n = other.heap.size() ;
+    for( uint64_t i = 0 ; i < n ; ++i )
+      add( other.heap[ i ].rownum, other.heap[ i ].score ) ;
+    }
+
+  // Best first, the heap is left empty
+  void extract( std::vector<Scoredrow_t> &rows )
+    {
+    std::sort_heap( heap.begin(), heap.end(), better ) ;
+    rows.swap( heap ) ;
+    heap.clear() ;
+    }
+  } ;
+
+// Tree merge of per thread heaps, tops holds nslots heaps per thread laid
+// out as tops[ thread * nslots + slot ].  Called by every thread of the
+// team that filled tops, leaves the merged heaps in the first nslots.
+// Each round halves the number of live heaps, no locks are taken.
+static inline void mergetopscores( std::vector<Topscores> &tops, uint64_t nslots,
+                                   int threadid, int nthreads )
+  {
+  for( int step = 1 ; step < nthreads ; step *= 2 )
+    {
+#pragma omp barrier
+    if( ( ( threadid % ( 2 * step ) ) == 0 ) && ( ( threadid + step ) < nthreads ) )
+      for( uint64_t slot = 0 ; slot < nslots ; ++slot )
+        tops[ threadid * nslots + slot ].merge( tops[ ( threadid + step ) * nslots + slot ] ) ;
+    }
+  }
+
+#endif
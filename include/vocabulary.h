@@ -0,0 +1,409 @@
+#ifndef VOCABULARY_H_INCLUDED
+#define VOCABULARY_H_INCLUDED
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <functional>
+#include <omp.h>
+#include "arena.h"
+
+// Word to word id map of the corpus.  Words are spread over nshards flat
+// tables by the top bits of their hash, so threads build them without
+// sharing anything: every thread first collects the words of its own rows
+// into nshards private Wordtables, then each shard is merged from all of
+// them by one thread and its words interned in the shard's arena.  Ids
+// follow the first sighting of each word in the corpus, ( row, position ),
+// so they come out the same whatever the thread count or timing.
+
+static inline uint64_t hashword( const char* text, uint32_t len )
+  {
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ len ;
+  uint64_t k ;
+  for( ; len >= 8 ; len -= 8, text += 8 )
+    {
+    memcpy( &k, text, 8 ) ;
+    h = ( h ^ k ) * 0xbf58476d1ce4e5b9ULL ;
+    h ^= h >> 29 ;
+    }
+  k = 0 ;
+  memcpy( &k, text, len ) ;
+  h = ( h ^ k ) * 0x94d049bb133111ebULL ;
+  h ^= h >> 31 ;
+  h *= 0xbf58476d1ce4e5b9ULL ;
+  return( h ^ ( h >> 32 ) ) ;
+  }
+
+typedef struct Vocabentry_t
+  {
+  const char* text ;                  // NULL when the slot is unused
+  uint32_t len ;
+  uint32_t id ;
+  uint64_t firstseen ;                // row << 32 | position within the row
+  }
+  Vocabentry_t ;
+
+// Open addressing table, linear probing, kept at most 3/4 full.  Holds
+// text pointers only, whoever inserts keeps the text alive.  Hashes are
+// not kept, 24 byte slots, a grow hashes the words again.
+class Wordtable
+  {
+  private :
+
+  std::vector<Vocabentry_t> slots ;
+  uint64_t count ;
+
+  void grow( void )
+    {
+    std::vector<Vocabentry_t> old( slots.size() ? 2 * slots.size() : 64 ) ;
+    old.swap( slots ) ;
+    uint64_t mask = slots.size() - 1 ;
+    for( uint64_t i = 0 ; i < old.size() ; ++i )
+      if( old[ i ].text != NULL )
+        {
+        uint64_t slot = hashword( old[ i ].text, old[ i ].len ) & mask ;
+        while( slots[ slot ].text != NULL )
+          slot = ( slot + 1 ) & mask ;
+        slots[ slot ] = old[ i ] ;
+        }
+    }
+
+  public :
+
+  Wordtable() : count( 0 )
+    {
+    }
+
+  // The word's entry, a new one with id 0 when added is set
+  Vocabentry_t* insert( const char* text, uint32_t len, uint64_t hash, bool &added )
+    {
+    if( 4 * ( count + 1 ) > 3 * slots.size() )
+      grow() ;
+
+    uint64_t mask = slots.size() - 1 ;
+    uint64_t slot = hash & mask ;
+    for( ; slots[ slot ].text != NULL ; slot = ( slot + 1 ) & mask )
+      if( ( slots[ slot ].len == len ) && ( memcmp( slots[ slot ].text, text, len ) == 0 ) )
+        {
+        added = false ;
+        return( &slots[ slot ] ) ;
+        }
+
+    Vocabentry_t &entry = slots[ slot ] ;
+    entry.text = text ;
+    entry.len = len ;
+    entry.id = 0 ;
+    entry.firstseen = UINT64_MAX ;
+    ++count ;
+    added = true ;
+    return( &entry ) ;
+    }
+
+  const Vocabentry_t* find( const char* text, uint32_t len, uint64_t hash ) const
+    {
+    if( count == 0 )
+      return( NULL ) ;
+
+    uint64_t mask = slots.size() - 1 ;
+    for( uint64_t slot = hash & mask ; slots[ slot ].text != NULL ; slot = ( slot + 1 ) & mask )
+      if( ( slots[ slot ].len == len ) && ( memcmp( slots[ slot ].text, text, len ) == 0 ) )
+        return( &slots[ slot ] ) ;
+    return( NULL ) ;
+    }
+
+  // Backward shift deletion, entries probed past the word move up so
+  // no lookup stops short.  false when the word is not there.
+  bool erase( const char* text, uint32_t len, uint64_t hash )
+    {
+    if( count == 0 )
+      return( false ) ;
+
+    uint64_t mask = slots.size() - 1 ;
+    uint64_t hole = hash & mask ;
+    for( ; slots[ hole ].text != NULL ; hole = ( hole + 1 ) & mask )
+      if( ( slots[ hole ].len == len ) && ( memcmp( slots[ hole ].text, text, len ) == 0 ) )
+        break ;
+    if( slots[ hole ].text == NULL )
+      return( false ) ;
+
+    for( uint64_t next = ( hole + 1 ) & mask ; slots[ next ].text != NULL ; next = ( next + 1 ) & mask )
+      {
+      uint64_t home = hashword( slots[ next ].text, slots[ next ].len ) & mask ;
+      if( ( ( next - home ) & mask ) >= ( ( next - hole ) & mask ) )
+        {
+        slots[ hole ] = slots[ next ] ;
+        hole = next ;
+        }
+      }
+    slots[ hole ].text = NULL ;
+    --count ;
+    return( true ) ;
+    }
+
+  inline uint64_t size( void ) const
+    {
+    return( count ) ;
+    }
+
+  inline uint64_t capacity( void ) const
+    {
+    return( slots.size() ) ;
+    }
+
+  // Slot i, text is NULL when it is unused
+  inline Vocabentry_t &slot( uint64_t i )
+    {
+    return( slots[ i ] ) ;
+    }
+
+  inline const Vocabentry_t &slot( uint64_t i ) const
+    {
+    return( slots[ i ] ) ;
+    }
+
+  void clear( void )
+    {
+    std::vector<Vocabentry_t>().swap( slots ) ;
+    count = 0 ;
+    }
+  } ;
+
+// Slot of the flat, read only form of a Vocabulary, see attach()
+typedef struct Flatword_t
+  {
+  uint64_t text ;                     // Offset into the texts the table goes with
+  uint32_t len ;
+  uint32_t id ;                       // 0 when the slot is unused
+  }
+  Flatword_t ;
+
+class Vocabulary
+  {
+  public :
+
+  static const uint32_t nshardbits = 6 ;
+  static const uint32_t nshards = 1U << nshardbits ;
+
+  private :
+
+  std::vector<Wordtable> shards ;
+  std::vector<Arena> texts ;          // Interned words of each shard
+  std::vector<std::vector<Vocabentry_t*> > sightings ;  // Merge only, each shard's words by first sighting
+  uint32_t nwords ;
+  const Flatword_t* flatslots ;       // Attached flat form, the shards are then empty
+  uint64_t flatmask ;
+  const char* flattexts ;
+
+  // Takes an attached flat table into the shards, its texts still in place
+  void thaw( void )
+    {
+    if( flatslots == NULL )
+      return ;
+
+    const Flatword_t* slots = flatslots ;
+    uint64_t nslots = flatmask + 1 ;
+    flatslots = NULL ;
+    for( uint64_t i = 0 ; i < nslots ; ++i )
+      if( slots[ i ].id != 0 )
+        {
+        const char* word = flattexts + slots[ i ].text ;
+        uint64_t wordhash = hashword( word, slots[ i ].len ) ;
+        bool isnew ;
+        shards[ shardof( wordhash ) ].insert( word, slots[ i ].len, wordhash, isnew )->id = slots[ i ].id ;
+        }
+    }
+
+  public :
+
+  Vocabulary() : shards( nshards ), nwords( 0 ), flatslots( NULL ), flatmask( 0 ), flattexts( NULL )
+    {
+    texts.reserve( nshards ) ;
+    for( uint32_t s = 0 ; s < nshards ; ++s )
+      texts.push_back( Arena( 256ULL * 1024ULL ) ) ;
+    }
+
+  static inline uint32_t shardof( uint64_t hash )
+    {
+    return( hash >> ( 64 - nshardbits ) ) ;
+    }
+
+  // Word id, 0 for words not in the vocabulary
+  inline uint32_t find( const char* text, uint32_t len ) const
+    {
+    uint64_t hash = hashword( text, len ) ;
+    if( flatslots != NULL )
+      {
+      for( uint64_t slot = hash & flatmask ; flatslots[ slot ].id != 0 ; slot = ( slot + 1 ) & flatmask )
+        if( ( flatslots[ slot ].len == len ) && ( memcmp( flattexts + flatslots[ slot ].text, text, len ) == 0 ) )
+          return( flatslots[ slot ].id ) ;
+      return( 0 ) ;
+      }
+    const Vocabentry_t* entry = shards[ shardof( hash ) ].find( text, len, hash ) ;
+    return( ( entry != NULL ) ? entry->id : 0 ) ;
+    }
+
+  inline uint32_t find( const std::string &word ) const
+    {
+    return( find( word.data(), word.size() ) ) ;
+    }
+
+  inline uint32_t size( void ) const
+    {
+    return( nwords ) ;
+    }
+
+  void clear( void )
+    {
+    for( uint32_t s = 0 ; s < nshards ; ++s )
+      {
+      shards[ s ].clear() ;
+      texts[ s ].release() ;
+      }
+    nwords = 0 ;
+    flatslots = NULL ;
+    flatmask = 0 ;
+    flattexts = NULL ;
+    }
+
+  // Flat form of words 1 ... nwords, an open addressing table of a power
+  // of two slots, at most 3/4 full, probed linearly from hashword().
+  // Holds offsets, not pointers, so it can be saved and mapped back.
+  // textof( id, text, len, offset ) gives word id's text and its offset,
+  // an empty text for an id no word has.
+  template<class F> static void flatten( uint32_t nwords, F textof, std::vector<Flatword_t> &slots )
+    {
+    uint64_t nslots = 64 ;
+    while( 3 * nslots < 4 * uint64_t( nwords ) )
+      nslots *= 2 ;
+    slots.assign( nslots, Flatword_t() ) ;
+    for( uint32_t id = 1 ; id <= nwords ; ++id )
+      {
+      const char* text ;
+      uint32_t len ;
+      uint64_t offset ;
+      textof( id, text, len, offset ) ;
+      if( len == 0 )
+        continue ;
+      uint64_t slot = hashword( text, len ) & ( nslots - 1 ) ;
+      while( slots[ slot ].id != 0 )
+        slot = ( slot + 1 ) & ( nslots - 1 ) ;
+      slots[ slot ].text = offset ;
+      slots[ slot ].len = len ;
+      slots[ slot ].id = id ;
+      }
+    }
+
+  // Answers find() from a flat table kept elsewhere, texts being what its
+  // offsets are into.  Both must outlive the vocabulary or its clear().
+  void attach( const Flatword_t* slots, uint64_t nslots, const char* texts, uint32_t count )
+    {
+    clear() ;
+    flatslots = slots ;
+    flatmask = nslots - 1 ;
+    flattexts = texts ;
+    nwords = count ;
+    }
+
+  // Inside a parallel region, every thread calls it.  Merges partials,
+  // nshards Wordtables per thread, shard by shard, then numbers the words
+  // 1... in order of first sighting.  partials are left empty.
+  void merge( std::vector<std::vector<Wordtable> > &partials )
+    {
+#pragma omp single
+    sightings.assign( nshards, std::vector<Vocabentry_t*>() ) ;
+
+#pragma omp for schedule( dynamic, 1 )
+    for( uint32_t s = 0 ; s < nshards ; ++s )
+      {
+      Wordtable &shard = shards[ s ] ;
+      for( uint64_t t = 0 ; t < partials.size() ; ++t )
+        {
+        Wordtable &partial = partials[ t ][ s ] ;
+        for( uint64_t i = 0 ; i < partial.capacity() ; ++i )
+          {
+          const Vocabentry_t &word = partial.slot( i ) ;
+          if( word.text == NULL )
+            continue ;
+          bool added ;
+          Vocabentry_t* entry = shard.insert( word.text, word.len, hashword( word.text, word.len ), added ) ;
+          if( added )
+            entry->text = texts[ s ].copystring( word.text, word.len ) ;
+          if( word.firstseen < entry->firstseen )
+            entry->firstseen = word.firstseen ;
+          }
+        partial.clear() ;
+        }
+
+      std::vector<Vocabentry_t*> &order = sightings[ s ] ;
+      order.reserve( shard.size() ) ;
+      for( uint64_t i = 0 ; i < shard.capacity() ; ++i )
+        if( ( shard.slot( i ).text != NULL ) && ( shard.slot( i ).id == 0 ) )
+          order.push_back( &shard.slot( i ) ) ;
+      std::sort( order.begin(), order.end(),
+                 []( const Vocabentry_t* a, const Vocabentry_t* b ) { return( a->firstseen < b->firstseen ) ; } ) ;
+      } // end of for, implied barrier
+
+#pragma omp single
+    {
+    typedef std::pair<uint64_t, uint32_t> Sighting_t ;  // First sighting, shard
+    std::priority_queue<Sighting_t, std::vector<Sighting_t>, std::greater<Sighting_t> > next ;
+    std::vector<uint64_t> taken( nshards, 0 ) ;
+    for( uint32_t s = 0 ; s < nshards ; ++s )
+      if( !sightings[ s ].empty() )
+        next.push( Sighting_t( sightings[ s ][ 0 ]->firstseen, s ) ) ;
+
+    while( !next.empty() )
+      {
+      uint32_t s = next.top().second ;
+      next.pop() ;
+      sightings[ s ][ taken[ s ] ]->id = ++nwords ;
+      if( ++taken[ s ] < sightings[ s ].size() )
+        next.push( Sighting_t( sightings[ s ][ taken[ s ] ]->firstseen, s ) ) ;
+      }
+    std::vector<std::vector<Vocabentry_t*> >().swap( sightings ) ;
+    } // end of single, implied barrier
+    }
+
+  // Puts a word in with a known id, as when reloading a saved vocabulary.
+  // An attached flat table is first thawed.
+  void assign( const char* text, uint32_t len, uint32_t id )
+    {
+    thaw() ;
+    uint64_t hash = hashword( text, len ) ;
+    uint32_t s = shardof( hash ) ;
+    bool added ;
+    Vocabentry_t* entry = shards[ s ].insert( text, len, hash, added ) ;
+    if( added )
+      entry->text = texts[ s ].copystring( text, len ) ;
+    entry->id = id ;
+    if( id > nwords )
+      nwords = id ;
+    }
+
+  // Takes a word out, its id may then be assigned to another.  size()
+  // stays the largest id.
+  bool erase( const char* text, uint32_t len )
+    {
+    thaw() ;
+    uint64_t hash = hashword( text, len ) ;
+    return( shards[ shardof( hash ) ].erase( text, len, hash ) ) ;
+    }
+
+  // f( text, len, id ) for every word, in no particular order
+  void foreach( const std::function<void ( const char* text, uint32_t len, uint32_t id )> &f ) const
+    {
+    if( flatslots != NULL )
+      for( uint64_t i = 0 ; i <= flatmask ; ++i )
+        if( flatslots[ i ].id != 0 )
+          f( flattexts + flatslots[ i ].text, flatslots[ i ].len, flatslots[ i ].id ) ;
+    for( uint32_t s = 0 ; s < nshards ; ++s )
+      for( uint64_t i = 0 ; i < shards[ s ].capacity() ; ++i )
+        if( shards[ s ].slot( i ).text != NULL )
+          f( shards[ s ].slot( i ).text, shards[ s ].slot( i ).len, shards[ s ].slot( i ).id ) ;
+    }
+  } ;
+
+#endif
@@ -0,0 +1,83 @@
+#include <iostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include "cosinehelper.h"
+
+// Loads a corpus file with and without trigram columns, timing the load and
+// a batch of queries each way, then times the gram, word and row merging
+// routines against their former versions.  make bench runs it on the
+// surnames, the queries are then corpus lines.  Needs -D_BENCHGRAMS, the
+// bench target builds its own objects with it.
+
+static bool readlines( const char* filename, std::vector<std::string> &lines )
+  {
+  std::ifstream file( filename ) ;
+  std::string line ;
+  if( !file.is_open() )
+    return( false ) ;
+  while( getline( file, line ) )
+    lines.push_back( line ) ;
+  return( true ) ;
+  }
+
+int main( int argc, char **argv )
+  {
+  if( argc < 2 )
+    {
+    std::cout<<"Usage: "<<argv[ 0 ]<<" <corpusfile> [ <queryfile> ]"<<std::endl ;
+    return 1 ;
+    }
+
+  std::vector<std::string> queries ;
+  if( argc > 2 )
+    {
+    if( !readlines( argv[ 2 ], queries ) )
+      {
+      std::cout<<"Could not open query file "<<argv[ 2 ]<<std::endl ;
+      return 1 ;
+      }
+    }
+  else
+    {
+    std::vector<std::string> lines ;
+    if( !readlines( argv[ 1 ], lines ) )
+      {
+      std::cout<<"Could not read corpus file "<<argv[ 1 ]<<std::endl ;
+      return 1 ;
+      }
+    uint64_t step = lines.size() / 300 + 1 ;
+    for( uint64_t i = 0 ; i < lines.size() ; i += step )
+      queries.push_back( lines[ i ] ) ;
+    }
+
+  double loadtime[ 2 ] ;
+  double querytime[ 2 ] ;
+  for( int trigrams = 0 ; trigrams < 2 ; ++trigrams )
+    {
+    Loadoptions_t loadoptions ;
+    Queryoptions_t options ;
+    Querycontext_t context ;
+    struct timespec starttime ;
+    loadoptions.trigrams = ( trigrams == 1 ) ;
+
+    clock_gettime( CLOCK_REALTIME, &starttime ) ;
+    CosineHelper cos( argv[ 1 ], stdcleaningtool, loadoptions ) ;
+    loadtime[ trigrams ] = compute_elapsed( starttime ) ;
+
+    cos.initquerycontext( context ) ;
+    clock_gettime( CLOCK_REALTIME, &starttime ) ;
+    cos.batchquery( queries, options, context ) ;
+    querytime[ trigrams ] = compute_elapsed( starttime ) / ( queries.size() > 0 ? queries.size() : 1 ) ;
+
+    if( trigrams == 1 )
+      cos.benchgrams() ;
+    }
+
+  const char* names[ 2 ] = { "bigrams", "bigrams and trigrams" } ;
+  for( int trigrams = 0 ; trigrams < 2 ; ++trigrams )
+    std::cout<<makemytimebracketed()<<" Bench "<<names[ trigrams ]<<": load "<<loadtime[ trigrams ]
+             <<" s, "<<queries.size()<<" queries "<<querytime[ trigrams ]<<" s per query"<<std::endl ;
+  return 0 ;
+  }
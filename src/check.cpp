@@ -0,0 +1,192 @@
+#include <iostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <set>
+#include <map>
+#include <math.h>
+#include "cosinehelper.h"
+
+// Checks the dot kernels against the scalar one, and the query paths and
+// the insert path against each other, on a corpus file.  make check runs
+// it on the surnames and the business names.  Every check prints ok or
+// FAILED, the exit status is the number of failed checks.
+
+static bool readlines( const char* filename, std::vector<std::string> &lines )
+  {
+  std::ifstream file( filename ) ;
+  std::string line ;
+  if( !file.is_open() )
+    return( false ) ;
+  while( getline( file, line ) )
+    lines.push_back( line ) ;
+  return( true ) ;
+  }
+
+// Scores within tolerance place by place, and the same rows but for those
+// tied with the last, which either side may cut differently
+static bool sameresults( const std::vector<Result_t> &a, const std::vector<Result_t> &b )
+  {
+  if( a.size() != b.size() )
+    return( false ) ;
+  std::set<uint32_t> brows ;
+  for( uint64_t i = 0 ; i < b.size() ; ++i )
+    {
+    if( fabs( a[ i ].score - b[ i ].score ) > 1.e-5 )
+      return( false ) ;
+    brows.insert( b[ i ].row ) ;
+    }
+  for( uint64_t i = 0 ; i < a.size() ; ++i )
+    if( ( a[ i ].score > a.back().score + 1.e-5 ) && ( brows.count( a[ i ].row ) == 0 ) )
+      return( false ) ;
+  return( true ) ;
+  }
+
+static int report( const char* what, uint64_t nqueries, uint64_t nbad, uint64_t nresults )
+  {
+  std::cout<<makemytimebracketed()<<what<<": "<<nqueries - nbad<<" of "<<nqueries<<" queries match, "
+           <<nresults<<" results"<<( ( nbad == 0 ) && ( nresults > 0 ) ? " ok" : " FAILED" )<<std::endl ;
+  return( ( nbad == 0 ) && ( nresults > 0 ) ? 0 : 1 ) ;
+  }
+
+// batchquery() against query() one input at a time
+static int checkbatch( const CosineHelper &cos, const std::vector<std::string> &queries, bool useanchorwords )
+  {
+  Queryoptions_t options ;
+  Querycontext_t context ;
+  options.useanchorwords = useanchorwords ;
+  options.maxresults = 50 ;
+  options.batchgroupsize = 16 ;
+  cos.initquerycontext( context ) ;
+
+  std::vector<Queryresult_t> batch = cos.batchquery( queries, options, context ) ;
+  uint64_t nbad = 0 ;
+  uint64_t nresults = 0 ;
+  for( uint64_t q = 0 ; q < queries.size() ; ++q )
+    {
+    Queryresult_t single = cos.query( queries[ q ], options, context ) ;
+    nresults += single.results.size() ;
+    if( !sameresults( batch[ q ].results, single.results ) )
+      ++nbad ;
+    }
+  return( report( useanchorwords ? "Batch against single queries, anchors"
+                                 : "Batch against single queries, no anchors", queries.size(), nbad, nresults ) ) ;
+  }
+
+// Half the lines loaded and the rest inserted against all of them loaded
+static int checkinsert( const CosineHelper &full, const std::vector<std::string> &lines,
+                        const std::vector<std::string> &queries )
+  {
+  std::vector<std::string> firsthalf( lines.begin(), lines.begin() + lines.size() / 2 ) ;
+  std::vector<std::string> secondhalf( lines.begin() + lines.size() / 2, lines.end() ) ;
+  CosineHelper inserted( firsthalf, stdcleaningtool ) ;
+  inserted.insertrows( secondhalf ) ;
+  inserted.rebaseidf() ;
+
+  Queryoptions_t options ;
+  Querycontext_t fullcontext ;
+  Querycontext_t insertedcontext ;
+  full.initquerycontext( fullcontext ) ;
+  inserted.initquerycontext( insertedcontext ) ;
+
+  uint64_t nbad = 0 ;
+  uint64_t nresults = 0 ;
+  for( uint64_t q = 0 ; q < queries.size() ; ++q )
+    {
+    Queryresult_t expected = full.query( queries[ q ], options, fullcontext ) ;
+    Queryresult_t got = inserted.query( queries[ q ], options, insertedcontext ) ;
+    nresults += expected.results.size() ;
+    if( !sameresults( expected.results, got.results ) )
+      ++nbad ;
+    }
+  return( report( "Half loaded and half inserted against all loaded", queries.size(), nbad, nresults ) ) ;
+  }
+
+// The derived overlap of -g against minoverlap 1.  The derived bound is a
+// heuristic, so rows above threshold may be dropped and are only counted.
+// What must hold is that it drops rows and nothing else: every row it keeps
+// scores as unfiltered, and at threshold 0 it derives 1 and keeps them all.
+static int checkderivedoverlap( const CosineHelper &cos, const std::vector<std::string> &queries )
+  {
+  const double thresholds[] = { 0, 0.3, 0.5, 0.7 } ;
+  Querycontext_t context ;
+  cos.initquerycontext( context ) ;
+  int nfailed = 0 ;
+
+  for( double threshold : thresholds )
+    {
+    Queryoptions_t options ;
+    Queryoptions_t derived ;
+    options.maxresults = derived.maxresults = 100000 ;
+    options.threshold = derived.threshold = threshold ;
+    derived.derivedoverlap = true ;
+
+    uint64_t nqualifying = 0 ;
+    uint64_t nkept = 0 ;
+    uint64_t nbad = 0 ;
+    for( uint64_t q = 0 ; q < queries.size() ; ++q )
+      {
+      Queryresult_t all = cos.query( queries[ q ], options, context ) ;
+      Queryresult_t kept = cos.query( queries[ q ], derived, context ) ;
+      std::map<uint32_t, float> scores ;
+      for( uint64_t i = 0 ; i < all.results.size() ; ++i )
+        scores[ all.results[ i ].row ] = all.results[ i ].score ;
+
+      bool same = ( threshold > 0 ) || ( kept.results.size() == all.results.size() ) ;
+      for( uint64_t i = 0 ; i < kept.results.size() ; ++i )
+        {
+        std::map<uint32_t, float>::const_iterator it = scores.find( kept.results[ i ].row ) ;
+        if( ( it == scores.end() ) || ( fabs( it->second - kept.results[ i ].score ) > 1.e-5 ) )
+          same = false ;
+        }
+      nqualifying += all.results.size() ;
+      nkept += kept.results.size() ;
+      if( !same )
+        ++nbad ;
+      }
+
+    std::cout<<makemytimebracketed()<<"Derived overlap at threshold "<<threshold<<": "
+             <<queries.size() - nbad<<" of "<<queries.size()<<" queries consistent, kept "
+             <<nkept<<" of "<<nqualifying<<" rows above threshold"<<( nbad == 0 ? " ok" : " FAILED" )<<std::endl ;
+    nfailed += ( nbad == 0 ) ? 0 : 1 ;
+    }
+  return( nfailed ) ;
+  }
+
+int main( int argc, char **argv )
+  {
+  if( argc < 2 )
+    {
+    std::cout<<"Usage: "<<argv[ 0 ]<<" <corpusfile>"<<std::endl ;
+    return 1 ;
+    }
+
+  std::vector<std::string> lines ;
+  if( !readlines( argv[ 1 ], lines ) || lines.size() < 2 )
+    {
+    std::cout<<"Could not read corpus file "<<argv[ 1 ]<<std::endl ;
+    return 1 ;
+    }
+
+  // Queries are corpus lines, every one of them as typed and with a letter dropped
+  std::vector<std::string> queries ;
+  uint64_t step = lines.size() / 20 + 1 ;
+  for( uint64_t i = 0 ; i < lines.size() ; i += step )
+    {
+    queries.push_back( lines[ i ] ) ;
+    if( lines[ i ].size() > 2 )
+      queries.push_back( lines[ i ].substr( 0, lines[ i ].size() / 2 ) + lines[ i ].substr( lines[ i ].size() / 2 + 1 ) ) ;
+    }
+
+  int nfailed = 0 ;
+  CosineHelper full( argv[ 1 ], stdcleaningtool ) ;
+  nfailed += full.checkdotkernels() ;
+  nfailed += checkbatch( full, queries, true ) ;
+  nfailed += checkbatch( full, queries, false ) ;
+  nfailed += checkinsert( full, lines, queries ) ;
+  nfailed += checkderivedoverlap( full, queries ) ;
+
+  std::cout<<makemytimebracketed()<<( nfailed == 0 ? "All checks ok" : "Some checks FAILED" )<<std::endl ;
+  return( nfailed ) ;
+  }
@@ -14,6 +14,43 @@ int main( int argc, char **argv )
   std::vector<std::vector<Result_t> > result ;
   struct timespec timetoload ;
   static CosineHelper *cos ;
+  Queryoptions_t options ;
+  Loadoptions_t loadoptions ;
+  const char* batchfile = NULL ;
+  const char* snapshotfile = NULL ;
+  const char* insertfile = NULL ;
+  const char* deletefile = NULL ;
+
+  for( int i = 3 ; i < argc ; ++i )   // Options following the corpus selection
+    {
+    if( ( strcmp( argv[ i ], "-b" ) == 0 ) && ( i + 1 < argc ) )
+      batchfile = argv[ ++i ] ;
+    else if( ( strcmp( argv[ i ], "-k" ) == 0 ) && ( i + 1 < argc ) )
+      options.maxresults = strtoul( argv[ ++i ], NULL, 10 ) ;
+    else if( ( strcmp( argv[ i ], "-t" ) == 0 ) && ( i + 1 < argc ) )
+      options.threshold = strtod( argv[ ++i ], NULL ) ;
+    else if( ( strcmp( argv[ i ], "-o" ) == 0 ) && ( i + 1 < argc ) )
+      options.minoverlap = strtoul( argv[ ++i ], NULL, 10 ) ;
+    else if( strcmp( argv[ i ], "-g" ) == 0 )
+      options.derivedoverlap = true ;
+    else if( strcmp( argv[ i ], "-c" ) == 0 )
+      loadoptions.compiledrows = true ;
+    else if( strcmp( argv[ i ], "-3" ) == 0 )
+      loadoptions.trigrams = true ;
+    else if( ( strcmp( argv[ i ], "-l" ) == 0 ) && ( i + 1 < argc ) )
+      loadoptions.loadbuffers = strtoul( argv[ ++i ], NULL, 10 ) ;
+    else if( ( strcmp( argv[ i ], "-w" ) == 0 ) && ( i + 1 < argc ) )
+      snapshotfile = argv[ ++i ] ;
+    else if( ( strcmp( argv[ i ], "-i" ) == 0 ) && ( i + 1 < argc ) )
+      insertfile = argv[ ++i ] ;
+    else if( ( strcmp( argv[ i ], "-d" ) == 0 ) && ( i + 1 < argc ) )
+      deletefile = argv[ ++i ] ;
+    else
+      {
+      std::cout<<"Unknown option "<<argv[ i ]<<std::endl ;
+      return 1 ;
+      }
+    }
 
 #ifdef _DEBUGCORPUS
   std::vector<std::string> debugcorpus = {  "jean",
@@ -37,8 +74,20 @@ int main( int argc, char **argv )
   if( argc == 1 )
     {
     std::cout<<"Usage: "<<argv[ 0 ]
-             <<"\n[ -f <filename> ] to be loaded "
+             <<"\n[ -f <filename> ] to be loaded, - for stdin, gzip or zstd compressed "
              <<"\n[ -n <value grater than 0> ] manual corpus to be loaded "
+             <<"\nfollowed by"
+             <<"\n[ -b <queryfile> ] match every line of queryfile and exit "
+             <<"\n[ -k <maxresults> ] results per query in batch mode, default 200 "
+             <<"\n[ -t <threshold> ] minimum score in batch mode, default 0 "
+             <<"\n[ -o <minoverlap> ] quadgrams a row must share with the input, default 1 "
+             <<"\n[ -g ] derive the quadgram overlap from the threshold, a heuristic that can drop rows above it "
+             <<"\n[ -c ] compile the rows at load time for faster scoring "
+             <<"\n[ -3 ] character trigram columns as well as bigrams "
+             <<"\n[ -l <buffers> ] blocks in flight while loading, default 6 "
+             <<"\n[ -i <file> ] append the lines of file as rows after loading "
+             <<"\n[ -d <file> ] delete the rows of the corpus lines numbered in file, from 0 "
+             <<"\n[ -w <snapshot> ] save the loaded index, -f <snapshot> loads it back "
              <<std::endl ;
     return 1 ;
     }
@@ -48,7 +97,7 @@ int main( int argc, char **argv )
     if( argc > 2 )
       {
       clock_gettime( CLOCK_REALTIME, &timetoload ) ;
-      cos = new CosineHelper( argv[ 2 ], stdcleaningtool ) ;
+      cos = new CosineHelper( argv[ 2 ], stdcleaningtool, loadoptions ) ;
       }
     else
       {
@@ -74,7 +123,7 @@ int main( int argc, char **argv )
       	inputcorpus.push_back( input ) ;
       	}
       clock_gettime( CLOCK_REALTIME, &timetoload ) ;
-      cos = new CosineHelper( inputcorpus, stdcleaningtool ) ;
+      cos = new CosineHelper( inputcorpus, stdcleaningtool, loadoptions ) ;
       }
     else
       {
@@ -82,6 +131,12 @@ int main( int argc, char **argv )
       return 1 ;
       }
     }
+
+  if( cos == NULL )
+    {
+    std::cout<<"Unknown corpus selection "<<argv[ 1 ]<<std::endl ;
+    return 1 ;
+    }
 #endif
 
   std::cout<<"Time to load the corpus: "<<compute_elapsed( timetoload )<<std::endl ;
@@ -93,17 +148,138 @@ int main( int argc, char **argv )
   std::cout<<std::endl ;
 #endif
 
+  if( insertfile != NULL )
+    {
+    std::vector<std::string> inserts ;
+    std::ifstream rowfile( insertfile ) ;
+    struct timespec insertstarttime ;
+
+    if( !rowfile.is_open() )
+      {
+      std::cout<<"Could not open insert file "<<insertfile<<std::endl ;
+      return 1 ;
+      }
+
+    while( getline( rowfile, input ) )
+      inserts.push_back( input ) ;
+
+    clock_gettime( CLOCK_REALTIME, &insertstarttime ) ;
+    uint64_t nadded = cos->insertrows( inserts ) ;
+    std::cout<<"Time to insert "<<nadded<<" rows: "<<compute_elapsed( insertstarttime )<<std::endl ;
+    }
+
+  if( deletefile != NULL )
+    {
+    std::vector<uint32_t> deletes ;
+    std::ifstream linefile( deletefile ) ;
+    struct timespec deletestarttime ;
+    uint32_t row ;
+
+    if( !linefile.is_open() )
+      {
+      std::cout<<"Could not open delete file "<<deletefile<<std::endl ;
+      return 1 ;
+      }
+
+    while( getline( linefile, input ) )
+      if( cos->linerow( strtoull( input.c_str(), NULL, 10 ), row ) )
+        deletes.push_back( row ) ;
+
+    clock_gettime( CLOCK_REALTIME, &deletestarttime ) ;
+    uint64_t ndeleted = cos->deleterows( deletes ) ;
+    std::cout<<"Time to delete "<<ndeleted<<" rows: "<<compute_elapsed( deletestarttime )<<std::endl ;
+    }
+
+  if( snapshotfile != NULL )
+    {
+    struct timespec savestarttime ;
+    clock_gettime( CLOCK_REALTIME, &savestarttime ) ;
+    if( !cos->savesnapshot( snapshotfile ) )
+      {
+      std::cout<<"Could not write snapshot "<<snapshotfile<<std::endl ;
+      return 1 ;
+      }
+    std::cout<<"Time to write the snapshot: "<<compute_elapsed( savestarttime )<<std::endl ;
+    }
+
   cos->stats() ;
+
+  Querycontext_t context ;
+  Queryresult_t queryresult ;
+  cos->initquerycontext( context ) ;
+
+  if( batchfile != NULL )
+    {
+    std::vector<std::string> queries ;
+    std::vector<Queryresult_t> batchresult ;
+    std::ifstream queryfile( batchfile ) ;
+    struct timespec batchstarttime ;
+
+    if( !queryfile.is_open() )
+      {
+      std::cout<<"Could not open query file "<<batchfile<<std::endl ;
+      return 1 ;
+      }
+
+    while( getline( queryfile, input ) )
+      queries.push_back( input ) ;
+
+    clock_gettime( CLOCK_REALTIME, &batchstarttime ) ;
+    batchresult = cos->batchquery( queries, options, context ) ;
+    double elapsed = compute_elapsed( batchstarttime ) ;
+
+    for( uint64_t q = 0 ; q < batchresult.size() ; ++q )
+      for( uint64_t i = 0 ; i < batchresult[ q ].results.size() ; ++i )
+        std::cout<<queries[ q ]<<"\t"<<i+1<<"\t"<<batchresult[ q ].results[ i ].part
+                 <<"\t"<<batchresult[ q ].results[ i ].score<<std::endl ;
+
+    std::cout<<"Batch of "<<queries.size()<<" queries: "<<elapsed<<" seconds ("
+             <<( queries.size() > 0 ? elapsed / queries.size() : 0 )<<" seconds per query)"<<std::endl ;
+    return 0 ;
+    }
   
   input.clear() ;
   while( true )
     {
     std::cout<<"\nEnter the input string for testing Cosine Similarity (quit to exit): "<<std::endl ;
     getline(std::cin,input) ;
-    if( input.compare("quit") )
-      result = cos->cosinematching( input ) ;
-    else
+    if( !input.compare("quit") || !std::cin.good() )
       return 0 ;
+
+    bool flag = true ;
+    while( flag )
+      {
+      try
+        {
+        std::string thresh ;
+        std::cout<<"Enter threshold: " ;
+        getline( std::cin, thresh ) ;
+        std::cout<<std::endl ;
+        options.threshold = std::stod( thresh ) ;
+        std::string max ;
+        std::cout<<"Enter maxresults: " ;
+        getline( std::cin, max ) ;
+        std::cout<<std::endl ;
+        options.maxresults = std::stoul( max ) ;
+        flag = false ;
+        }
+      catch( ... )
+        {
+        if( !std::cin.good() )
+          return 0 ;
+        std::cout<<"Must be integers! \n"<<std::endl ;
+        flag = true ;
+        }
+      }
+
+    std::cout<<"\nInput part before ->"<<input<<std::endl ;
+    std::cout<<"Input part after ->"<<stdcleaningtool( input )<<std::endl<<std::endl ;
+
+    queryresult = cos->query( input, options, context ) ;
+    result.assign( 1, queryresult.results ) ;
+
+    std::cout<<"Number of row multiplication -> "<<queryresult.counters.rowsscored<<std::endl ;
+    std::cout<<"Query time -> "<<queryresult.counters.elapsed<<" seconds"<<std::endl ;
     
     std::cout<<"\nCosine results ->"<<std::endl ;
     for( uint64_t i = 0 ; i < result[ 0 ].size() ; ++i )
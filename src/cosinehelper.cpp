@@ -1,62 +1,63 @@
 #include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "cosinehelper.h"
 
 using namespace std ;
 
+const uint32_t CosineHelper::nocolumn ;
+
 CosineHelper::CosineHelper( const char* file, 
-                            string ( *cleaner ) ( const string& dirtystring ) ) : filename( file ),
+                            string ( *cleaner ) ( const string& dirtystring ),
+                            const Loadoptions_t &options ) : filename( file ),
+                                                                                  nbigramcols( 0 ),
+                                                                                  ntrigramcols( 0 ),
+                                                                                  nwordcols( 0 ),
+                                                                                  nmatrixcols( 0 ),
                                                                                   totalnnzs( 0 ),
+                                                                                  idfrows( 0 ),
+                                                                                  rowschanged( 0 ),
+                                                                                  ndeleted( 0 ),
+                                                                                  generation( 0 ),
                                                                                   anchorwords( 15000 ),
-                                                                                  cleaningtool( *cleaner )
+                                                                                  cleaningtool( *cleaner ),
+                                                                                  loadoptions( options ),
+                                                                                  dotkernel( selectdotkernel() ),
+                                                                                  hashkernel( selecthashkernel() )
   {
   loadcorpus( filename ) ;
+  initquerycontext( defaultcontext ) ;
   }
 
 CosineHelper::CosineHelper( const std::vector<std::string> &inputcorpus,
-                            string ( *cleaner ) ( const string& dirtystring ) ) : totalnnzs( 0 ), cleaningtool( *cleaner )
+                            string ( *cleaner ) ( const string& dirtystring ),
+                            const Loadoptions_t &options ) : filename( NULL ),
+                                                                                  nbigramcols( 0 ),
+                                                                                  ntrigramcols( 0 ),
+                                                                                  nwordcols( 0 ),
+                                                                                  nmatrixcols( 0 ),
+                                                                                  totalnnzs( 0 ),
+                                                                                  idfrows( 0 ),
+                                                                                  rowschanged( 0 ),
+                                                                                  ndeleted( 0 ),
+                                                                                  generation( 0 ),
+                                                                                  cleaningtool( *cleaner ),
+                                                                                  loadoptions( options ),
+                                                                                  dotkernel( selectdotkernel() ),
+                                                                                  hashkernel( selecthashkernel() )
   {
   loadcorpus( inputcorpus ) ;
   dimensionwords() ;
   formmatrix() ;
   buildanchorwords() ;
+  initquerycontext( defaultcontext ) ;
   }
 
 CosineHelper::~CosineHelper()
   {
-  uint32_t wordlistsize = wordlist.size() ;
-
-  for( uint32_t i = 0 ; i < wordlistsize ; ++i )
-    {
-    if( wordlist[ i ].wordtext != NULL )
-      {
-      delete [] wordlist[ i ].wordtext ;
-      wordlist[ i ].wordtext = NULL ;
-      }
-
-    if( wordlist[ i ].rownnzs != NULL )
-      {
-      delete [] wordlist[ i ].rownnzs ;
-      wordlist[ i ].rownnzs = NULL ;
-      }
-    }
-  }
-
-FILE *CosineHelper::openblockreadfile( const string &filename )
-  {
-  static const string catter( "/usr/bin/ucat" ) ;
-  FILE *f ;
-  string command ;
-
-  command = catter + " " + filename + " 2>/dev/null < /dev/null" ;
-  f = popen( command.c_str(), "r" ) ;
-
-  return( f ) ;
-  }
-
-void CosineHelper::closeblockreadfile( FILE *f )
-  {
-  if( f != NULL )
-    pclose( f ) ;
   }
 
 string CosineHelper::defaultcleaningtool( const string &dirtystring )
@@ -75,12 +76,11 @@ void CosineHelper::loadcorpus( const std::vector<std::string> &inputcorpus )
     exit(1) ;
     }
 
+  linearenas.resize( 1 ) ;
   for( uint64_t i = 0 ; i < inputcorpussize ; ++i )
     {
     string cleaninput = cleaningtool( inputcorpus[ i ] ) ;
-    uint32_t cleaninputsize = cleaninput.size() ;
-    corpusdata[ i ] = new char[ cleaninputsize + 1 ] ;
-    strcpy(  corpusdata[ i ], cleaninput.c_str() ) ;
+    corpusdata[ i ] = linearenas[ 0 ].copystring( cleaninput.data(), cleaninput.size() ) ;
     }
   }
 
@@ -93,58 +93,36 @@ void CosineHelper::loadcorpus( const char* filename )
   cout << makemytimebracketed() << "Loading address file \"" << filename << "\"..." << endl ;
   clock_gettime( CLOCK_REALTIME, &loadstarttime ) ;
   clock_gettime( CLOCK_REALTIME, &stepstarttime ) ;
-  corpusdata.reserve( 62000000 ) ;
-
-  FILE *f = openblockreadfile( filename ) ;
-  
-  if( f != NULL )
-    {
-    const uint64_t preferredbufsize = 32UL * 1024ULL * 1024ULL ;
-    const uint64_t reportinterval = 10000000ULL ;
-    uint64_t nextreport = reportinterval ;
-    string buffer[2] ;
-    uint64_t switchbuffer = 0 ;
-    bool bufferread ;
-    string preread ;
-    uint64_t nlinesinfile = 0 ;
-    uint64_t nbytesinfile = 0 ;
-
-    getvmstats( vmsize, vmpeak ) ;
-    cout << makemytimebracketed() << "         VmSize: " << vmsize << "  VmPeak: " << vmpeak << endl ;
-    
-    bufferread = readblockreadfile( f, preferredbufsize, preread, buffer[ switchbuffer ] ) ;
 
-    omp_set_nested( 1 ) ; // Need this for nested parallelism
-
-#pragma omp parallel num_threads( 2 )
+  if( Snapshotmap::issnapshot( filename ) )
     {
-    while( bufferread )
-      {
-#pragma omp single nowait
-      bufferread = readblockreadfile( f, preferredbufsize, preread, buffer[ !switchbuffer ] ) ;
-
-#pragma omp single
+    if( loadsnapshot( filename ) )
       {
-      processblock( nbytesinfile, nlinesinfile, buffer[ switchbuffer ] ) ;
-      if( nlinesinfile >= nextreport )
-        {
-        cout << makemytimebracketed() << "  ...processed " << nlinesinfile << " corpus data" << endl ;
-        getvmstats( vmsize, vmpeak ) ;
-        cout << makemytimebracketed() << "         VmSize: " << vmsize << "  VmPeak: " << vmpeak << endl ;
+      cout << makemytimebracketed() << "...Snapshot loaded, Matrix dimension: " << corpus.size() << " X " << nmatrixcols
+           << ", " << vocabulary.size() << " unique words (" << compute_elapsed( stepstarttime ) << " seconds)" << endl ;
+      cout <<"                                    Total non-zeros: "<<totalnnzs<<endl ;
+      getvmstats( vmsize, vmpeak ) ;
+      cout << makemytimebracketed() << "         VmSize: " << vmsize << "  VmPeak: " << vmpeak << endl ;
+      }
+    else
+      cout<<"Error:: Could not load corpus"<<endl ;
+    return ;
+    }
 
-        nextreport = nlinesinfile + reportinterval ;
-        }
-      switchbuffer = !switchbuffer ;
-      } // end of single, relying on implied barrier
-      } // end of while 
-    } // end of parallel
+  corpusdata.reserve( 62000000 ) ;
 
-    omp_set_nested( 0 ) ; // switching off nested parallelism
+  uint64_t nlinesinfile = 0 ;
+  uint64_t nbytesinfile = 0 ;
 
-    processblock( nbytesinfile, nlinesinfile, buffer[ switchbuffer ] ) ;
+  getvmstats( vmsize, vmpeak ) ;
+  cout << makemytimebracketed() << "         VmSize: " << vmsize << "  VmPeak: " << vmpeak << endl ;
 
-    closeblockreadfile( f ) ;
+  bool loaded = mapcorpusfile( filename, nbytesinfile, nlinesinfile ) ;
+  if( !loaded )
+    loaded = streamcorpusfile( filename, nbytesinfile, nlinesinfile ) ;
 
+  if( loaded )
+    {
     cout << makemytimebracketed() << "...[1/4] Complete (" << compute_elapsed( stepstarttime ) << " seconds)" << "\n" ;
     cout << makemytimebracketed() << "         Filesize:             " << nbytesinfile << "\n" ;
     cout << makemytimebracketed() << "         Lines in File      " << nlinesinfile << "\n" ;
@@ -158,7 +136,7 @@ void CosineHelper::loadcorpus( const char* filename )
     
     dimensionwords() ;
 
-    cout << makemytimebracketed() << "...[2/4] Complete " << wordstolist.size() << " unique words ("
+    cout << makemytimebracketed() << "...[2/4] Complete " << vocabulary.size() << " unique words ("
          << compute_elapsed( stepstarttime ) << " seconds)" << endl ;
     cout << makemytimebracketed() << "         Corpus Size:          " << corpus.size() << "\n" ;
     getvmstats( vmsize, vmpeak ) ;
@@ -172,6 +150,9 @@ void CosineHelper::loadcorpus( const char* filename )
     cout << makemytimebracketed() << "...[3/4] Complete Matrix dimension: " << corpus.size() << " X " << nmatrixcols
          << " (" << compute_elapsed( stepstarttime ) << " seconds)" <<endl ;
     cout <<"                                    Total non-zeros: "<<totalnnzs<<endl ;
+    if( loadoptions.compiledrows )
+      cout << makemytimebracketed() << "         Compiled rows:     " << csrentries.size() - corpus.size() << " entries, "
+           << csrentries.size() * sizeof( Entry_t ) + csrrowstart.size() * sizeof( uint64_t ) << " bytes" << endl ;
     getvmstats( vmsize, vmpeak ) ;
     cout << makemytimebracketed() << "         VmSize: " << vmsize << "  VmPeak: " << vmpeak << endl ;
 
@@ -190,7 +171,206 @@ void CosineHelper::loadcorpus( const char* filename )
     cout<<"Error:: Could not load corpus"<<endl ;
   }
 
-bool CosineHelper::readblockreadfile( FILE *f,
+// Plain files are mapped and their lines go through the load pipeline in
+// place, pages already turned into corpus entries are dropped.  false,
+// having read nothing, when the file cannot be mapped ( stdin, a pipe, a
+// device ... ) or is compressed.
+bool CosineHelper::mapcorpusfile( const char* filename,
+                                  uint64_t &nbytesinfile,
+                                  uint64_t &nlinesinfile )
+  {
+  if( strcmp( filename, "-" ) == 0 )
+    return( false ) ;
+
+  int fd = open( filename, O_RDONLY ) ;
+  if( fd < 0 )
+    return( false ) ;
+
+  struct stat filestat ;
+  if( ( fstat( fd, &filestat ) != 0 ) || !S_ISREG( filestat.st_mode ) || ( filestat.st_size == 0 ) )
+    {
+    close( fd ) ;
+    return( false ) ;
+    }
+
+  uint64_t len = filestat.st_size ;
+  void* mapped = mmap( NULL, len, PROT_READ, MAP_PRIVATE, fd, 0 ) ;
+  close( fd ) ;
+  if( mapped == MAP_FAILED )
+    return( false ) ;
+
+  if( Blockreader::detectformat( ( const unsigned char* ) mapped, len ) != Blockreader::plainformat )
+    {
+    munmap( mapped, len ) ;
+    return( false ) ;
+    }
+
+  madvise( mapped, len, MADV_SEQUENTIAL ) ;
+  cout << makemytimebracketed() << "         Reading mapped file, " << len << " bytes" << endl ;
+
+  const char* data = ( const char* ) mapped ;
+  const uint64_t pagesize = sysconf( _SC_PAGESIZE ) ;
+  uint64_t start = 0 ;
+  uint64_t released = 0 ;
+
+  runloadpipeline( [ & ]( Loadslot_t &slot )
+    {
+    // The block the slot held is in the corpus, and so is everything before it
+    if( slot.data != NULL )
+      {
+      uint64_t releasable = ( ( slot.data + slot.len - data ) / pagesize ) * pagesize ;
+      if( releasable > released )
+        {
+        madvise( ( char* ) mapped + released, releasable - released, MADV_DONTNEED ) ;
+        released = releasable ;
+        }
+      }
+
+    uint64_t stop = ( len - start > loadblocksize ) ? start + loadblocksize : len ;
+    const char* newline = ( const char* ) memchr( data + stop - 1, '\n', len - stop + 1 ) ;
+    stop = ( newline != NULL ) ? ( newline - data ) + 1 : len ;
+    slot.data = data + start ;
+    slot.len = stop - start ;
+    slot.last = ( stop == len ) ;
+    start = stop ;
+    }, nbytesinfile, nlinesinfile ) ;
+
+  if( data[ len - 1 ] != '\n' )      // Last line without its newline
+    ++nlinesinfile ;
+
+  munmap( mapped, len ) ;
+  return( true ) ;
+  }
+
+// Streams stdin, pipes, compressed files and anything else that cannot be
+// mapped through the load pipeline, the reader stage decompresses
+bool CosineHelper::streamcorpusfile( const char* filename,
+                                     uint64_t &nbytesinfile,
+                                     uint64_t &nlinesinfile )
+  {
+  Blockreader reader ;
+  if( !reader.open( filename ) )
+    return( false ) ;
+
+  cout << makemytimebracketed() << "         Reading streamed " << Blockreader::formatname( reader.fileformat() )
+       << " file" << endl ;
+
+  string preread ;
+
+  runloadpipeline( [ & ]( Loadslot_t &slot )
+    {
+    slot.last = !readblockreadfile( reader, loadblocksize, preread, slot.text ) ;
+    slot.data = slot.text.data() ;
+    slot.len = slot.text.size() ;
+    }, nbytesinfile, nlinesinfile ) ;
+
+  if( reader.corrupt() )
+    cout << makemytimebracketed() << "Warning:: compressed input is truncated or corrupt, loaded what decompressed" << endl ;
+  reader.close() ;
+  return( true ) ;
+  }
+
+// Loads the blocks fill() produces through a ring of loadbuffers slots and
+// one thread per stage: the reader fills a slot, the splitter finds its
+// lines, the cleaner runs cleaningtool over them with nested threads and
+// the globalizer appends them to corpusdata.  Every stage takes the slots
+// in file order, so the corpus keeps the order of the file while reading,
+// cleaning and appending different blocks overlap.
+void CosineHelper::runloadpipeline( const std::function<void ( Loadslot_t &slot )> &fill,
+                                    uint64_t &nbytesinfile,
+                                    uint64_t &nlinesinfile )
+  {
+  const uint32_t nslots = ( loadoptions.loadbuffers > 2 ) ? loadoptions.loadbuffers : 2 ;
+  const int ncleaners = omp_get_max_threads() ;
+  const char* stagenames[ nloadstages ] = { "reader", "splitter", "cleaner", "globalizer" } ;
+  vector<Loadslot_t> ring( nslots ) ;
+  if( linearenas.size() < uint64_t( ncleaners ) )
+    linearenas.resize( ncleaners ) ;
+  mutex ringlock ;
+  condition_variable ringchanged ;
+  double busy[ nloadstages ] = { 0 } ;
+  uint64_t nblocks = 0 ;
+  uint64_t nextreport = loadreportinterval ;
+  uint64_t nextline = 0 ;
+  double starttime = omp_get_wtime() ;
+
+  omp_set_nested( 1 ) ; // The cleaner runs its own parallel region
+
+#pragma omp parallel num_threads( nloadstages )
+  {
+  // Normally a thread per stage, a short team takes turns over them
+  int nthreads = omp_get_num_threads() ;
+  int first = omp_get_thread_num() ;
+  bool done = false ;
+
+  for( uint64_t block = 0 ; !done ; ++block )
+    {
+    Loadslot_t &slot = ring[ block % nslots ] ;
+    for( int stage = first ; stage < nloadstages ; stage += nthreads )
+      {
+        {
+        unique_lock<mutex> lock( ringlock ) ;
+        ringchanged.wait( lock, [ & ] { return( slot.stage == uint32_t( stage ) ) ; } ) ;
+        }
+
+      double stagestart = omp_get_wtime() ;
+      switch( stage )
+        {
+        case readstage :
+          fill( slot ) ;
+          break ;
+        case splitstage :
+          splitblock( slot, nextline ) ;
+          break ;
+        case cleanstage :
+          cleanblock( slot, ncleaners ) ;
+          break ;
+        case globalizestage :
+          corpusdata.insert( corpusdata.end(), slot.entries.begin(), slot.entries.end() ) ;
+          slot.entries.clear() ;
+          nbytesinfile += slot.len ;
+          nlinesinfile += slot.nlines ;
+          ++nblocks ;
+          reportload( nlinesinfile, nextreport ) ;
+          break ;
+        }
+      busy[ stage ] += omp_get_wtime() - stagestart ;
+      done = slot.last ;
+
+        {
+        lock_guard<mutex> lock( ringlock ) ;
+        slot.stage = ( stage + 1 ) % nloadstages ;
+        }
+      ringchanged.notify_all() ;
+      }
+    }
+  } // end of parallel
+
+  omp_set_nested( 0 ) ;
+
+  double elapsed = omp_get_wtime() - starttime ;
+  cout << makemytimebracketed() << "         Load stages busy over " << nblocks << " blocks, " << nslots << " buffers:" ;
+  for( int stage = 0 ; stage < nloadstages ; ++stage )
+    cout << " " << stagenames[ stage ] << " " << fixed << setprecision( 0 )
+         << ( ( elapsed > 0 ) ? 100 * busy[ stage ] / elapsed : 0 ) << "%" ;
+  cout << defaultfloat << setprecision( 6 ) << endl ;
+  }
+
+void CosineHelper::reportload( uint64_t nlinesinfile, uint64_t &nextreport )
+  {
+  if( nlinesinfile >= nextreport )
+    {
+    uint64_t vmsize ;
+    uint64_t vmpeak ;
+    cout << makemytimebracketed() << "  ...processed " << nlinesinfile << " corpus data" << endl ;
+    getvmstats( vmsize, vmpeak ) ;
+    cout << makemytimebracketed() << "         VmSize: " << vmsize << "  VmPeak: " << vmpeak << endl ;
+
+    nextreport = nlinesinfile + loadreportinterval ;
+    }
+  }
+
+bool CosineHelper::readblockreadfile( Blockreader &reader,
                                      uint64_t preferredbufsize,
                                      string &prereaddata,
                                      string &buffer )
@@ -205,29 +385,21 @@ bool CosineHelper::readblockreadfile( FILE *f,
   if( nreserve < preferredbufsize )
     nreserve = preferredbufsize ;
 
-  if( f == NULL )               // better not happen
+  buffer.resize( nreserve ) ;
+  for( uint64_t i = 0 ; i < npreread ; ++i )
+    buffer[ i ] = prereaddata[ i ] ;
+
+  uint64_t maxread = nreserve - npreread ;
+  uint64_t nread = reader.read( &( buffer[ npreread ] ), maxread ) ;
+  if( nread < maxread )
     {
-    buffer = prereaddata ;
+    buffer.resize( npreread + nread ) ;
+    if( ( buffer.size() > 0 ) && ( buffer[ buffer.size() - 1 ] != '\n' ) )
+      buffer.push_back( '\n' ) ;
     filehasmoredata = false ;
     }
   else
-    {
-    buffer.resize( nreserve ) ;
-    for( uint64_t i = 0 ; i < npreread ; ++i )
-      buffer[ i ] = prereaddata[ i ] ;
-
-    uint64_t maxread = nreserve - npreread ;
-    uint64_t nread = fread( ( void * ) &( buffer[ npreread ] ), 1, maxread, f ) ;
-    if( nread < maxread )
-      {
-      buffer.resize( npreread + nread ) ;
-      if( ( buffer.size() > 0 ) && ( buffer[ buffer.size() - 1 ] != '\n' ) )
-        buffer.push_back( '\n' ) ;
-      filehasmoredata = false ;
-      }
-    else
-      extractpreread( prereaddata, buffer ) ;
-    }
+    extractpreread( prereaddata, buffer ) ;
 
   return( filehasmoredata ) ;
   }
@@ -263,117 +435,84 @@ void CosineHelper::extractpreread( string &preread, string &buffer )
     }
   }
 
-void CosineHelper::processblock( uint64_t &nread, uint64_t &nlines,
-                                const string &buffer )
-  {
-  uint64_t nbuffer ;
-  uint64_t nlinesinbuffer = 0 ;
-
-  nbuffer = buffer.size() ;
-
-#pragma omp parallel
+// Records the nonempty lines of the block and counts its newlines.  Runs
+// over the blocks in file order, nextline numbers the lines and blank ones
+// go to emptylines.
+void CosineHelper::splitblock( Loadslot_t &slot, uint64_t &nextline )
   {
-  uint64_t  mycount = 0 ;
-#pragma omp for schedule( static ) nowait
-  for( uint64_t i = 0 ; i < nbuffer ; ++i )
-    if( buffer[ i ] == '\n' )
-      ++mycount ;
+  const char* data = slot.data ;
+  const char* end = data + slot.len ;
+  slot.lines.clear() ;
+  slot.nlines = 0 ;
 
-#pragma omp atomic
-  nlinesinbuffer += mycount ;
-  } // parallel
-
-  if( nbuffer > 0 )
+  for( const char* begin = data ; begin < end ; ++nextline )
     {
-    // Must have parallel here rather than in the routines as
-    // thread count in parallel regions must not change during
-    // this processing
-
-    vector<uint64_t> bufstarts ;
-
-#pragma omp parallel
+    const char* newline = ( const char* ) memchr( begin, '\n', end - begin ) ;
+    const char* stop = ( newline != NULL ) ? newline : end ;
+    if( stop > begin )
       {
-#pragma omp single
-      computestarts( buffer, bufstarts ) ;
-      
-      prepcorpus( buffer, bufstarts ) ;
-      } // End of Parallel, implied barrier
+      slot.lines.push_back( begin - data ) ;
+      slot.lines.push_back( stop - data ) ;
+      }
+    else
+      emptylines.push_back( nextline ) ;
+    if( newline != NULL )
+      ++slot.nlines ;
+    begin = stop + 1 ;
     }
-
-  nread += nbuffer ;
-  nlines += nlinesinbuffer ;
   }
 
-void CosineHelper::prepcorpus( const string &buf,
-                               vector<uint64_t> &bufstarts )  // Inside parallel region
+void CosineHelper::cleanblock( Loadslot_t &slot, int ncleaners )
   {
-  vector<char*> mycorpusentries ;
-  mycorpusentries.reserve( 2000000 ) ;
-  string entrystr ;
-  uint64_t myid = omp_get_thread_num() ;
-  uint64_t stop = bufstarts[ myid + 1 ] ;
+  const char* data = slot.data ;
+  const vector<uint64_t> &lines = slot.lines ;
+  uint64_t nentries = lines.size() / 2 ;
+  slot.entries.resize( nentries ) ;
 
+#pragma omp parallel num_threads( ncleaners )
+  {
+  string entrystr ;
   entrystr.reserve( 512 ) ;
+  Arena &arena = linearenas[ omp_get_thread_num() ] ;
 
-  for( uint64_t i = bufstarts[ myid ] ; i < stop ; )
+#pragma omp for schedule( dynamic, 4096 )
+  for( uint64_t i = 0 ; i < nentries ; ++i )
     {
-    uint64_t j = i ;
-    while( ( i < stop ) && ( buf[ i ] != '\n' ) )
-      ++i ;
-
-    if( i > j )
-      {
-      entrystr.resize( i - j ) ;
-      for( uint64_t k = j ; k < i ; ++k )
-        entrystr[ k - j ] = buf[ k ] ;
-
-      entrystr = cleaningtool( entrystr ) ;
-      char* temp ;
-      temp = new char[ entrystr.length() + 1 ] ;
-      strcpy( temp, entrystr.c_str() ) ;
-      mycorpusentries.push_back( temp ) ;
-      }
-    if( i < stop )
-      ++i ;
+    entrystr.assign( data + lines[ 2 * i ], lines[ 2 * i + 1 ] - lines[ 2 * i ] ) ;
+    entrystr = cleaningtool( entrystr ) ;
+    slot.entries[ i ] = arena.copystring( entrystr.data(), entrystr.size() ) ;
     }
+  } // parallel
+  }
 
-#pragma omp critical( globalize_corpus )
-    {
-    uint32_t corpussize = corpusdata.size() ;
-    uint32_t mycorpusentriessize = mycorpusentries.size() ;
-    corpusdata.resize( corpussize + mycorpusentriessize ) ;
-    for( uint32_t i = 0 ; i < mycorpusentriessize ; ++i )
-      corpusdata[ corpussize + i ] = mycorpusentries[ i ] ;
-    } // end of critical
-
+// The row's line is row plus the blank lines before it, the first k with
+// emptylines[ k ] - k past row counts them
+uint64_t CosineHelper::rowline( uint32_t row ) const
+  {
+  uint64_t lo = 0 ;
+  uint64_t hi = emptylines.size() ;
+  while( lo < hi )
     {
-    vector<char*>().swap( mycorpusentries ) ;
+    uint64_t mid = ( lo + hi ) / 2 ;
+    if( emptylines[ mid ] - mid <= row )
+      lo = mid + 1 ;
+    else
+      hi = mid ;
     }
-#pragma omp barrier
+  return( row + lo ) ;
   }
 
-void CosineHelper::computestarts( const string &buf,
-                                 vector<uint64_t> &bufstarts )
+bool CosineHelper::linerow( uint64_t line, uint32_t &row ) const
   {
-  uint64_t nthread = omp_get_num_threads() ;
-  uint64_t len     = buf.size() ;
-
-  uint64_t nper = buf.size() / nthread ;
-  if( nper == 0 )
-    nper = 1 ;
-
-  bufstarts.resize( nthread + 1 ) ;
-  bufstarts[ nthread ] = len ;
-  bufstarts[ 0 ] = 0 ;
-  for( uint64_t thread = 1 ; thread < nthread ; ++thread )
-    {
-    uint64_t offset = bufstarts[ thread - 1 ] + nper ;
-    for( ; offset < len ; ++offset )
-      if( buf[ offset ] == '\n' )
-        break ;
-
-    bufstarts[ thread ] = ( offset < len ) ? offset + 1 : len ;
-    }
+  const uint64_t* it = lower_bound( emptylines.begin(), emptylines.end(), line ) ;
+  if( ( it != emptylines.end() ) && ( *it == line ) )
+    return( false ) ;
+
+  uint64_t candidate = line - ( it - emptylines.begin() ) ;
+  if( candidate >= corpus.size() )
+    return( false ) ;
+  row = candidate ;
+  return( true ) ;
   }
 
 void CosineHelper::stats( void )
@@ -382,43 +521,51 @@ void CosineHelper::stats( void )
   cout<<"nbigramcols  ->"<<nbigramcols<<endl
       <<"ntrigramcols ->"<<ntrigramcols<<endl
       <<"nwordcols    ->"<<nwordcols<<endl
-      <<"nmatrixcols  ->"<<nmatrixcols<<endl ;
+      <<"nmatrixcols  ->"<<nmatrixcols<<endl
+      <<"dotkernel    ->"<<dotkernelname( dotkernel )<<endl ;
+  if( loadoptions.compiledrows )
+    cout<<"compiledrows ->"<<csrentries.size() - corpus.size()<<" entries"<<endl ;
+  if( snapshot.size() > 0 )
+    cout<<"snapshot     ->"<<snapshot.size()<<" bytes mapped shared"<<endl ;
   }
 
+// Inside parallel region.  Every thread gathers the words of its rows into
+// its own shards, then the shards are merged and numbered in parallel
 void CosineHelper::collectwords( )
   {
-  Splitwords corpuswords ;
-  unordered_set<string> mywords ;
   uint32_t corpussize = corpusdata.size() ;
-  const uint32_t nchunk = 500000 ;
 
-  for( uint32_t ii = 0 ; ii < corpussize ; ii += nchunk )
-    {
-    uint32_t len = ( ( corpussize - ii ) < nchunk ) ? ( corpussize - ii ) : nchunk ;
+#pragma omp single
+  wordpartials.assign( omp_get_num_threads(), vector<Wordtable>( Vocabulary::nshards ) ) ;
 
-#pragma omp for schedule ( static )
-    for( uint32_t i = 0 ; i < len ; ++i )
-      { 
-      uint32_t nwords = corpuswords.split( corpusdata[ ii + i ], ' ', false ) ;
-      for( uint32_t j = 0 ; j < nwords ; ++j )
-        if( wordstolist.find( corpuswords[ j ] ) == wordstolist.end() )
-          mywords.insert( corpuswords[ j ] ) ;
-      }
+  vector<Wordtable> &mywords = wordpartials[ omp_get_thread_num() ] ;
 
-#pragma omp critical( globalize )
+#pragma omp for schedule( static )
+  for( uint32_t i = 0 ; i < corpussize ; ++i )
     {
-    unordered_set<string>::const_iterator it ;
-    for( it = mywords.begin() ; it != mywords.end() ; ++it )
-      if( wordstolist.find( *it ) == wordstolist.end() )
-        wordstolist.insert( pair<string,uint32_t>( *it, nwordcols++ ) ) ;
-    } // end of critical
+    const char* p = corpusdata[ i ] ;
+    const char* word ;
+    size_t len ;
+    for( uint64_t position = 0 ; nextword( p, ' ', word, len ) ; ++position )
+      {
+      uint64_t hash = hashword( word, len ) ;
+      bool added ;
+      Vocabentry_t* entry = mywords[ Vocabulary::shardof( hash ) ].insert( word, len, hash, added ) ;
+      if( added )         // Rows come in order, the first sighting is the earliest
+        entry->firstseen = ( uint64_t( i ) << 32 ) | position ;
+      }
+    } // end of for, implied barrier
 
-    mywords.clear() ;
-#pragma omp barrier
-    } // end of for
+  vocabulary.merge( wordpartials ) ;
+
+#pragma omp single
+    {
+    vector<vector<Wordtable> >().swap( wordpartials ) ;
+    nwordcols = vocabulary.size() + 1 ;
+    } // end of single, implied barrier
   }
 
-string CosineHelper::getcorpustext( uint32_t index )
+string CosineHelper::getcorpustext( uint32_t index ) const
   {
   string corpustext ;
   uint32_t rowinfoindex = corpus[ index ].rowinfoindex ;
@@ -426,7 +573,7 @@ string CosineHelper::getcorpustext( uint32_t index )
   for( uint32_t i = 1 ; i <= nword ; ++i )
     {
     uint32_t wordind = corpusrowinfo[ rowinfoindex + i ] ;
-    corpustext = corpustext + wordlist[ wordind ].wordtext + " " ;
+    corpustext = corpustext + wordtext( wordind ) + " " ;
     }
   
   return corpustext ;
@@ -439,7 +586,7 @@ string CosineHelper::getcorpusmatrixform( uint32_t rowinfoindex )
   for( uint32_t i = 1 ; i <= nword ; ++i )
     {
     uint32_t wordind = corpusrowinfo[ rowinfoindex + i ] ;
-    uint32_t* sparserow = wordlist[ wordind ].rownnzs ;
+    const Entry_t* sparserow = wordrow( wordind ) ;
     uint32_t wordnnzs = sparserow[ 0 ] ;
     for( uint32_t j = 1 ; j <= wordnnzs ; ++j )
       {
@@ -451,143 +598,182 @@ string CosineHelper::getcorpusmatrixform( uint32_t rowinfoindex )
   return corpusrowform ;
   }
 
-void CosineHelper::formcorpus()
+// Inside parallel region.  Rows are laid out in corpusrowinfo in row order:
+// every thread counts the words of its share of the rows, a prefix sum over
+// the shares places them and the rows are then written in place.  No
+// critical section, and the same layout whatever the thread count.
+void CosineHelper::formcorpus( vector<uint64_t> &sharestart )
   {
-  Splitwords rowword ;
   uint32_t corpussize = corpusdata.size() ;
-  unordered_map<string, uint32_t>::iterator it ;
-  const uint32_t nchunk = 500000 ;
-  vector<uint32_t> indexvec ;
-  indexvec.reserve( 200000 ) ;
+  uint32_t nthreads = omp_get_num_threads() ;
+  uint32_t myid = omp_get_thread_num() ;
+  uint32_t myfirst = uint64_t( corpussize ) * myid / nthreads ;
+  uint32_t mylast = uint64_t( corpussize ) * ( myid + 1 ) / nthreads ;
+  const char* word ;
+  size_t wordlen ;
 
 #pragma omp single
     {
-    wordlist.resize( wordstolist.size() + 1 ) ;
+    wordlist.resize( vocabulary.size() + 1 ) ;
     corpus.resize( corpussize ) ;
-
-    // The zeroth is for all unknown words, All unknown words are mapped here 
-    wordlist[ 0 ].wordtext = new char[ 1 ] ;
-    wordlist[ 0 ].wordtext[ 0 ] = '\0' ;
-    wordlist[ 0 ].rownnzs = new uint32_t[ 1 ] ;
-    wordlist[ 0 ].rownnzs[ 0 ] = 0 ;
+    sharestart.assign( nthreads + 1, 0 ) ;
+
+    // Word texts go one after the other into wordtexts, in word order.
+    // The zeroth is for all unknown words, All unknown words are mapped here
+    uint32_t wordslistsize = wordlist.size() ;
+    vector<const char*> texts( wordslistsize, NULL ) ;
+    vector<uint32_t> lens( wordslistsize, 0 ) ;
+    uint64_t ntextbytes = wordslistsize ;
+    vocabulary.foreach( [ & ]( const char* text, uint32_t len, uint32_t id )
+      {
+      texts[ id ] = text ;
+      lens[ id ] = len ;
+      ntextbytes += len ;
+      } ) ;
+
+    wordtexts.resize( ntextbytes ) ;
+    char* text = wordtexts.writable() ;
+    Wordform_t* words = wordlist.writable() ;
+    uint64_t at = 0 ;
+    for( uint32_t i = 0 ; i < wordslistsize ; ++i )
+      {
+      uint64_t len = lens[ i ] ;
+      if( len > 0 )
+        memcpy( text + at, texts[ i ], len ) ;
+      text[ at + len ] = '\0' ;
+      words[ i ].wordtext = at ;
+      words[ i ].rownnzs = 0 ;
+      at += len + 1 ;
+      }
     } // end of single
 
-  uint32_t wordslistsize = wordlist.size() ;
-
-#pragma omp for schedule( static )
-  for( uint32_t i = 1 ; i < wordslistsize ; ++i )
+  // Word counts parked in rowinfoindex until the rows are placed
+  uint64_t mysize = 0 ;
+  for( uint32_t row = myfirst ; row < mylast ; ++row )
     {
-    wordlist[ i ].wordtext = NULL ;
-    wordlist[ i ].rownnzs  = NULL ;
+    uint32_t nwords = 0 ;
+    for( const char* p = corpusdata[ row ] ; nextword( p, ' ', word, wordlen ) ; )
+      ++nwords ;
+    corpus[ row ].rowinfoindex = nwords ;
+    mysize += nwords + 1 ;
     }
+  sharestart[ myid + 1 ] = mysize ;
+#pragma omp barrier
 
-#pragma omp for schedule( static )
-  for( uint32_t ii = 0 ; ii < corpussize ; ii += nchunk )
+#pragma omp single
     {
-    uint32_t len = ( ( corpussize - ii ) < nchunk ) ? ( corpussize - ii ) : nchunk ;
-    indexvec.clear() ;
-
-    for( uint32_t i = 0 ; i < len ; ++i )
-      {
-      uint32_t nword = rowword.split( corpusdata[ ii + i ], ' ', false ) ;
-      indexvec.push_back( ii + i ) ;
-      indexvec.push_back( nword ) ;
-      
-      delete [] corpusdata[ ii + i ] ;
-      corpusdata[ ii + i ] = NULL ;
-      
-      for( uint32_t j = 0 ; j < nword ; ++j )
-        {
-        // Find it in the wordtolist map and add it to wordlist
-        it = wordstolist.find( rowword[ j ] ) ;
-
-        if( it == wordstolist.end() )
-          cout<<"ERROR: Not found in wordstolist"<<endl ;
-
-        uint32_t index = it->second ;
+    for( uint32_t t = 1 ; t <= nthreads ; ++t )
+      sharestart[ t ] += sharestart[ t - 1 ] ;
+    corpusrowinfo.resize( sharestart[ nthreads ] ) ;
+    } // end of single, implied barrier
 
-        if( wordlist[ index ].wordtext == NULL )
-          {
-          uint32_t rowwordsize = rowword[ j ].size() ;
-          wordlist[ index ].wordtext = new char[ rowwordsize + 1 ] ;  
-          memcpy( wordlist[ index ].wordtext, rowword[ j ].data(), rowwordsize ) ;
-          wordlist[ index ].wordtext[ rowwordsize ] = '\0' ;
-          }
+  uint64_t rowinfoindex = sharestart[ myid ] ;
+  for( uint32_t row = myfirst ; row < mylast ; ++row )
+    {
+    corpusrowinfo[ rowinfoindex ] = corpus[ row ].rowinfoindex ;
+    corpus[ row ].rowinfoindex = rowinfoindex++ ;
 
-        // Copy the index values to corpus
-        indexvec.push_back( index ) ;
-        }
-      } // end of nested for
-#pragma omp critical( globalize_vector )
+    for( const char* p = corpusdata[ row ] ; nextword( p, ' ', word, wordlen ) ; )
       {
-      uint32_t nindexvec = indexvec.size() ;
-      uint32_t i = 0 ;
-      while( i < nindexvec )
-        {
-        uint32_t rownum = indexvec[ i ] ;
-        uint32_t nwords = indexvec[ i + 1 ] ;
-        uint32_t rowinfoindex = corpusrowinfo.size() ;
-        corpusrowinfo.resize( rowinfoindex + nwords + 1 ) ;
-        corpusrowinfo[ rowinfoindex ] = nwords ;
-
-        for( uint32_t j = 0 ; j < nwords ; ++j )
-          corpusrowinfo[ rowinfoindex + j + 1 ] = indexvec[ i + j + 2 ] ;
+      uint32_t index = vocabulary.find( word, wordlen ) ;
 
-        corpus[ rownum ].rowinfoindex = rowinfoindex ;
+      if( index == 0 )
+        cout<<"ERROR: Not found in vocabulary"<<endl ;
 
-        i += nwords + 2 ;
-        }
+      corpusrowinfo[ rowinfoindex++ ] = index ;
       }
-    } // end of chunking for
+    }
 #pragma omp barrier
   }
 
 void CosineHelper::dimensionwords()
   {
-  wordstolist.clear() ;
-  wordstolist.reserve( 2000000 ) ;
+  vocabulary.clear() ;
   nwordcols = 1 ;
+  vector<uint64_t> sharestart ;       // formcorpus, where each thread's rows start in corpusrowinfo
 
 #pragma omp parallel
     {
     collectwords( ) ;
 
-    formcorpus() ;
+    formcorpus( sharestart ) ;
+    } // end of parallel
+
+    {
+    vector<char*>().swap( corpusdata ) ;
+    vector<Arena>().swap( linearenas ) ;
+    } 
+
+    dimensionngrams() ;
+    nmatrixcols = nbigramcols + ntrigramcols + nwordcols ;
+  }
+
+// Numbers the bigrams and trigrams the words have, for the enabled
+// families, in code order.  Each thread marks what its words have in
+// bitmaps of its own, merged at the end.
+void CosineHelper::dimensionngrams( void )
+  {
+  const uint64_t nbigrams = 256ULL * 256ULL ;
+  const uint64_t ntrigrams = 256ULL * 256ULL * 256ULL ;
+  const uint32_t nwords = wordlist.size() ;
+  vector<uint64_t> seenbigrams( loadoptions.bigrams ? nbigrams / 64 : 0, 0 ) ;
+  vector<uint64_t> seentrigrams( loadoptions.trigrams ? ntrigrams / 64 : 0, 0 ) ;
+
+#pragma omp parallel
+  {
+  vector<uint64_t> mybigrams( seenbigrams.size(), 0 ) ;
+  vector<uint64_t> mytrigrams( seentrigrams.size(), 0 ) ;
+  vector<uint32_t> grams ;
+  vector<uint32_t> gramcount ;
 
-#pragma omp single nowait
+#pragma omp for schedule( static ) nowait
+  for( uint32_t j = 1 ; j < nwords ; ++j )
+    {
+    string text( wordtext( j ) ) ;
+    if( !mybigrams.empty() )
       {
-      // bigrams
-      bigramstodim.resize( 256UL * 256UL, 0 ) ;
-      nbigramcols = 0 ;
-
-      for( uint32_t i = 0 ; i < 256 ; ++i )
-        if( isprint( i ) )
-          for( uint32_t j = 0 ; j < 256 ; ++j )
-            if( isprint( j ) )
-              bigramstodim[ i * 256 + j ] = nbigramcols++ ;
+      getuniquebigrams( text, grams, gramcount ) ;
+      for( uint64_t g = 0 ; g < grams.size() ; ++g )
+        mybigrams[ grams[ g ] >> 6 ] |= 1ULL << ( grams[ g ] & 63 ) ;
       }
-
-#pragma omp single nowait
+    if( !mytrigrams.empty() )
       {
-      // trigrams
-      trigramstodim.resize( 256UL * 256UL * 256UL, 0 ) ;
-      ntrigramcols = 0 ;
-
-      for( uint32_t i = 0 ; i < 256 ; ++i )
-        if( isprint( i ) )
-          for( uint32_t j = 0 ; j < 256 ; ++j )
-            if( isprint( j ) )
-              for( uint32_t k = 0 ; k < 256 ; ++k )
-                if( isprint( k ) )
-                  trigramstodim[ i * 256 * 256 + j * 256 + k ] = ntrigramcols++ ;  
+      getuniquetrigrams( text, grams, gramcount ) ;
+      for( uint64_t g = 0 ; g < grams.size() ; ++g )
+        mytrigrams[ grams[ g ] >> 6 ] |= 1ULL << ( grams[ g ] & 63 ) ;
       }
-    } // end of parallel
+    }
 
+#pragma omp critical
     {
-    vector<char*>().swap( corpusdata ) ;
-    } 
+    for( uint64_t i = 0 ; i < mybigrams.size() ; ++i )
+      seenbigrams[ i ] |= mybigrams[ i ] ;
+    for( uint64_t i = 0 ; i < mytrigrams.size() ; ++i )
+      seentrigrams[ i ] |= mytrigrams[ i ] ;
+    }
+  } // end of parallel
 
-    nmatrixcols = nbigramcols + ntrigramcols + nwordcols ;
+  nbigramcols = 0 ;
+  bigramstodim.clear() ;
+  if( !seenbigrams.empty() )
+    {
+    bigramstodim.assign( nbigrams, nocolumn ) ;
+    uint32_t* todim = bigramstodim.writable() ;
+    for( uint64_t i = 0 ; i < nbigrams ; ++i )
+      if( ( seenbigrams[ i >> 6 ] >> ( i & 63 ) ) & 1 )
+        todim[ i ] = nbigramcols++ ;
+    }
+
+  ntrigramcols = 0 ;
+  trigramstodim.clear() ;
+  if( !seentrigrams.empty() )
+    {
+    trigramstodim.assign( ntrigrams, nocolumn ) ;
+    uint32_t* todim = trigramstodim.writable() ;
+    for( uint64_t i = 0 ; i < ntrigrams ; ++i )
+      if( ( seentrigrams[ i >> 6 ] >> ( i & 63 ) ) & 1 )
+        todim[ i ] = ntrigramcols++ ;
+    }
   }
 
 void CosineHelper::buildanchorwords( void )
@@ -606,6 +792,7 @@ void CosineHelper::buildanchorwords( void )
 #pragma omp parallel
   {
   set<uint32_t> myquads ;
+  vector<uint32_t> myrows ;
 #pragma omp for schedule( static )
   for( uint32_t i = 0 ; i < corpussize ; ++i )
     {
@@ -626,10 +813,11 @@ void CosineHelper::buildanchorwords( void )
 #pragma omp for schedule( static )
   for( uint32_t i = 0 ; i < usedvecssize ; ++i )
     {
-    const vector<uint32_t> &quadrows  = anchorwords.getquadrows( usedvecs[ i ] ) ;
-    uint32_t nrows = quadrows.size() ;
+    myrows.clear() ;
+    anchorwords.getquadrows( usedvecs[ i ] ).appendto( myrows ) ;
+    uint32_t nrows = myrows.size() ;
     for( uint32_t j = 0 ; j < nrows ; ++j )
-      reachable[ quadrows[ j ] ] = 1 ;
+      reachable[ myrows[ j ] ] = 1 ;
     }
 
 #pragma omp for schedule( static )
@@ -650,12 +838,13 @@ void CosineHelper::buildanchorwords( void )
   } // end of parallel
   cout << makemytimebracketed() ;
   anchorwords.compactor() ;
+  anchorwords.sortrows() ;
+  anchorwords.freeze() ;
 
-  anchormask.resize( corpus.size(), 0 ) ;
   // anchorwords.stats() ;  // Enable if you want quadgram stats
   }
 
-void CosineHelper::generatequadgrams( const string &data, set<uint32_t> &myquads )
+void CosineHelper::generatequadgrams( const string &data, set<uint32_t> &myquads ) const
   {
   uint32_t n = data.size() ;
   for( uint32_t i = 0 ; i < n ; ++i )
@@ -673,14 +862,14 @@ void CosineHelper::generatequadgrams( const string &data, set<uint32_t> &myquads
   }
 
 void CosineHelper::formmatrixrow( const string &inputtext,
-                                  vector<uint32_t> &sparserow, 
+                                  vector<Entry_t> &sparserow, 
                                   Splitwords &splitwords,
                                   vector<uint32_t> &bigrams ,
                                   vector<uint32_t> &trigrams ,
                                   vector<uint32_t> &bigramcount ,
                                   vector<uint32_t> &trigramcount ,
                                   vector<string>   &uniqueword,
-                                  vector<uint32_t> &wordcount )
+                                  vector<uint32_t> &wordcount ) const
   {
   sparserow.clear() ;
   splitwords.resize( 0 ) ;
@@ -691,31 +880,32 @@ void CosineHelper::formmatrixrow( const string &inputtext,
   uniqueword.clear() ;
   wordcount.clear() ;
 
-  getuniquebigrams( inputtext, bigrams, bigramcount ) ;
-  // getuniquetrigrams( corpusrow.rowtext, trigrams, trigramcount ) ;
+  if( !bigramstodim.empty() )
+    getuniquebigrams( inputtext, bigrams, bigramcount ) ;
+  if( !trigramstodim.empty() )
+    getuniquetrigrams( inputtext, trigrams, trigramcount ) ;
   uniquewords( inputtext, ' ', splitwords, uniqueword, wordcount ) ;
 
   uint32_t nbigrams = bigrams.size() ;
   uint32_t ntrigrams = trigrams.size() ;
   uint32_t nwords = uniqueword.size() ;
 
-  uint32_t nnzs = nbigrams + ntrigrams + nwords ;
-  sparserow.resize( nnzs + 1 ) ;
-  sparserow[ 0 ] = nnzs ;
+  sparserow.resize( nbigrams + ntrigrams + nwords + 1 ) ;
 
+  // Grams without a column, none of the words has them, are left out
   uint32_t k = 1 ;
   for( uint32_t j = 0 ; j < nbigrams ; ++j )
     {
     uint32_t index = mapbigramtodim( bigrams[ j ] ) ;
-    sparserow[ k ] = entrycreate( index, bigramcount[ j ] ) ;
-    ++k ;
+    if( index != nocolumn )
+      sparserow[ k++ ] = entrycreate( index, bigramcount[ j ] ) ;
     }
 
   for( uint32_t j = 0 ; j < ntrigrams ; ++j )
     {
     uint32_t index = maptrigramtodim( trigrams[ j ] ) ;
-    sparserow[ k ] = entrycreate( index, trigramcount[ j ] ) ;
-    ++k ;
+    if( index != nocolumn )
+      sparserow[ k++ ] = entrycreate( index, trigramcount[ j ] ) ;
     }
 
   for( uint32_t j = 0 ; j < nwords ; ++j )
@@ -724,9 +914,11 @@ void CosineHelper::formmatrixrow( const string &inputtext,
     sparserow[ k ] = entrycreate( index, wordcount[ j ] ) ;
     ++k ;
     }
+  sparserow[ 0 ] = k - 1 ;
+  sparserow.resize( k ) ;
   }
 
-void CosineHelper::formmatrixrow( const string &inputtext, vector<uint32_t> &sparserow )
+void CosineHelper::formmatrixrow( const string &inputtext, vector<Entry_t> &sparserow ) const
   {
   Splitwords splitwords ;
   vector<uint32_t> bigrams ;
@@ -747,10 +939,31 @@ void CosineHelper::formmatrixrow( const string &inputtext, vector<uint32_t> &spa
                  wordcount ) ;
   }
 
-void CosineHelper::computemagnitude( void )
+static bool entrycolumnless( Entry_t a, Entry_t b )
   {
-  const double eps = 1.e-12 ;
+  return( Entryformat_t::index( a ) < Entryformat_t::index( b ) ) ;
+  }
+
+static bool entryclamps( uint32_t weight )
+  {
+  return( weight > Entryformat_t::maxweight ) ;
+  }
 
+// Entries clamp columns and term frequencies their format cannot hold,
+// see entryformat.h.  Clamped columns all land on the last one.
+void CosineHelper::reportentryoverflow( const char* what, uint64_t nclamped ) const
+  {
+  if( nmatrixcols > uint64_t( Entryformat_t::maxindex ) + 1 )
+    cout << makemytimebracketed() << "Error:: " << what << ": " << nmatrixcols - Entryformat_t::maxindex - 1
+         << " columns past " << Entryformat_t::maxindex << " do not fit an entry, their scores are wrong,"
+         << " build with -D_WIDEENTRIES" << endl ;
+  if( nclamped > 0 )
+    cout << makemytimebracketed() << "Warning:: " << what << ": " << nclamped
+         << " term frequencies clamped to " << Entryformat_t::maxweight << endl ;
+  }
+
+void CosineHelper::computemagnitude( void )
+  {
   #pragma omp parallel
     {
     uint64_t mytotalnnzs = 0 ;
@@ -763,53 +976,9 @@ void CosineHelper::computemagnitude( void )
   #pragma omp for schedule( static ) nowait
     for( uint32_t i = 0 ; i < corpussize ; ++i )
       {
-      unique.clear() ;
-      count.clear() ;
-      double rowmag = 0 ;
-      uint32_t rowinfoindex = corpus[ i ].rowinfoindex ;
-      uint32_t nwords = corpusrowinfo[ rowinfoindex ] ;
-      
-      for( uint32_t j = 0 ; j < nwords ; ++j )
-        {
-        uint32_t wordind = corpusrowinfo[ rowinfoindex + j + 1 ] ;
-        const uint32_t* rownnzs = wordlist[ wordind ].rownnzs ;
-        uint32_t nnzs = rownnzs[ 0 ] ;
-
-        for( uint32_t k = 1 ; k <= nnzs ; ++k )
-          {
-          uint32_t index = entryindex( rownnzs[ k ] ) ;
-          uint32_t tf = entryweight( rownnzs[ k ] ) ;
-
-          uint32_t l ;
-          uint32_t size = unique.size() ;
-          
-          for( l = 0 ; l < size ; ++l )
-            if( index == unique[ l ] )
-              break ;
-
-          if( l < size )
-            count[ l ] += tf ;
-          else
-            {
-            unique.push_back( index ) ;
-            count.push_back( tf ) ;
-            }
-          }
-        } // for nwords
-
-      uint32_t nunique = unique.size() ;
-      for( uint32_t j = 0 ; j < nunique ; ++j )
-        {
-        uint32_t index = unique[ j ] ;
-        uint32_t tf = count[ j ] ;
-        double cof = tf * idf[ index ] ;
-        rowmag += cof * cof ;
-
-        }
-      mytotalnnzs += nunique ;
-
-      rowmag = sqrt( rowmag ) ;
-      corpus[ i ].rowmaginv = ( rowmag > eps ) ? ( 1 / rowmag ) : ( 1 / eps ) ;
+      mergerow( i, unique, count ) ;
+      mytotalnnzs += unique.size() ;
+      corpus[ i ].rowmaginv = rowmaginv( unique, count ) ;
       } // end of corpussize for
 
   #pragma omp atomic
@@ -817,52 +986,196 @@ void CosineHelper::computemagnitude( void )
     }// end of parallel
   }
 
-void CosineHelper::formmatrix( void )
+// Of a row merged by mergerow(), weighted with the current idf
+float CosineHelper::rowmaginv( const vector<uint32_t> &unique, const vector<uint32_t> &count ) const
   {
-  rowcofs.resize( nmatrixcols ) ;   // convinient place to allocate dense representation of input vector 
+  const double eps = 1.e-12 ;
+  double rowmag = 0 ;
 
-#pragma omp parallel
-  {
-  Splitwords splitwords ;
-  vector<uint32_t> bigrams ;
-  vector<uint32_t> trigrams ;
-  vector<uint32_t> bigramcount ;
-  vector<uint32_t> trigramcount ;
-  vector<string>   uniqueword ;
-  vector<uint32_t> wordcount ;
+  uint32_t nunique = unique.size() ;
+  for( uint32_t j = 0 ; j < nunique ; ++j )
+    {
+    double cof = count[ j ] * idf[ unique[ j ] ] ;
+    rowmag += cof * cof ;
+    }
 
+  rowmag = sqrt( rowmag ) ;
+  return( ( rowmag > eps ) ? ( 1 / rowmag ) : ( 1 / eps ) ) ;
+  }
 
-#pragma omp for schedule( static ) nowait
-  for( uint32_t i = 0 ; i < nmatrixcols ; ++i )
-    rowcofs[ i ] = 0 ;
+// Sums the term frequencies of a row over its words, one entry per column
+void CosineHelper::mergerow( uint32_t rownum,
+                             vector<uint32_t> &unique,
+                             vector<uint32_t> &count ) const
+  {
+  unique.clear() ;
+  count.clear() ;
+  uint32_t rowinfoindex = corpus[ rownum ].rowinfoindex ;
+  uint32_t nwords = corpusrowinfo[ rowinfoindex ] ;
+  
+  // Every column is found through slot, its place in unique plus one,
+  // zero again on return, so a row of n words merges in O( n ) however
+  // long it is.  Sized to the matrix columns, grown as inserts add some.
+  static thread_local vector<uint32_t> slot ;
+  if( slot.size() < nmatrixcols )
+    slot.resize( nmatrixcols, 0 ) ;
 
-  uint32_t wordlistsize = wordlist.size() ;
-  vector<uint32_t> sparserow ;
+  for( uint32_t j = 0 ; j < nwords ; ++j )
+    {
+    uint32_t wordind = corpusrowinfo[ rowinfoindex + j + 1 ] ;
+    const Entry_t* rownnzs = wordrow( wordind ) ;
+    uint32_t nnzs = rownnzs[ 0 ] ;
+
+    for( uint32_t k = 1 ; k <= nnzs ; ++k )
+      {
+      uint32_t index = entryindex( rownnzs[ k ] ) ;
+      uint32_t tf = entryweight( rownnzs[ k ] ) ;
+
+      if( slot[ index ] == 0 )
+        {
+        unique.push_back( index ) ;
+        count.push_back( tf ) ;
+        slot[ index ] = unique.size() ;
+        }
+      else
+        count[ slot[ index ] - 1 ] += tf ;
+      }
+    } // for nwords
+
+  for( uint32_t l = 0 ; l < unique.size() ; ++l )
+    slot[ unique[ l ] ] = 0 ;
+  }
+
+// Lays every row out as its merged nonzeros, packed and counted like a
+// word's rownnzs and sorted by column, contiguous in csrentries.  Scoring
+// a row is then one kernel call over one sequential sweep instead of a
+// walk through corpusrowinfo and the words' nonzeros.  Only the term
+// frequency is kept, idf is folded into the query side.
+void CosineHelper::compilerows( void )
+  {
+  const uint32_t corpussize = corpus.size() ;
+  csrrowstart.assign( uint64_t( corpussize ) + 1, 0 ) ;
+  uint64_t* rowstart = csrrowstart.writable() ;
+  Entry_t* entries = NULL ;
+  uint64_t nclamped = 0 ;
+
+#pragma omp parallel
+  {
+  vector<uint32_t> unique ;
+  vector<uint32_t> count ;
+
+#pragma omp for schedule( static )
+  for( uint32_t i = 0 ; i < corpussize ; ++i )
+    {
+    mergerow( i, unique, count ) ;
+    rowstart[ i + 1 ] = unique.size() + 1 ;
+    }
+
+#pragma omp single
+  {
+  for( uint32_t i = 0 ; i < corpussize ; ++i )
+    rowstart[ i + 1 ] += rowstart[ i ] ;
+  csrentries.resize( rowstart[ corpussize ] ) ;
+  entries = csrentries.writable() ;
+  } // Implied barrier
+
+#pragma omp for schedule( static ) reduction( + : nclamped )
+  for( uint32_t i = 0 ; i < corpussize ; ++i )
+    {
+    mergerow( i, unique, count ) ;
+    uint32_t nunique = unique.size() ;
+    Entry_t* dest = entries + rowstart[ i ] ;
+    dest[ 0 ] = nunique ;
+    for( uint32_t j = 0 ; j < nunique ; ++j )
+      dest[ j + 1 ] = entrycreate( unique[ j ], count[ j ] ) ;
+    sort( dest + 1, dest + 1 + nunique, entrycolumnless ) ;
+    nclamped += count_if( count.begin(), count.end(), entryclamps ) ;
+    }
+  } // end of parallel
+  reportentryoverflow( "compiled rows", nclamped ) ;
+  }
+
+
+// Each thread forms its static share of the word rows, then the shares
+// are copied one after the other into wordnnzs
+void CosineHelper::formmatrix( void )
+  {
+  vector<uint64_t> threadstart ;
+  Entry_t* nnzs = NULL ;
+  Wordform_t* words = wordlist.writable() ;
+  uint64_t nclamped = 0 ;
+
+#pragma omp parallel
+  {
+  Splitwords splitwords ;
+  vector<uint32_t> bigrams ;
+  vector<uint32_t> trigrams ;
+  vector<uint32_t> bigramcount ;
+  vector<uint32_t> trigramcount ;
+  vector<string>   uniqueword ;
+  vector<uint32_t> wordcount ;
+
+  uint32_t wordlistsize = wordlist.size() ;
+  vector<Entry_t> sparserow ;
   sparserow.reserve( 32 ) ;
+  vector<Entry_t> myrows ;
+  vector<uint64_t> myoffsets ;
+  uint32_t myfirst = 0 ;
+  uint64_t myclamped = 0 ;
+  int myid = omp_get_thread_num() ;
+
+#pragma omp single
+  threadstart.assign( omp_get_num_threads() + 1, 0 ) ;
 
 #pragma omp for schedule( static )
   for( uint32_t j = 0 ; j < wordlistsize ; ++j )
     {
-    formmatrixrow( wordlist[ j ].wordtext, sparserow, splitwords,
+    formmatrixrow( wordtext( j ), sparserow, splitwords,
                    bigrams, trigrams, bigramcount, trigramcount, uniqueword, wordcount ) ;
-    uint32_t sparserowsize = sparserow.size() ;
-    wordlist[ j ].rownnzs = new uint32_t[ sparserowsize ] ;
-    for( uint32_t k = 0 ; k < sparserowsize ; ++k )
-      wordlist[ j ].rownnzs[ k ] = sparserow[ k ] ; 
+    myclamped += count_if( bigramcount.begin(), bigramcount.end(), entryclamps ) +
+                 count_if( trigramcount.begin(), trigramcount.end(), entryclamps ) ;
+    if( myoffsets.empty() )
+      myfirst = j ;
+    myoffsets.push_back( myrows.size() ) ;
+    myrows.insert( myrows.end(), sparserow.begin(), sparserow.end() ) ;
     }
+
+  threadstart[ myid + 1 ] = myrows.size() ;
+#pragma omp atomic
+  nclamped += myclamped ;
+#pragma omp barrier
+
+#pragma omp single
+    {
+    for( uint64_t t = 1 ; t < threadstart.size() ; ++t )
+      threadstart[ t ] += threadstart[ t - 1 ] ;
+    wordnnzs.resize( threadstart.back() ) ;
+    nnzs = wordnnzs.writable() ;
+    } // end of single, implied barrier
+
+  Entry_t* mynnzs = nnzs + threadstart[ myid ] ;
+  if( !myrows.empty() )
+    memcpy( mynnzs, myrows.data(), myrows.size() * sizeof( Entry_t ) ) ;
+  for( uint64_t k = 0 ; k < myoffsets.size() ; ++k )
+    words[ myfirst + k ].rownnzs = threadstart[ myid ] + myoffsets[ k ] ;
   } // end of parallel  
+  reportentryoverflow( "word rows", nclamped ) ;
 
   computeidf() ;
   computemagnitude() ;
+
+  if( loadoptions.compiledrows )
+    compilerows() ;
   }
 
+// In order of first appearance.  slot holds each bigram's place in
+// bigrams plus one while the string is scanned, and is zero again after.
 void CosineHelper::getuniquebigrams( const string &data,
                                      vector<uint32_t> &bigrams,
-                                     vector<uint32_t> &bigramcount )
+                                     vector<uint32_t> &bigramcount ) const
   {
-  uint32_t uniquebigrams[ 256ULL * 256ULL ] ;
-  uint32_t uniquebigramscount[ 256ULL * 256ULL ] ;
-  uint32_t nuniquebigrams = 0 ;
+  static thread_local vector<uint32_t> slot( 256 * 256, 0 ) ;
+  const unsigned char* text = ( const unsigned char* ) data.data() ;
   uint32_t n = data.size() ;
 
   bigrams.clear() ;
@@ -870,97 +1183,80 @@ void CosineHelper::getuniquebigrams( const string &data,
 
   if( n > 0 )
     {
-
     for( uint32_t i = 0 ; i <= n ; ++i )
-    {
-    char c1 = ( i > 0 ) ? data[ i - 1 ] : ' ' ;
-    char c2 = ( i < n ) ? data[ i ] : ' ' ;
-
-    if( isprint( c1 ) && isprint( c2 ) )
       {
-      uint32_t index = *( unsigned char * ) &c1 * 256UL + *( unsigned char * ) &c2 ;
-      uint32_t k ;
-      for( k = 0 ;  k < nuniquebigrams ; ++k )
-        if( uniquebigrams[ k ] == index )
-          break ;
+      uint32_t c1 = ( i > 0 ) ? text[ i - 1 ] : ' ' ;
+      uint32_t c2 = ( i < n ) ? text[ i ] : ' ' ;
 
-      if( k == nuniquebigrams )
+      if( isprint( c1 ) && isprint( c2 ) )
         {
-        uniquebigrams[ nuniquebigrams ] = index ;
-        uniquebigramscount[ nuniquebigrams ] = 1 ;
-        ++nuniquebigrams ;
+        uint32_t index = ( c1 << 8 ) | c2 ;
+        if( slot[ index ] == 0 )
+          {
+          bigrams.push_back( index ) ;
+          bigramcount.push_back( 1 ) ;
+          slot[ index ] = bigrams.size() ;
+          }
+        else
+          ++bigramcount[ slot[ index ] - 1 ] ;
         }
-      else
-        ++uniquebigramscount[ k ] ;
       }
-    }
 
-    bigrams.resize( nuniquebigrams ) ;
-    bigramcount.resize( nuniquebigrams ) ;
-    for( uint32_t k = 0 ; k < nuniquebigrams ; ++k )
-      {
-      bigrams[ k ] = uniquebigrams[ k ] ;
-      bigramcount[ k ] = uniquebigramscount[ k ] ;
-      }
+    for( uint32_t k = 0 ; k < bigrams.size() ; ++k )
+      slot[ bigrams[ k ] ] = 0 ;
     }
   }
 
+// Every trigram code into trigrams, then sorted and run length folded in
+// place, no table and nothing allocated once the caller's vectors have
+// grown.  Codes come out ascending.
 void CosineHelper::getuniquetrigrams( const string &data,
-                        				      vector<uint32_t> &trigrams,
-                        				      vector<uint32_t> &trigramcount )
+                                      vector<uint32_t> &trigrams,
+                                      vector<uint32_t> &trigramcount ) const
   {
-  // If we use this, try to remove maps and vectorize it. 
-
+  const unsigned char* text = ( const unsigned char* ) data.data() ;
   uint32_t n = data.size() ;
-  map<uint32_t,uint32_t> uniquetrigrams ;
 
   trigrams.clear() ;
   trigramcount.clear() ;
 
   if( n > 1 )
     {
-    for( uint32_t i = 0 ; i <= n ; ++i )
-	    {
-	    char c1 = ( i > 0 ) ? data[ i - 1 ] : ' ' ;
-	    char c2 = data[ i ] ;
-	    char c3 = ( i < ( n - 1 ) ) ? data[ i + 1 ] : ' ' ;
-
-	    if( ( c2 != ' ' ) && isprint( c1 ) && isprint( c2 ) && isprint( c3 ) )
-	      {
-	      uint32_t index = *( unsigned char * ) &c1 * 256UL * 256UL +
-		    *( unsigned char * ) &c2 * 256UL +
-	    	*( unsigned char * ) &c3 ;
-	      map<uint32_t,uint32_t>::iterator it = uniquetrigrams.find( index ) ;
-	      if( it == uniquetrigrams.end() )
-		      uniquetrigrams.insert( pair<uint32_t,uint32_t>( index, 1 ) ) ;
-	      else
-		      ++( it->second ) ;
-	    }
-	  }
-
-    trigrams.reserve( uniquetrigrams.size() ) ;
-    trigramcount.reserve( uniquetrigrams.size() ) ;
-    for( map<uint32_t,uint32_t>::const_iterator it = uniquetrigrams.begin() ;
-	  it != uniquetrigrams.end() ; ++it )
-	    {
-	    trigrams.push_back( it->first ) ;
-	    trigramcount.push_back( it->second ) ;
-	    }
-    }
-  
-  //Switching off trigrams
-  {
-  vector<uint32_t>().swap( trigrams ) ;
-  vector<uint32_t>().swap( trigramcount ) ;
-  }
+    trigrams.resize( n ) ;
+    uint32_t ncodes = 0 ;
+    for( uint32_t i = 0 ; i < n ; ++i )
+      {
+      uint32_t c1 = ( i > 0 ) ? text[ i - 1 ] : ' ' ;
+      uint32_t c2 = text[ i ] ;
+      uint32_t c3 = ( i < ( n - 1 ) ) ? text[ i + 1 ] : ' ' ;
+
+      if( ( c2 != ' ' ) && isprint( c1 ) && isprint( c2 ) && isprint( c3 ) )
+        trigrams[ ncodes++ ] = ( c1 << 16 ) | ( c2 << 8 ) | c3 ;
+      }
 
+    sort( trigrams.begin(), trigrams.begin() + ncodes ) ;
+    trigramcount.resize( ncodes ) ;
+    uint32_t nunique = 0 ;
+    for( uint32_t i = 0 ; i < ncodes ; ++nunique )
+      {
+      uint32_t j = i + 1 ;
+      while( ( j < ncodes ) && ( trigrams[ j ] == trigrams[ i ] ) )
+        ++j ;
+      trigrams[ nunique ] = trigrams[ i ] ;
+      trigramcount[ nunique ] = j - i ;
+      i = j ;
+      }
+    trigrams.resize( nunique ) ;
+    trigramcount.resize( nunique ) ;
+    }
   }
 
+// The distinct words of data and their counts, in order of first appearance
 void CosineHelper::uniquewords( const string &data,
                                 char delim,
                                 Splitwords &splitwords,
                                 vector<string> &uniqueword,
-                                vector<uint32_t> &wordcount )
+                                vector<uint32_t> &wordcount ) const
   {
   uniqueword.clear() ;
   splitwords.resize( 0 ) ;
@@ -973,24 +1269,60 @@ void CosineHelper::uniquewords( const string &data,
   wordcount.reserve( nword ) ;
   uniqueword.reserve( nword ) ;
 
-  for( uint32_t i = 0 ; i < nword ; ++i )
+  if( nword <= 64 )
     {
-    uint32_t nunique = uniqueword.size() ;
-    uint32_t j ;
-    for( j = 0 ; j < nunique ; ++j )
-      if( splitwords[ i ] == uniqueword[ j ] )
-        break ;
-    if( j < nunique ) // i-th word is a duplicate 
-      ++wordcount[ j ] ;
-    else
+    for( uint32_t i = 0 ; i < nword ; ++i )
       {
-      uniqueword.push_back( splitwords[ i ] ) ;
-      wordcount.push_back( 1 ) ;
-      }
-    } //end of outer for  
+      uint32_t nunique = uniqueword.size() ;
+      uint32_t j ;
+      for( j = 0 ; j < nunique ; ++j )
+        if( splitwords[ i ] == uniqueword[ j ] )
+          break ;
+      if( j < nunique ) // i-th word is a duplicate 
+        ++wordcount[ j ] ;
+      else
+        {
+        uniqueword.push_back( splitwords[ i ] ) ;
+        wordcount.push_back( 1 ) ;
+        }
+      } //end of outer for  
+    return ;
+    }
+
+  // Long records: word positions sorted by text, ties by position, so equal
+  // words sit together behind their first position.  Each run packs into
+  // its first position and count, sorted back into first appearance.
+  static thread_local vector<uint32_t> order ;
+  static thread_local vector<uint64_t> runs ;
+  order.resize( nword ) ;
+  for( uint32_t i = 0 ; i < nword ; ++i )
+    order[ i ] = i ;
+  sort( order.begin(), order.end(), [ & ]( uint32_t a, uint32_t b )
+    {
+    int c = splitwords[ a ].compare( splitwords[ b ] ) ;
+    return( ( c < 0 ) || ( ( c == 0 ) && ( a < b ) ) ) ;
+    } ) ;
+
+  runs.clear() ;
+  for( uint32_t i = 0 ; i < nword ; )
+    {
+    const string &word = splitwords[ order[ i ] ] ;
+    uint32_t j = i + 1 ;
+    while( ( j < nword ) && ( splitwords[ order[ j ] ] == word ) )
+      ++j ;
+    runs.push_back( ( uint64_t( order[ i ] ) << 32 ) | ( j - i ) ) ;
+    i = j ;
+    }
+  sort( runs.begin(), runs.end() ) ;
+
+  for( uint64_t r = 0 ; r < runs.size() ; ++r )
+    {
+    uniqueword.push_back( splitwords[ runs[ r ] >> 32 ] ) ;
+    wordcount.push_back( runs[ r ] & 0xffffffff ) ;
+    }
   }
 
-void CosineHelper::idfDedup(  const uint32_t* rownnzs,
+void CosineHelper::idfDedup(  const Entry_t* rownnzs,
                               vector<bool> &termsusedthisrow,
                               vector<uint32_t> &theseterms )
   {
@@ -1008,9 +1340,11 @@ void CosineHelper::idfDedup(  const uint32_t* rownnzs,
 
 void CosineHelper::computeidf( void )
   {
-  vector<uint32_t> idfcount ;
   idf.resize( nmatrixcols ) ;
-  idfcount.resize( nmatrixcols ) ;
+  idfcount.assign( nmatrixcols, 0 ) ;
+  double* idfs = idf.writable() ;
+  uint32_t* counts = idfcount.writable() ;
+  idfrows = corpus.size() ;
 
 #pragma omp parallel
     {
@@ -1037,7 +1371,7 @@ void CosineHelper::computeidf( void )
       for( uint32_t j = 0 ; j < nwords ; ++j )
         {
         uint32_t wordind = corpusrowinfo[ rowinfoindex + j + 1 ] ;
-        const uint32_t* rownnzs = wordlist[ wordind ].rownnzs ;
+        const Entry_t* rownnzs = wordrow( wordind ) ;
         idfDedup( rownnzs, termusedthisrow, theseterms ) ;
         }
 
@@ -1065,287 +1399,1408 @@ void CosineHelper::computeidf( void )
       
       if( pass == 0 )
         for( uint32_t i = first ; i < last ; ++i )
-          idfcount[ i ] = myidfcount[ i ] ;
+          counts[ i ] = myidfcount[ i ] ;
       else
         for( uint32_t i = first ; i < last ; ++i )
-          idfcount[ i ] += myidfcount[ i ] ;
+          counts[ i ] += myidfcount[ i ] ;
 
 #pragma omp barrier
       }
 
 #pragma omp for schedule( static )
     for( uint32_t i = 0 ; i < nmatrixcols ; ++i )
-      idf[ i ] = idfcount[ i ] > 0 ? pow( -log( idfcount[ i ] / ( double ) corpussize ), 0.5 ) : 0 ;
+      idfs[ i ] = idfof( counts[ i ], corpussize ) ;
     } // Parallel
   }
 
-vector<uint32_t> CosineHelper::selectrows()  // select the row indexes
+// The next word id, a freed one first, and with a new id the next column
+uint32_t CosineHelper::takewordid( Wordform_t form )
   {
-  vector<uint32_t> selectedrows ;
-  uint32_t corpussize = corpus.size() ;
-  selectedrows.resize( corpussize ) ;
-  
-  for( uint32_t i = 0 ; i < corpussize ; ++i )
-    selectedrows[ i ] = i ;
+  uint32_t id ;
+  if( !freewords.empty() )    // A freed word's column, no row uses it
+    {
+    id = freewords.back() ;
+    freewords.pop_back() ;
+    wordlist.writable()[ id ] = form ;
+    }
+  else
+    {
+    id = wordlist.size() ;
+    wordlist.push_back( form ) ;
+    ++nwordcols ;
+    ++nmatrixcols ;
+    idf.push_back( 0 ) ;
+    idfcount.push_back( 0 ) ;
+    }
+  return( id ) ;
+  }
 
-  return selectedrows ;
+// Gives the grams of text no word had so far a column each.  Their columns
+// are taken among the word columns, through word ids left without text
+// like freed words, so a word's column stays its id past the grams.
+void CosineHelper::addgramcolumns( const string &text )
+  {
+  const uint32_t wordoffset = nbigramcols + ntrigramcols ;
+  vector<uint32_t> grams ;
+  vector<uint32_t> gramcount ;
+
+  if( !bigramstodim.empty() )
+    {
+    getuniquebigrams( text, grams, gramcount ) ;
+    for( uint64_t g = 0 ; g < grams.size() ; ++g )
+      if( bigramstodim[ grams[ g ] ] == nocolumn )
+        bigramstodim.writable()[ grams[ g ] ] = wordoffset + takewordid( wordlist[ 0 ] ) ;
+    }
+  if( !trigramstodim.empty() )
+    {
+    getuniquetrigrams( text, grams, gramcount ) ;
+    for( uint64_t g = 0 ; g < grams.size() ; ++g )
+      if( trigramstodim[ grams[ g ] ] == nocolumn )
+        trigramstodim.writable()[ grams[ g ] ] = wordoffset + takewordid( wordlist[ 0 ] ) - nbigramcols ;
+    }
   }
 
-double CosineHelper::f1score( Result_t cosine, Result_t tanimoto )
+// Gives a word not seen before the next word column, its text and
+// matrix row appended to the word arrays, and its new grams columns
+uint32_t CosineHelper::addword( const char* text, uint32_t len )
   {
-  return ( ( 2 * ( cosine.score * tanimoto.score ) ) / ( cosine.score + tanimoto.score ) ) ;  
+  Wordform_t form ;
+  form.wordtext = wordtexts.size() ;
+  form.rownnzs = wordnnzs.size() ;
+  wordtexts.resize( form.wordtext + len + 1, '\0' ) ;
+  memcpy( wordtexts.writable() + form.wordtext, text, len ) ;
+
+  uint32_t id = takewordid( form ) ;
+  vocabulary.assign( text, len, id ) ;
+  addgramcolumns( string( text, len ) ) ;
+
+  vector<Entry_t> sparserow ;
+  formmatrixrow( string( text, len ), sparserow ) ;
+  wordnnzs.resize( form.rownnzs + sparserow.size() ) ;
+  memcpy( wordnnzs.writable() + form.rownnzs, sparserow.data(), sparserow.size() * sizeof( Entry_t ) ) ;
+  return( id ) ;
   }
 
-vector<Result_t> CosineHelper::accumscores( vector< vector<Result_t> > &result, uint64_t maxresults )
+// One cleaned row at the end of the corpus.  Columns the row is the first
+// to use get their idf at once, the others keep theirs until the rebase.
+void CosineHelper::insertrow( const char* text, vector<uint32_t> &unique, vector<uint32_t> &count )
   {
-  vector<Result_t> accum ;
-  accum.resize( maxresults ) ;
-  for( uint32_t i = 0 ; i < maxresults; ++i )
+  uint32_t row = corpus.size() ;
+  uint64_t rowinfoindex = corpusrowinfo.size() ;
+  const char* word ;
+  size_t wordlen ;
+
+  uint32_t nwords = 0 ;
+  for( const char* p = text ; nextword( p, ' ', word, wordlen ) ; )
+    ++nwords ;
+  corpusrowinfo.resize( rowinfoindex + nwords + 1 ) ;
+  corpusrowinfo[ rowinfoindex ] = nwords ;
+  uint64_t at = rowinfoindex + 1 ;
+  for( const char* p = text ; nextword( p, ' ', word, wordlen ) ; )
     {
-    accum[ i ].score = f1score( result[ 0 ][ i ], result[ 1 ][ i ] ) ;
-    accum[ i ].part = ( accum[ i ].score == result[ 0 ][ i ].score ) ? result[ 0 ][ i ].part : result[ 0 ][ i ].part ;
+    uint32_t index = vocabulary.find( word, wordlen ) ;
+    if( index == 0 )
+      index = addword( word, wordlen ) ;
+    corpusrowinfo[ at++ ] = index ;
     }
-  return accum ;
+
+  corpus.resize( row + 1 ) ;
+  corpus[ row ].rowinfoindex = rowinfoindex ;
+  mergerow( row, unique, count ) ;
+
+  uint32_t nunique = unique.size() ;
+  uint32_t* counts = idfcount.writable() ;
+  for( uint32_t j = 0 ; j < nunique ; ++j )
+    if( counts[ unique[ j ] ]++ == 0 )
+      idf.writable()[ unique[ j ] ] = idfof( 1, idfrows ) ;
+  corpus[ row ].rowmaginv = rowmaginv( unique, count ) ;
+  totalnnzs += nunique ;
+
+  if( !csrrowstart.empty() )
+    {
+    uint64_t start = csrentries.size() ;
+    csrentries.resize( start + nunique + 1 ) ;
+    Entry_t* dest = csrentries.writable() + start ;
+    dest[ 0 ] = nunique ;
+    for( uint32_t j = 0 ; j < nunique ; ++j )
+      dest[ j + 1 ] = entrycreate( unique[ j ], count[ j ] ) ;
+    sort( dest + 1, dest + 1 + nunique, entrycolumnless ) ;
+    csrrowstart.push_back( start + nunique + 1 ) ;
+    }
+
+  // Like buildanchorwords(), a row all of whose quadgrams were discarded
+  // is posted under them all
+  set<uint32_t> myquads ;
+  generatequadgrams( getcorpustext( row ), myquads ) ;
+  bool reached = false ;
+  for( set<uint32_t>::const_iterator it = myquads.begin() ; it != myquads.end() ; ++it )
+    reached = anchorwords.appendrow( *it, row, false ) || reached ;
+  if( !reached )
+    for( set<uint32_t>::const_iterator it = myquads.begin() ; it != myquads.end() ; ++it )
+      anchorwords.appendrow( *it, row, true ) ;
   }
 
-vector<vector<Result_t> > CosineHelper::cosinematching( const string &input, 
-                                               uint64_t maxresults, 
-                                               double threshold )
+uint64_t CosineHelper::insertrows( const vector<string> &inputs )
   {
-  
-  // Testing purposes
-  std::vector<std::vector<Result_t> > result ;
-  result.resize( 1 ) ;
+  vector<uint32_t> unique ;
+  vector<uint32_t> count ;
+  uint64_t nadded = 0 ;
+  uint64_t nclamped = 0 ;
 
-  bool flag = true ;
-  while( flag )
+  for( uint64_t i = 0 ; i < inputs.size() ; ++i )
     {
-    try
-      {
-      string thresh ;
-      cout<<"Enter threshold: " ;
-      getline( cin, thresh ) ;
-      cout<<endl ;
-      string::size_type sz ;
-      threshold = stod( thresh , &sz ) ; 
-      string max ;
-      cout<<"Enter maxresults: " ;
-      getline( cin, max ) ;
-      cout<<endl ;
-      maxresults = stoul( max, &sz ) ;
-      flag = false ;
-      }
-    catch( ... )
+    if( inputs[ i ].empty() )
       {
-      cout<<"Must be integers! \n"<<endl ;
-      flag = true ;
+      emptylines.push_back( corpus.size() + emptylines.size() ) ;
+      continue ;
       }
+    insertrow( cleaningtool( inputs[ i ] ).c_str(), unique, count ) ;
+    if( !csrrowstart.empty() )
+      nclamped += count_if( count.begin(), count.end(), entryclamps ) ;
+    ++nadded ;
     }
-  // test code ends
-
-  if( threshold < 0 )
-    threshold = 0 ;
+  reportentryoverflow( "inserted rows", nclamped ) ;
 
-  vector<uint32_t> selectedrows ;
-  vector<uint32_t> sparserow ;
-  std::string inputtext ;
+  if( !inputs.empty() )
+    ++generation ;
+  rowschanged += nadded ;
+  rebaseifdue() ;
+  return( nadded ) ;
+  }
 
-  cout<<"\nInput part before ->"<<input<<endl ;
-  inputtext = cleaningtool( input ) ; ;
-  cout<<"Input part after ->"<<inputtext<<endl<<endl ;
+void CosineHelper::rebaseifdue( void )
+  {
+  if( rowschanged > loadoptions.idfrebase * idfrows )
+    rebaseidf() ;
+  }
 
-  // form row matrix for input
-  formmatrixrow( inputtext, sparserow ) ;
+// Recomputes idf over all rows and every row's magnitude with it, and
+// merges the anchor postings appended since the last rebase
+void CosineHelper::rebaseidf( void )
+  {
+  uint32_t nliverows = corpus.size() - ndeleted ;
+  double* idfs = idf.writable() ;
+  const uint32_t* counts = idfcount.data() ;
 
-  // select the relevant rows from corpus
-  selectedrows = selectrows() ;
+#pragma omp parallel for schedule( static )
+  for( uint32_t i = 0 ; i < nmatrixcols ; ++i )
+    idfs[ i ] = idfof( counts[ i ], nliverows ) ;
+  idfrows = nliverows ;
+  rowschanged = 0 ;
+  ++generation ;
 
-  result[ 0 ] = score( inputtext, sparserow, maxresults, threshold , selectedrows ) ;  // Cosine Similarity with tf idf
-  // result[ 1 ] = score( inputtext, sparserow, maxresults, threshold , selectedrows, true ) ;  // Tanimoto
-  // result[ 2 ] = accumscores( result, maxresults ) ;   // Accumulates the two scores into one based on better scoring
-  return result ;
+  corpus.detach() ;
+  uint64_t nnzs = totalnnzs ;         // The same, computemagnitude() adds them up again
+  computemagnitude() ;
+  totalnnzs = nnzs ;
+  anchorwords.fold() ;
   }
 
-void CosineHelper::addtotopscores( uint64_t newindex, 
-                                   double newscore,
-                                   vector<uint64_t> &rowindexes,
-                                   vector<double> &rowscores ) const
+uint64_t CosineHelper::deleterows( const vector<uint32_t> &rows )
   {
-  uint64_t maxresults = rowscores.size() ;
+  vector<uint32_t> unique ;
+  vector<uint32_t> count ;
+  uint64_t ndone = 0 ;
 
-  if( ( maxresults > 0 ) &&
-      ( newscore > rowscores[ maxresults - 1 ] ) ) // Score in top scoring results discovered so far
+  tombstones.resize( ( corpus.size() + 63 ) / 64, 0 ) ;
+  for( uint64_t i = 0 ; i < rows.size() ; ++i )
     {
-    uint64_t k = 0 ;
-    
-    for( k = 0 ; k < maxresults ; ++k )
-      if( newscore > rowscores[ k ] )
-        break ;
-
-    for( ; k < maxresults ; ++k )
-      {
-      double tmpscore = rowscores[ k ] ;
-      uint64_t tmpindex = rowindexes[ k ] ;
-      rowscores[ k ] = newscore ;
-      rowindexes[ k ] = newindex ;
-      newscore = tmpscore ;
-      newindex = tmpindex ;
-      }
+    uint32_t row = rows[ i ] ;
+    if( ( row >= corpus.size() ) || isdeleted( row ) )
+      continue ;
+
+    tombstones[ row >> 6 ] |= 1ULL << ( row & 63 ) ;
+    mergerow( row, unique, count ) ;
+    uint32_t* counts = idfcount.writable() ;
+    for( uint32_t j = 0 ; j < unique.size() ; ++j )
+      --counts[ unique[ j ] ] ;
+    totalnnzs -= unique.size() ;
+    ++ndone ;
     }
+
+  if( ndone > 0 )
+    ++generation ;
+  ndeleted += ndone ;
+  rowschanged += ndone ;
+  rebaseifdue() ;
+  return( ndone ) ;
   }
 
-void CosineHelper::scatteranchormasks( const string &inputtext, uint8_t value )
+void CosineHelper::preparecompaction( Compaction_t &compaction ) const
   {
-  set<uint32_t> myanchorwords ;
-  generatequadgrams( inputtext, myanchorwords ) ;
-  set<uint32_t>::const_iterator it ;
+  const uint32_t corpussize = corpus.size() ;
+  vector<uint32_t> newrow( corpussize ) ;
+  vector<uint64_t> deletedlines ;
+  uint64_t nkept = 0 ;
+  uint64_t nrowinfo = 0 ;
+  for( uint32_t i = 0 ; i < corpussize ; ++i )
+    if( isdeleted( i ) )
+      {
+      newrow[ i ] = UINT32_MAX ;
+      deletedlines.push_back( rowline( i ) ) ;
+      }
+    else
+      {
+      newrow[ i ] = nkept++ ;
+      nrowinfo += corpusrowinfo[ corpus[ i ].rowinfoindex ] + 1 ;
+      }
+  compaction.generation = generation ;
+
+  // Rows, laid out again one after the other
+  compaction.corpus.clear() ;
+  compaction.corpusrowinfo.clear() ;
+  compaction.corpus.resize( nkept ) ;
+  compaction.corpusrowinfo.resize( nrowinfo ) ;
+  uint64_t at = 0 ;
+  for( uint32_t i = 0 ; i < corpussize ; ++i )
+    if( newrow[ i ] != UINT32_MAX )
+      {
+      Corpusform_t &form = compaction.corpus[ newrow[ i ] ] ;
+      uint32_t rowinfoindex = corpus[ i ].rowinfoindex ;
+      uint32_t nwords = corpusrowinfo[ rowinfoindex ] ;
+      form.rowmaginv = corpus[ i ].rowmaginv ;
+      form.rowinfoindex = at ;
+      for( uint32_t j = 0 ; j <= nwords ; ++j )
+        compaction.corpusrowinfo[ at++ ] = corpusrowinfo[ rowinfoindex + j ] ;
+      }
 
-  for( it = myanchorwords.begin() ; it != myanchorwords.end() ; ++it )
+  compaction.emptylines.resize( emptylines.size() + deletedlines.size() ) ;
+  merge( emptylines.begin(), emptylines.end(), deletedlines.begin(), deletedlines.end(),
+         compaction.emptylines.begin() ) ;
+
+  compaction.csrrowstart.clear() ;
+  compaction.csrentries.clear() ;
+  if( !csrrowstart.empty() )
     {
-    const vector<uint32_t> &rows = anchorwords.getquadrows( *it ) ;
-    uint32_t nrows = rows.size() ;
+    compaction.csrrowstart.push_back( 0 ) ;
+    for( uint32_t i = 0 ; i < corpussize ; ++i )
+      if( newrow[ i ] != UINT32_MAX )
+        {
+        compaction.csrentries.insert( compaction.csrentries.end(),
+                                      csrentries.begin() + csrrowstart[ i ], csrentries.begin() + csrrowstart[ i + 1 ] ) ;
+        compaction.csrrowstart.push_back( compaction.csrentries.size() ) ;
+        }
+    }
 
-#pragma omp parallel for schedule( static )
-    for( uint32_t j = 0 ; j < nrows ; ++j )
-      anchormask[ rows[ j ] ] = value ;
+  anchorwords.compacted( newrow.data(), compaction.quadcodes, compaction.quadstarts,
+                         compaction.quadblocks, compaction.quadbytes ) ;
+
+  // A word no kept row uses has a zero count in its own column.  Freed
+  // words keep their id and column, with word 0's empty text and row.
+  const uint32_t wordoffset = nbigramcols + ntrigramcols ;
+  const uint32_t nwords = wordlist.size() ;
+  compaction.freedwords.clear() ;
+  for( uint32_t id = 1 ; id < nwords ; ++id )
+    if( ( wordlist[ id ].wordtext != wordlist[ 0 ].wordtext ) && ( idfcount[ wordoffset + id ] == 0 ) )
+      compaction.freedwords.push_back( id ) ;
+
+  compaction.wordlist.clear() ;
+  compaction.wordtexts.clear() ;
+  compaction.wordnnzs.clear() ;
+  if( !compaction.freedwords.empty() )
+    {
+    compaction.wordlist.resize( nwords ) ;
+    uint64_t nfreed = 0 ;
+    for( uint32_t id = 0 ; id < nwords ; ++id )
+      {
+      Wordform_t &form = compaction.wordlist[ id ] ;
+      if( ( nfreed < compaction.freedwords.size() ) && ( compaction.freedwords[ nfreed ] == id ) )
+        ++nfreed ;
+      else if( ( id == 0 ) || ( wordlist[ id ].wordtext != wordlist[ 0 ].wordtext ) )
+        {
+        const char* text = wordtext( id ) ;
+        const Entry_t* row = wordrow( id ) ;
+        form.wordtext = compaction.wordtexts.size() ;
+        form.rownnzs = compaction.wordnnzs.size() ;
+        compaction.wordtexts.insert( compaction.wordtexts.end(), text, text + strlen( text ) + 1 ) ;
+        compaction.wordnnzs.insert( compaction.wordnnzs.end(), row, row + row[ 0 ] + 1 ) ;
+        continue ;
+        }
+      form = compaction.wordlist[ 0 ] ;
+      }
     }
   }
 
-void CosineHelper::scatterweights( const vector<uint32_t> &rowentries, bool dozero )
+bool CosineHelper::applycompaction( Compaction_t &compaction )
   {
-  const double eps = 1.e-12 ;
-  double mag = 0 ;
-  uint32_t nentries = ( rowentries.size() > 0 ) ? rowentries[ 0 ] : 0 ;
+  if( compaction.generation != generation )
+    return( false ) ;
 
-  if( dozero )
-    for( uint32_t i = 1 ; i <= nentries ; ++i )
-      {
-      uint32_t index = entryindex( rowentries[ i ] ) ;
-      rowcofs[ index ] = 0 ;
-      }
-  else
+  if( !compaction.freedwords.empty() )
     {
-    for( uint32_t i = 1 ; i <= nentries ; ++i )
+    for( uint64_t i = 0 ; i < compaction.freedwords.size() ; ++i )
       {
-      uint32_t index = entryindex( rowentries[ i ] ) ;
-      double cof = entryweight( rowentries[ i ] ) * idf[ index ] ;
-      rowcofs[ index ] += cof ;
-      mag += cof * cof ;
+      const char* text = wordtext( compaction.freedwords[ i ] ) ;
+      vocabulary.erase( text, strlen( text ) ) ;
       }
-    mag = sqrt( mag ) ;
-    inputrowmaginv = ( mag > eps ) ? ( 1 / mag ) : ( 1 / eps ) ;
+    wordlist.swap( compaction.wordlist ) ;
+    wordtexts.swap( compaction.wordtexts ) ;
+    wordnnzs.swap( compaction.wordnnzs ) ;
+    freewords.insert( freewords.end(), compaction.freedwords.begin(), compaction.freedwords.end() ) ;
+    sort( freewords.begin(), freewords.end(), greater<uint32_t>() ) ;
     }
-  }
 
-double CosineHelper::dotrow( const uint32_t* rowentries ) const
-  {
-  double dot = 0 ;
-  uint32_t n = rowentries[ 0 ] ;
-  for( uint32_t i = 1 ; i <= n ; ++i )
+  corpus.swap( compaction.corpus ) ;
+  corpusrowinfo.swap( compaction.corpusrowinfo ) ;
+  emptylines.swap( compaction.emptylines ) ;
+  if( !csrrowstart.empty() )
     {
-    uint32_t entry = entryindex( rowentries[ i ] ) ;
-    double temp = rowcofs[ entry ] * entryweight( rowentries[ i ] ) * idf[ entry ] ;
-    dot += temp ;
+    csrrowstart.swap( compaction.csrrowstart ) ;
+    csrentries.swap( compaction.csrentries ) ;
     }
-  return( dot ) ;
+  anchorwords.replace( compaction.quadcodes, compaction.quadstarts, compaction.quadblocks, compaction.quadbytes ) ;
+
+  vector<uint64_t>().swap( tombstones ) ;
+  ndeleted = 0 ;
+  ++generation ;
+  return( true ) ;
   }
 
-vector<Result_t> CosineHelper::score( const string inputtext, const vector<uint32_t> &inputnnzs, 
-                                      uint64_t maxresults, double threshold,
-                                      const vector<uint32_t> selectedrows, bool tanimoto )
+void CosineHelper::compactrows( void )
   {
-  const bool useanchorwords = true ;
-
-  vector<Result_t> result ;   // stores the current set of results
-  vector<double> maxrowscores ; // score of highest scoring row
-  vector<uint64_t> maxrowindexes ;  // Indexes of the highest scoring row
-  uint32_t counter = 0 ;
+  Compaction_t compaction ;
+  preparecompaction( compaction ) ;
+  applycompaction( compaction ) ;
+  }
 
-  uint64_t selectedrowsize = selectedrows.size() ;
+vector<uint32_t> CosineHelper::selectrows() const  // select the row indexes
+  {
+  vector<uint32_t> selectedrows ;
+  uint32_t corpussize = corpus.size() ;
+  selectedrows.reserve( corpussize - ndeleted ) ;
+  
+  for( uint32_t i = 0 ; i < corpussize ; ++i )
+    if( !isdeleted( i ) )
+      selectedrows.push_back( i ) ;
 
-  if( maxresults > 0 )
-    {
-    maxrowscores.resize( maxresults, -1 ) ;
-    maxrowindexes.resize( maxresults, 0 ) ;
+  return selectedrows ;
+  }
 
-  if( useanchorwords )
-    scatteranchormasks( inputtext, 1 ) ;
-  scatterweights( inputnnzs, false ) ; // makes a dense vector
+double CosineHelper::f1score( Result_t cosine, Result_t tanimoto )
+  {
+  return ( ( 2 * ( cosine.score * tanimoto.score ) ) / ( cosine.score + tanimoto.score ) ) ;  
+  }
 
-#pragma omp parallel
+vector<Result_t> CosineHelper::accumscores( vector< vector<Result_t> > &result, uint64_t maxresults )
+  {
+  vector<Result_t> accum ;
+  accum.resize( maxresults ) ;
+  for( uint32_t i = 0 ; i < maxresults; ++i )
     {
-    vector<double> myrowscores ; 
-    vector<uint64_t> myrowindexes ;  
+    accum[ i ].score = f1score( result[ 0 ][ i ], result[ 1 ][ i ] ) ;
+    accum[ i ].part = ( accum[ i ].score == result[ 0 ][ i ].score ) ? result[ 0 ][ i ].part : result[ 0 ][ i ].part ;
+    }
+  return accum ;
+  }
 
-    myrowscores.resize( maxresults, -1 ) ;
-    myrowindexes.resize( maxresults, 0 ) ;
+void CosineHelper::initquerycontext( Querycontext_t &context, int nthreads ) const
+  {
+  context.nthreads = nthreads ;
+  context.inputrowmaginv = 0 ;
+  vector<float>().swap( context.foldedcofs ) ;   // Allocated by the first dense query
+  }
 
-#pragma omp for schedule ( static ) nowait
-    for( uint64_t i = 0 ; i < selectedrowsize ; ++i )
+int CosineHelper::querythreads( const Querycontext_t &context ) const
+  {
+  return( ( context.nthreads > 0 ) ? context.nthreads : omp_get_max_threads() ) ;
+  }
+
+vector<vector<Result_t> > CosineHelper::cosinematching( const string &input, 
+                                               uint64_t maxresults, 
+                                               double threshold )
+  {
+  std::vector<std::vector<Result_t> > result ;
+  result.resize( 1 ) ;
+
+  result[ 0 ] = cosinematching( input, maxresults, threshold, defaultcontext ) ;  // Cosine Similarity with tf idf
+  // result[ 1 ] = score( sparserow, tanimotooptions, selectedrows, defaultcontext, counters ) ;  // Tanimoto
+  // result[ 2 ] = accumscores( result, maxresults ) ;   // Accumulates the two scores into one based on better scoring
+  return result ;
+  }
+
+vector<Result_t> CosineHelper::cosinematching( const string &input,
+                                               uint64_t maxresults,
+                                               double threshold,
+                                               Querycontext_t &context ) const
+  {
+  Queryoptions_t options ;
+  options.maxresults = maxresults ;
+  options.threshold = threshold ;
+
+  return query( input, options, context ).results ;
+  }
+
+Queryresult_t CosineHelper::query( const string &input,
+                                   const Queryoptions_t &options,
+                                   Querycontext_t &context ) const
+  {
+  Queryresult_t result ;
+  Queryoptions_t myoptions( options ) ;
+  struct timespec querystarttime ;
+  clock_gettime( CLOCK_REALTIME, &querystarttime ) ;
+
+  if( myoptions.threshold < 0 )
+    myoptions.threshold = 0 ;
+
+  vector<Entry_t> sparserow ;
+  std::string inputtext ;
+
+  inputtext = myoptions.cleaninput ? cleaningtool( input ) : input ;
+
+  // form row matrix for input
+  formmatrixrow( inputtext, sparserow ) ;
+  result.counters.inputnnzs = sparserow[ 0 ] ;
+
+  // select the relevant rows from corpus, only those sharing an anchor quadgram
+  if( myoptions.useanchorwords )
+    gatheranchorrows( inputtext, myoptions, context.candidates, result.counters ) ;
+  else
+    context.candidates = selectrows() ;
+
+  result.results = score( sparserow, myoptions, context.candidates, context, result.counters ) ;
+  result.counters.elapsed = compute_elapsed( querystarttime ) ;
+
+  return result ;
+  }
+
+static bool columnless( const Batchweight_t &a, const Batchweight_t &b )
+  {
+  return( a.column < b.column ) ;
+  }
+
+vector<Queryresult_t> CosineHelper::batchquery( const vector<string> &inputs,
+                                                const Queryoptions_t &options,
+                                                Querycontext_t &context ) const
+  {
+  uint64_t ninputs = inputs.size() ;
+  vector<Queryresult_t> results( ninputs ) ;
+  Queryoptions_t myoptions( options ) ;
+
+  if( myoptions.threshold < 0 )
+    myoptions.threshold = 0 ;
+
+  if( myoptions.batchgroupsize == 0 )
+    myoptions.batchgroupsize = 1 ;
+
+  if( context.colhead.size() != nmatrixcols )
+    context.colhead.assign( nmatrixcols, UINT32_MAX ) ;
+
+  for( uint64_t first = 0 ; first < ninputs ; first += myoptions.batchgroupsize )
+    {
+    uint64_t ngroup = ( ( ninputs - first ) < myoptions.batchgroupsize ) ? ( ninputs - first )
+                                                                        : myoptions.batchgroupsize ;
+    scoregroup( inputs, first, ngroup, myoptions, context, results ) ;
+    }
+
+  return results ;
+  }
+
+void CosineHelper::scoregroup( const vector<string> &inputs,
+                               uint64_t first,
+                               uint64_t ngroup,
+                               const Queryoptions_t &options,
+                               Querycontext_t &context,
+                               vector<Queryresult_t> &results ) const
+  {
+  const uint64_t maxresults = options.maxresults ;
+  const double threshold = options.threshold ;
+  const bool useanchorwords = options.useanchorwords ;
+  const uint32_t corpussize = corpus.size() ;
+  struct timespec groupstarttime ;
+  clock_gettime( CLOCK_REALTIME, &groupstarttime ) ;
+
+  vector<vector<Entry_t> > sparserows( ngroup ) ;
+  vector<vector<uint32_t> > candidates( ngroup ) ;
+  vector<double> maginv( ngroup ) ;
+  vector<Batchweight_t> colweights ;
+  vector<uint64_t> pairs ;          // ( rownum << 32 ) | slot, sorted so each row is visited once
+  vector<uint64_t> counter( ngroup, 0 ) ;
+  vector<uint64_t> abovethreshold( ngroup, 0 ) ;
+  uint32_t* colhead = context.colhead.data() ;
+
+  // Form the input rows and their candidate rows
+#pragma omp parallel for schedule( dynamic ) num_threads( querythreads( context ) )
+  for( uint64_t q = 0 ; q < ngroup ; ++q )
+    {
+    Querycounters_t &counters = results[ first + q ].counters ;
+    string inputtext = options.cleaninput ? cleaningtool( inputs[ first + q ] ) : inputs[ first + q ] ;
+
+    formmatrixrow( inputtext, sparserows[ q ] ) ;
+    counters.inputnnzs = sparserows[ q ][ 0 ] ;
+    maginv[ q ] = inputmaginv( sparserows[ q ] ) ;
+
+    if( useanchorwords )
+      gatheranchorrows( inputtext, options, candidates[ q ], counters ) ;
+    }
+
+  // Gather the column weights of the group, one run per column
+  for( uint64_t q = 0 ; q < ngroup ; ++q )
+    {
+    uint32_t nentries = sparserows[ q ][ 0 ] ;
+    for( uint32_t i = 1 ; i <= nentries ; ++i )
       {
-      uint64_t rownum = selectedrows[ i ] ;
-      if( anchormask[ rownum ] > 0 )/*( ( anchormask[ rownum ] > 0 ) || true )*/
+      Batchweight_t colweight ;
+      colweight.column = entryindex( sparserows[ q ][ i ] ) ;
+      colweight.slot = q ;
+      colweight.weight = entryweight( sparserows[ q ][ i ] ) * idf[ colweight.column ] * idf[ colweight.column ] ;
+      colweights.push_back( colweight ) ;
+      }
+    }
+
+  sort( colweights.begin(), colweights.end(), columnless ) ;
+
+  uint32_t ncolweights = colweights.size() ;
+  for( uint32_t i = ncolweights ; i > 0 ; --i )
+    colhead[ colweights[ i - 1 ].column ] = i - 1 ;
+
+  // Pair every candidate row with the queries that reached it
+  if( useanchorwords )
+    {
+    uint64_t npairs = 0 ;
+    for( uint64_t q = 0 ; q < ngroup ; ++q )
+      npairs += candidates[ q ].size() ;
+
+    pairs.reserve( npairs ) ;
+    for( uint64_t q = 0 ; q < ngroup ; ++q )
+      {
+      uint64_t ncandidates = candidates[ q ].size() ;
+      for( uint64_t i = 0 ; i < ncandidates ; ++i )
+        pairs.push_back( ( uint64_t( candidates[ q ][ i ] ) << 32 ) | q ) ;
+      vector<uint32_t>().swap( candidates[ q ] ) ;
+      }
+
+    sort( pairs.begin(), pairs.end() ) ;
+    }
+
+  uint64_t npairs = pairs.size() ;
+  uint64_t nsteps = useanchorwords ? npairs : corpussize ;
+
+  int nthreads = querythreads( context ) ;
+  vector<Topscores> &threadtops = context.threadtops ;   // [ thread * ngroup + slot ]
+  if( threadtops.size() < nthreads * ngroup )
+    threadtops.resize( nthreads * ngroup ) ;
+
+  for( uint64_t q = 0 ; q < ngroup ; ++q )
+    threadtops[ q ].reset( 0 ) ;
+
+  if( maxresults > 0 )
+    {
+#pragma omp parallel num_threads( nthreads )
+    {
+    int myid = omp_get_thread_num() ;
+    Topscores* mytops = &threadtops[ myid * ngroup ] ;
+    vector<uint64_t> mycounter( ngroup, 0 ) ;
+    vector<uint64_t> myabovethreshold( ngroup, 0 ) ;
+    vector<double> dots( ngroup, 0 ) ;
+
+    for( uint64_t q = 0 ; q < ngroup ; ++q )
+      mytops[ q ].reset( maxresults, nsteps ) ;
+
+#pragma omp for schedule( dynamic, 1024 ) nowait
+    for( uint64_t i = 0 ; i < nsteps ; ++i )
+      {
+      uint32_t rownum = useanchorwords ? ( pairs[ i ] >> 32 ) : i ;
+
+      // Only the first pair of a row does the work, for all of its queries
+      if( useanchorwords && ( i > 0 ) && ( ( pairs[ i - 1 ] >> 32 ) == rownum ) )
+        continue ;
+      if( !useanchorwords && isdeleted( rownum ) )
+        continue ;
+
+      batchdotrow( rownum, colweights, colhead, dots.data() ) ;
+
+      // With anchors the row's pairs from i on name its queries, without
+      // every query of the group scores it
+      uint64_t j = useanchorwords ? i : 0 ;
+      uint64_t end = useanchorwords ? npairs : ngroup ;
+      for( ; j < end ; ++j )
         {
-        double rowscore = 0 ;
-        double dot = 0 ;
-        uint32_t rowinfoindex = corpus[ rownum ].rowinfoindex ;
-        uint32_t nword = corpusrowinfo[ rowinfoindex ] ;
-        for( uint32_t r = 1 ; r <= nword ; ++r )
-          {    
-          uint32_t wordind = corpusrowinfo[ rowinfoindex + r ] ;
-          uint32_t* sparserow = wordlist[ wordind ].rownnzs ;
-          dot += dotrow( sparserow ) ;
+        uint64_t slot ;
+        if( useanchorwords )
+          {
+          if( ( pairs[ j ] >> 32 ) != rownum )
+            break ;
+          slot = pairs[ j ] & 0xffffffff ;
           }
+        else
+          slot = j ;
+
+        double dot = dots[ slot ] ;
+        double rowscore ;
 
-        if( tanimoto )
-          { 
-          double denom = 1 / ( inputrowmaginv * inputrowmaginv ) + 
+        if( options.tanimoto )
+          {
+          double denom = 1 / ( maginv[ slot ] * maginv[ slot ] ) +
                          1 / ( corpus[ rownum ].rowmaginv * corpus[ rownum ].rowmaginv )
                          - dot ;
           rowscore = dot / denom ;
           }
         else
-          rowscore = dot * corpus[ rownum ].rowmaginv * inputrowmaginv ;
+          rowscore = dot * corpus[ rownum ].rowmaginv * maginv[ slot ] ;
 
         if( rowscore >= threshold )
-          addtotopscores( rownum, rowscore, myrowindexes, myrowscores ) ;
-        
-#pragma omp atomic update
-        ++counter ;
-        } // end of if
+          {
+          mytops[ slot ].add( rownum, rowscore ) ;
+          ++myabovethreshold[ slot ] ;
+          }
+
+        ++mycounter[ slot ] ;
+        }
+
+      for( uint64_t q = 0 ; q < ngroup ; ++q )
+        dots[ q ] = 0 ;
       } // end of for
 
-#pragma omp critical( addtotopscores_lock )
+    for( uint64_t q = 0 ; q < ngroup ; ++q )
       {
-      for( uint64_t j = 0 ; j < maxresults ; ++j )
-        addtotopscores( myrowindexes[ j ], myrowscores[ j ], maxrowindexes, maxrowscores ) ;
-      } // end of critical
-    } // end of parallel
+#pragma omp atomic
+      counter[ q ] += mycounter[ q ] ;
+#pragma omp atomic
+      abovethreshold[ q ] += myabovethreshold[ q ] ;
+      }
 
-    if( useanchorwords )
-      scatteranchormasks( inputtext, 0 ) ;
-    scatterweights( inputnnzs, true ) ; // zero them out
+    mergetopscores( threadtops, ngroup, myid, omp_get_num_threads() ) ;
+    } // end of parallel
     } // End of if
 
-  uint64_t maxrowindexessize = maxrowindexes.size() ;
-  if( maxrowindexessize > 0 )
+  for( uint32_t i = 0 ; i < ncolweights ; ++i )
+    colhead[ colweights[ i ].column ] = UINT32_MAX ;
+
+  double elapsed = compute_elapsed( groupstarttime ) ;
+
+  vector<Scoredrow_t> toprows ;
+  for( uint64_t q = 0 ; q < ngroup ; ++q )
+    {
+    Queryresult_t &result = results[ first + q ] ;
+    threadtops[ q ].extract( toprows ) ;
+    uint64_t ntoprows = toprows.size() ;
+    result.results.resize( ntoprows ) ;
+    for( uint64_t i = 0 ; i < ntoprows ; ++i )
+      {
+      result.results[ i ].part = getcorpustext( toprows[ i ].rownum ) ;
+      result.results[ i ].row = toprows[ i ].rownum ;
+      result.results[ i ].score = toprows[ i ].score ;
+      }
+
+    result.counters.rowsscored = counter[ q ] ;
+    result.counters.rowsabovethreshold = abovethreshold[ q ] ;
+    result.counters.elapsed = elapsed / ngroup ;   // Group wall time shared by its queries
+    }
+  }
+
+void CosineHelper::batchdotrow( uint32_t rownum,
+                                const vector<Batchweight_t> &colweights,
+                                const uint32_t* colhead,
+                                double* dots ) const
+  {
+  if( loadoptions.compiledrows )
+    {
+    batchdotentries( &csrentries[ csrrowstart[ rownum ] ], colweights, colhead, dots ) ;
+    return ;
+    }
+
+  uint32_t rowinfoindex = corpus[ rownum ].rowinfoindex ;
+  uint32_t nword = corpusrowinfo[ rowinfoindex ] ;
+
+  for( uint32_t r = 1 ; r <= nword ; ++r )
+    {
+    uint32_t wordind = corpusrowinfo[ rowinfoindex + r ] ;
+    batchdotentries( wordrow( wordind ), colweights, colhead, dots ) ;
+    }
+  }
+
+// Column weights carry both idfs, a row entry only contributes its tf
+void CosineHelper::batchdotentries( const Entry_t* rowentries,
+                                    const vector<Batchweight_t> &colweights,
+                                    const uint32_t* colhead,
+                                    double* dots ) const
+  {
+  uint32_t ncolweights = colweights.size() ;
+  uint32_t n = rowentries[ 0 ] ;
+  for( uint32_t i = 1 ; i <= n ; ++i )
+    {
+    uint32_t entry = entryindex( rowentries[ i ] ) ;
+    uint32_t k = colhead[ entry ] ;
+    if( k == UINT32_MAX )
+      continue ;
+
+    double rowweight = entryweight( rowentries[ i ] ) ;
+    for( ; ( k < ncolweights ) && ( colweights[ k ].column == entry ) ; ++k )
+      dots[ colweights[ k ].slot ] += colweights[ k ].weight * rowweight ;
+    }
+  }
+
+void CosineHelper::gatheranchorrows( const string &inputtext,
+                                     const Queryoptions_t &options,
+                                     vector<uint32_t> &rows,
+                                     Querycounters_t &counters ) const
+  {
+  set<uint32_t> myanchorwords ;
+  generatequadgrams( inputtext, myanchorwords ) ;
+  set<uint32_t>::const_iterator it ;
+
+  vector<uint64_t> runstarts ;
+  vector<uint64_t> mergedstarts ;
+  uint64_t nanchorquads = 0 ;       // Input quadgrams that have a posting list
+
+  rows.clear() ;
+  for( it = myanchorwords.begin() ; it != myanchorwords.end() ; ++it )
+    {
+    Postinglist_t quadrows = anchorwords.getquadrows( *it ) ;
+    if( quadrows.size() > 0 )
+      {
+      ++nanchorquads ;
+      runstarts.push_back( rows.size() ) ;
+      quadrows.appendto( rows ) ;
+      }
+    }
+  runstarts.push_back( rows.size() ) ;
+
+  // Posting lists are sorted, merge neighbouring runs pairwise until one is left
+  while( runstarts.size() > 2 )
+    {
+    uint64_t nruns = runstarts.size() - 1 ;
+    uint64_t i ;
+    mergedstarts.clear() ;
+    for( i = 0 ; i + 1 < nruns ; i += 2 )
+      {
+      inplace_merge( rows.begin() + runstarts[ i ],
+                     rows.begin() + runstarts[ i + 1 ],
+                     rows.begin() + runstarts[ i + 2 ] ) ;
+      mergedstarts.push_back( runstarts[ i ] ) ;
+      }
+    if( i < nruns )
+      mergedstarts.push_back( runstarts[ i ] ) ;
+    mergedstarts.push_back( runstarts[ nruns ] ) ;
+    runstarts.swap( mergedstarts ) ;
+    }
+
+  counters.anchorquads = myanchorwords.size() ;
+  filteroverlap( options, nanchorquads, rows, counters ) ;
+  }
+
+// rows holds one entry per shared quadgram, sorted, so the overlap of a row is
+// the length of its run.  Reduces rows to the distinct rows passing the filter.
+void CosineHelper::filteroverlap( const Queryoptions_t &options,
+                                  uint64_t nanchorquads,
+                                  vector<uint32_t> &rows,
+                                  Querycounters_t &counters ) const
+  {
+  uint64_t minoverlap = ( options.minoverlap > 0 ) ? options.minoverlap : 1 ;
+  uint64_t topnoverlap = options.topnoverlap ;
+  uint64_t nrows = rows.size() ;
+  uint64_t ndistinct = 0 ;
+  uint64_t nkept = 0 ;
+
+  if( options.derivedoverlap )
+    {
+    // For the input quadgram set A and a row set B, |A^B| <= |B| so a cosine
+    // of |A^B| / sqrt( |A| |B| ) >= t needs |A^B| >= t * t * |A|.  Quadgrams
+    // without a posting list can never be shared and are left out of |A|.
+    // The tf-idf score counts bigrams and words rather than quadgrams, so
+    // this bound does not hold for it.  Scaled by overlapslack it is a
+    // heuristic only, rows scoring above threshold can be dropped, make
+    // check reports how many.
+    double threshold = ( options.threshold < 1 ) ? options.threshold : 1 ;
+    minoverlap = ceil( options.overlapslack * threshold * threshold * nanchorquads - 1.e-9 ) ;
+    if( minoverlap < 1 )
+      minoverlap = 1 ;
+    topnoverlap = 0 ;
+    }
+
+  vector<uint64_t> ranked ;     // ( ~overlap << 32 ) | rownum, best overlap and lowest row first
+  for( uint64_t i = 0 ; i < nrows ; )
+    {
+    uint64_t j = i + 1 ;
+    while( ( j < nrows ) && ( rows[ j ] == rows[ i ] ) )
+      ++j ;
+
+    // Postings still hold deleted rows until compaction
+    if( isdeleted( rows[ i ] ) )
+      {
+      i = j ;
+      continue ;
+      }
+
+    uint64_t overlap = j - i ;
+    if( overlap >= minoverlap )
+      {
+      if( topnoverlap > 0 )
+        ranked.push_back( ( uint64_t( UINT32_MAX - overlap ) << 32 ) | rows[ i ] ) ;
+      else
+        rows[ nkept ] = rows[ i ] ;
+      ++nkept ;
+      }
+    ++ndistinct ;
+    i = j ;
+    }
+
+  if( ( topnoverlap > 0 ) && ( nkept > topnoverlap ) )
+    {
+    nth_element( ranked.begin(), ranked.begin() + topnoverlap, ranked.end() ) ;
+    ranked.resize( topnoverlap ) ;
+    nkept = topnoverlap ;
+    }
+
+  if( topnoverlap > 0 )
+    {
+    for( uint64_t i = 0 ; i < nkept ; ++i )
+      rows[ i ] = ranked[ i ] & 0xffffffff ;
+    sort( rows.begin(), rows.begin() + nkept ) ;
+    }
+
+  rows.resize( nkept ) ;
+  counters.anchorrows = ndistinct ;
+  counters.minoverlap = minoverlap ;
+  }
+
+// Returns whether the compact vector was used, an input too large for it
+// is scattered into the dense one
+bool CosineHelper::scatterweights( const vector<Entry_t> &rowentries, bool dozero,
+                                   bool compact, Querycontext_t &context ) const
+  {
+  uint32_t nentries = ( rowentries.size() > 0 ) ? rowentries[ 0 ] : 0 ;
+  vector<float> &foldedcofs = context.foldedcofs ;
+  Queryhash &compactcofs = context.compactcofs ;
+
+  if( compact )
     {
-    result.resize( maxrowindexessize ) ;
-    uint64_t count = 0 ;  // Testing remove in final
-    for( uint64_t i = 0 ; i < maxrowindexessize ; ++i )
+    if( dozero )
+      return( true ) ;            // Rebuilt by the next input
+
+    compactcofs.reset() ;
+    for( uint32_t i = 1 ; i <= nentries ; ++i )
       {
-      if( maxrowscores[ i ] >= threshold )  // Testing, remove in final
+      uint32_t index = entryindex( rowentries[ i ] ) ;
+      compactcofs.add( index, entryweight( rowentries[ i ] ) * idf[ index ] * idf[ index ] ) ;
+      }
+    if( compactcofs.place() )
+      {
+      context.inputrowmaginv = inputmaginv( rowentries ) ;
+      return( true ) ;
+      }
+    }
+
+  if( dozero )
+    for( uint32_t i = 1 ; i <= nentries ; ++i )
+      {
+      uint32_t index = entryindex( rowentries[ i ] ) ;
+      foldedcofs[ index ] = 0 ;
+      }
+  else
+    {
+    // Sized on first use, and again once inserts have added columns.  It
+    // is all zeros between queries so it can be grown as it is.
+    if( foldedcofs.size() != nmatrixcols )
+      foldedcofs.resize( nmatrixcols, 0 ) ;
+
+    // The input weight tf * idf times the corpus side idf of the column
+    for( uint32_t i = 1 ; i <= nentries ; ++i )
+      {
+      uint32_t index = entryindex( rowentries[ i ] ) ;
+      double cof = entryweight( rowentries[ i ] ) * idf[ index ] * idf[ index ] ;
+      foldedcofs[ index ] += cof ;
+      }
+    context.inputrowmaginv = inputmaginv( rowentries ) ;
+    }
+  return( false ) ;
+  }
+
+double CosineHelper::inputmaginv( const vector<Entry_t> &rowentries ) const
+  {
+  const double eps = 1.e-12 ;
+  double mag = 0 ;
+  uint32_t nentries = ( rowentries.size() > 0 ) ? rowentries[ 0 ] : 0 ;
+
+  for( uint32_t i = 1 ; i <= nentries ; ++i )
+    {
+    uint32_t index = entryindex( rowentries[ i ] ) ;
+    double cof = entryweight( rowentries[ i ] ) * idf[ index ] ;
+    mag += cof * cof ;
+    }
+  mag = sqrt( mag ) ;
+
+  return( ( mag > eps ) ? ( 1 / mag ) : ( 1 / eps ) ) ;
+  }
+
+// The corpus side idf is already folded into foldedcofs, so each entry
+// is one gather, see dotkernels.h
+double CosineHelper::dotrow( const Entry_t* rowentries, const float* foldedcofs ) const
+  {
+  return( dotkernel( rowentries, foldedcofs ) ) ;
+  }
+
+// Runs every kernel the CPU supports over all word rows against a made up
+// folded input row and reports how far each strays from the scalar kernel.
+// Returns the number of kernels that strayed, make check runs it.
+int CosineHelper::checkdotkernels( void ) const
+  {
+  int nfailed = 0 ;
+  vector<float> foldedcofs( nmatrixcols ) ;
+  uint32_t seed = 12345 ;
+  for( uint32_t i = 0 ; i < nmatrixcols ; ++i )
+    {
+    seed = seed * 1103515245 + 12345 ;
+    foldedcofs[ i ] = ( ( seed >> 8 ) & 0xffff ) / 65536.0f ;
+    }
+
+  vector<Dotkernel_t> kernels ;
+  __builtin_cpu_init() ;
+#ifndef _WIDEENTRIES
+  if( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ) )
+    kernels.push_back( dotrowavx2 ) ;
+  if( __builtin_cpu_supports( "avx512f" ) )
+    kernels.push_back( dotrowavx512 ) ;
+#endif
+
+  uint32_t wordlistsize = wordlist.size() ;
+  if( kernels.empty() )
+    cout << makemytimebracketed() << " Kernel scalar only, nothing to compare" << endl ;
+  for( uint32_t k = 0 ; k < kernels.size() ; ++k )
+    {
+    uint64_t exact = 0 ;
+    double maxrelerr = 0 ;
+    for( uint32_t i = 0 ; i < wordlistsize ; ++i )
+      {
+      double expected = dotrowscalar( wordrow( i ), foldedcofs.data() ) ;
+      double got = kernels[ k ]( wordrow( i ), foldedcofs.data() ) ;
+      if( got == expected )
+        ++exact ;
+      else
+        maxrelerr = max( maxrelerr, fabs( got - expected ) / max( fabs( expected ), 1.e-30 ) ) ;
+      }
+    cout << makemytimebracketed() << " Kernel " << dotkernelname( kernels[ k ] ) << ": " << exact << " of "
+         << wordlistsize << " rows bit exact, max relative error " << maxrelerr
+         << ( ( maxrelerr < 1.e-12 ) ? " ok" : " FAILED" ) << endl ;
+    nfailed += ( maxrelerr < 1.e-12 ) ? 0 : 1 ;
+    }
+
+  // Hashed kernels against the dense scalar kernel, the made up input row
+  // takes the columns of a few word rows and is zero elsewhere
+  Queryhash compactcofs ;
+  vector<float> densecofs( nmatrixcols, 0 ) ;
+  compactcofs.reset() ;
+  for( uint32_t i = 0 ; ( i < wordlistsize ) && ( compactcofs.size() < 48 ) ; i += 1 + wordlistsize / 8 )
+    for( uint32_t j = 1 ; j <= wordrow( i )[ 0 ] ; ++j )
+      {
+      uint32_t column = entryindex( wordrow( i )[ j ] ) ;
+      compactcofs.add( column, foldedcofs[ column ] ) ;
+      densecofs[ column ] += foldedcofs[ column ] ;
+      }
+  if( !compactcofs.place() )
+    {
+    cout << makemytimebracketed() << " Hashed kernels: could not place " << compactcofs.size() << " columns FAILED" << endl ;
+    return( nfailed + 1 ) ;
+    }
+
+#ifndef _WIDEENTRIES
+  Hashkernel_t hashkernels[ 3 ] = { dotrowhashedscalar, dotrowhashedavx2, dotrowhashedavx512 } ;
+  bool supported[ 3 ] = { true,
+                          __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ),
+                          __builtin_cpu_supports( "avx512f" ) != 0 } ;
+#else
+  Hashkernel_t hashkernels[ 3 ] = { dotrowhashedscalar, NULL, NULL } ;
+  bool supported[ 3 ] = { true, false, false } ;
+#endif
+  const char* hashkernelnames[ 3 ] = { "hashed scalar", "hashed avx2", "hashed avx512" } ;
+  for( uint32_t k = 0 ; k < 3 ; ++k )
+    {
+    if( !supported[ k ] )
+      continue ;
+
+    uint64_t exact = 0 ;
+    double maxrelerr = 0 ;
+    for( uint32_t i = 0 ; i < wordlistsize ; ++i )
+      {
+      double expected = dotrowscalar( wordrow( i ), densecofs.data() ) ;
+      double got = hashkernels[ k ]( wordrow( i ), compactcofs ) ;
+      if( got == expected )
+        ++exact ;
+      else
+        maxrelerr = max( maxrelerr, fabs( got - expected ) / max( fabs( expected ), 1.e-30 ) ) ;
+      }
+    cout << makemytimebracketed() << " Kernel " << hashkernelnames[ k ] << ": " << exact << " of "
+         << wordlistsize << " rows bit exact, max relative error " << maxrelerr
+         << ( ( maxrelerr < 1.e-12 ) ? " ok" : " FAILED" ) << endl ;
+    nfailed += ( maxrelerr < 1.e-12 ) ? 0 : 1 ;
+    }
+  return( nfailed ) ;
+  }
+
+#ifdef _BENCHGRAMS
+// The gram and word routines as they were before the slot tables and the
+// sort-unique trigrams, kept to time the current ones against
+static void formerbigrams( const string &data, vector<uint32_t> &bigrams, vector<uint32_t> &bigramcount )
+  {
+  static uint32_t uniquebigrams[ 256ULL * 256ULL ] ;
+  static uint32_t uniquebigramscount[ 256ULL * 256ULL ] ;
+  uint32_t nuniquebigrams = 0 ;
+  uint32_t n = data.size() ;
+
+  bigrams.clear() ;
+  bigramcount.clear() ;
+  if( n == 0 )
+    return ;
+
+  for( uint32_t i = 0 ; i <= n ; ++i )
+    {
+    char c1 = ( i > 0 ) ? data[ i - 1 ] : ' ' ;
+    char c2 = ( i < n ) ? data[ i ] : ' ' ;
+    if( isprint( c1 ) && isprint( c2 ) )
+      {
+      uint32_t index = *( unsigned char * ) &c1 * 256UL + *( unsigned char * ) &c2 ;
+      uint32_t k ;
+      for( k = 0 ; k < nuniquebigrams ; ++k )
+        if( uniquebigrams[ k ] == index )
+          break ;
+      if( k == nuniquebigrams )
         {
-        result[ i ].part = getcorpustext( maxrowindexes[ i ] ) ;
-        
-        result[ i ].score = maxrowscores[ i ] ;
-        ++count ;  // Testing remove in final
+        uniquebigrams[ nuniquebigrams ] = index ;
+        uniquebigramscount[ nuniquebigrams ] = 1 ;
+        ++nuniquebigrams ;
         }
+      else
+        ++uniquebigramscount[ k ] ;
       }
-    result.resize( count ) ;
-    } // end of if
+    }
+  bigrams.assign( uniquebigrams, uniquebigrams + nuniquebigrams ) ;
+  bigramcount.assign( uniquebigramscount, uniquebigramscount + nuniquebigrams ) ;
+  }
+
+static void formertrigrams( const string &data, vector<uint32_t> &trigrams, vector<uint32_t> &trigramcount )
+  {
+  uint32_t n = data.size() ;
+  map<uint32_t,uint32_t> uniquetrigrams ;
+
+  trigrams.clear() ;
+  trigramcount.clear() ;
+  if( n <= 1 )
+    return ;
+
+  for( uint32_t i = 0 ; i <= n ; ++i )
+    {
+    char c1 = ( i > 0 ) ? data[ i - 1 ] : ' ' ;
+    char c2 = data[ i ] ;
+    char c3 = ( i < ( n - 1 ) ) ? data[ i + 1 ] : ' ' ;
+    if( ( c2 != ' ' ) && isprint( c1 ) && isprint( c2 ) && isprint( c3 ) )
+      ++uniquetrigrams[ *( unsigned char * ) &c1 * 256UL * 256UL + *( unsigned char * ) &c2 * 256UL + *( unsigned char * ) &c3 ] ;
+    }
+  for( map<uint32_t,uint32_t>::const_iterator it = uniquetrigrams.begin() ; it != uniquetrigrams.end() ; ++it )
+    {
+    trigrams.push_back( it->first ) ;
+    trigramcount.push_back( it->second ) ;
+    }
+  }
+
+static void formerwords( const string &data, Splitwords &splitwords,
+                         vector<string> &uniqueword, vector<uint32_t> &wordcount )
+  {
+  uniqueword.clear() ;
+  splitwords.resize( 0 ) ;
+  wordcount.clear() ;
+
+  uniqueword.reserve( 16 ) ;
+  wordcount.reserve( 16 ) ;
+
+  uint32_t nword = splitwords.split( data, ' ', false ) ;
+  wordcount.reserve( nword ) ;
+  uniqueword.reserve( nword ) ;
+  for( uint32_t i = 0 ; i < nword ; ++i )
+    {
+    uint32_t nunique = uniqueword.size() ;
+    uint32_t j ;
+    for( j = 0 ; j < nunique ; ++j )
+      if( splitwords[ i ] == uniqueword[ j ] )
+        break ;
+    if( j < nunique )
+      ++wordcount[ j ] ;
+    else
+      {
+      uniqueword.push_back( splitwords[ i ] ) ;
+      wordcount.push_back( 1 ) ;
+      }
+    }
+  }
+
+static void reportbench( const char* what, uint64_t n, double former, double current, uint64_t ndiffer )
+  {
+  cout << makemytimebracketed() << " Bench " << what << ": " << n << " inputs, former " << former
+       << " s, current " << current << " s, " << ( current > 0 ? former / current : 0 ) << "x, "
+       << ndiffer << " outputs differ" << ( ndiffer == 0 ? " ok" : " FAILED" ) << endl ;
+  }
+
+// Times every routine on one thread over the corpus rows, and over long
+// records of 100 rows joined, against its former version, and checks the
+// two give the same output in the same order
+void CosineHelper::benchgrams( void ) const
+  {
+  const uint32_t corpussize = corpus.size() ;
+  vector<string> rowtexts( corpussize ) ;
+  vector<string> longtexts ;
+  for( uint32_t i = 0 ; i < corpussize ; ++i )
+    {
+    rowtexts[ i ] = getcorpustext( i ) ;
+    if( i % 100 == 0 )
+      longtexts.push_back( rowtexts[ i ] ) ;
+    else
+      longtexts.back() += " " + rowtexts[ i ] ;
+    }
+
+  vector<uint32_t> grams ;
+  vector<uint32_t> counts ;
+  vector<uint32_t> formergrams ;
+  vector<uint32_t> formercounts ;
+  vector<string> words ;
+  vector<string> formerwordlist ;
+  Splitwords splitwords ;
+  struct timespec starttime ;
+  uint64_t sink = 0 ;                 // Keeps the timed loops from being dropped
+
+  const vector<string>* inputs[ 2 ] = { &rowtexts, &longtexts } ;
+  const char* inputnames[ 2 ] = { "rows", "long records" } ;
+  for( uint32_t t = 0 ; t < 2 ; ++t )
+    {
+    const vector<string> &texts = *inputs[ t ] ;
+    uint64_t ntexts = texts.size() ;
+    double former ;
+    double current ;
+    uint64_t ndiffer ;
+    string what ;
+
+    clock_gettime( CLOCK_REALTIME, &starttime ) ;
+    for( uint64_t i = 0 ; i < ntexts ; ++i )
+      {
+      formerbigrams( texts[ i ], grams, counts ) ;
+      sink += grams.size() ;
+      }
+    former = compute_elapsed( starttime ) ;
+    clock_gettime( CLOCK_REALTIME, &starttime ) ;
+    for( uint64_t i = 0 ; i < ntexts ; ++i )
+      {
+      getuniquebigrams( texts[ i ], grams, counts ) ;
+      sink += grams.size() ;
+      }
+    current = compute_elapsed( starttime ) ;
+    ndiffer = 0 ;
+    for( uint64_t i = 0 ; i < ntexts ; ++i )
+      {
+      formerbigrams( texts[ i ], formergrams, formercounts ) ;
+      getuniquebigrams( texts[ i ], grams, counts ) ;
+      ndiffer += ( grams != formergrams ) || ( counts != formercounts ) ;
+      }
+    what = string( "getuniquebigrams, " ) + inputnames[ t ] ;
+    reportbench( what.c_str(), ntexts, former, current, ndiffer ) ;
+
+    clock_gettime( CLOCK_REALTIME, &starttime ) ;
+    for( uint64_t i = 0 ; i < ntexts ; ++i )
+      {
+      formertrigrams( texts[ i ], grams, counts ) ;
+      sink += grams.size() ;
+      }
+    former = compute_elapsed( starttime ) ;
+    clock_gettime( CLOCK_REALTIME, &starttime ) ;
+    for( uint64_t i = 0 ; i < ntexts ; ++i )
+      {
+      getuniquetrigrams( texts[ i ], grams, counts ) ;
+      sink += grams.size() ;
+      }
+    current = compute_elapsed( starttime ) ;
+    ndiffer = 0 ;
+    for( uint64_t i = 0 ; i < ntexts ; ++i )
+      {
+      formertrigrams( texts[ i ], formergrams, formercounts ) ;
+      getuniquetrigrams( texts[ i ], grams, counts ) ;
+      ndiffer += ( grams != formergrams ) || ( counts != formercounts ) ;
+      }
+    what = string( "getuniquetrigrams, " ) + inputnames[ t ] ;
+    reportbench( what.c_str(), ntexts, former, current, ndiffer ) ;
+
+    clock_gettime( CLOCK_REALTIME, &starttime ) ;
+    for( uint64_t i = 0 ; i < ntexts ; ++i )
+      {
+      formerwords( texts[ i ], splitwords, words, counts ) ;
+      sink += words.size() ;
+      }
+    former = compute_elapsed( starttime ) ;
+    clock_gettime( CLOCK_REALTIME, &starttime ) ;
+    for( uint64_t i = 0 ; i < ntexts ; ++i )
+      {
+      uniquewords( texts[ i ], ' ', splitwords, words, counts ) ;
+      sink += words.size() ;
+      }
+    current = compute_elapsed( starttime ) ;
+    ndiffer = 0 ;
+    for( uint64_t i = 0 ; i < ntexts ; ++i )
+      {
+      formerwords( texts[ i ], splitwords, formerwordlist, formercounts ) ;
+      uniquewords( texts[ i ], ' ', splitwords, words, counts ) ;
+      ndiffer += ( words != formerwordlist ) || ( counts != formercounts ) ;
+      }
+    what = string( "uniquewords, " ) + inputnames[ t ] ;
+    reportbench( what.c_str(), ntexts, former, current, ndiffer ) ;
+    }
+
+  // mergerow() against a scan of every column merged so far, its former self
+  vector<uint32_t> unique ;
+  auto formermerge = [ & ]( uint32_t row )
+    {
+    formergrams.clear() ;
+    formercounts.clear() ;
+    uint32_t rowinfoindex = corpus[ row ].rowinfoindex ;
+    uint32_t nwords = corpusrowinfo[ rowinfoindex ] ;
+    for( uint32_t j = 0 ; j < nwords ; ++j )
+      {
+      const Entry_t* rownnzs = wordrow( corpusrowinfo[ rowinfoindex + j + 1 ] ) ;
+      for( uint32_t k = 1 ; k <= rownnzs[ 0 ] ; ++k )
+        {
+        uint32_t index = entryindex( rownnzs[ k ] ) ;
+        uint32_t l ;
+        for( l = 0 ; l < formergrams.size() ; ++l )
+          if( formergrams[ l ] == index )
+            break ;
+        if( l < formergrams.size() )
+          formercounts[ l ] += entryweight( rownnzs[ k ] ) ;
+        else
+          {
+          formergrams.push_back( index ) ;
+          formercounts.push_back( entryweight( rownnzs[ k ] ) ) ;
+          }
+        }
+      }
+    } ;
+
+  clock_gettime( CLOCK_REALTIME, &starttime ) ;
+  for( uint32_t row = 0 ; row < corpussize ; ++row )
+    {
+    formermerge( row ) ;
+    sink += formergrams.size() ;
+    }
+  double former = compute_elapsed( starttime ) ;
+  clock_gettime( CLOCK_REALTIME, &starttime ) ;
+  for( uint32_t row = 0 ; row < corpussize ; ++row )
+    {
+    mergerow( row, unique, counts ) ;
+    sink += unique.size() ;
+    }
+  double current = compute_elapsed( starttime ) ;
+  uint64_t ndiffer = 0 ;
+  for( uint32_t row = 0 ; row < corpussize ; ++row )
+    {
+    formermerge( row ) ;
+    mergerow( row, unique, counts ) ;
+    ndiffer += ( unique != formergrams ) || ( counts != formercounts ) ;
+    }
+  reportbench( "mergerow, rows", corpussize, former, current, ndiffer ) ;
+
+  if( sink == 0 )
+    cout << makemytimebracketed() << " Bench: nothing was timed" << endl ;
+  }
+#endif
+
+vector<Result_t> CosineHelper::score( const vector<Entry_t> &inputnnzs, 
+                                      const Queryoptions_t &options,
+                                      const vector<uint32_t> &selectedrows,
+                                      Querycontext_t &context,
+                                      Querycounters_t &counters ) const
+  {
+  const bool tanimoto = options.tanimoto ;
+  const uint64_t maxresults = options.maxresults ;
+  const double threshold = options.threshold ;
+
+  vector<Result_t> result ;   // stores the current set of results
+  vector<Scoredrow_t> toprows ; // highest scoring rows, best first
+  uint64_t counter = 0 ;
+  uint64_t abovethreshold = 0 ;
+
+  uint64_t selectedrowsize = selectedrows.size() ;
+  int nthreads = querythreads( context ) ;
+
+  if( context.threadtops.size() < ( uint64_t ) nthreads )
+    context.threadtops.resize( nthreads ) ;
+
+  if( maxresults > 0 )
+    {
+  // Small inputs against a wide matrix hash their few columns, the table
+  // stays in L1.  Below compactmincols the dense vector's hot columns stay
+  // cached and its single gather per entry is as fast or faster.
+  const bool compact = scatterweights( inputnnzs, false,
+                                       ( nmatrixcols >= options.compactmincols ) && ( inputnnzs.size() > 0 )
+                                       && ( inputnnzs[ 0 ] <= options.compactnnzs ),
+                                       context ) ; // makes a dense or compact vector
+
+  const float* foldedcofs = context.foldedcofs.data() ;
+  const Queryhash &compactcofs = context.compactcofs ;
+  const float inputrowmaginv = context.inputrowmaginv ;
+  const bool compiled = loadoptions.compiledrows ;
+  vector<Topscores> &threadtops = context.threadtops ;
+
+#pragma omp parallel num_threads( nthreads ) reduction( + : counter, abovethreshold )
+    {
+    int myid = omp_get_thread_num() ;
+    Topscores &mytops = threadtops[ myid ] ;
+    mytops.reset( maxresults, selectedrowsize ) ;
+
+#pragma omp for schedule ( static ) nowait
+    for( uint64_t i = 0 ; i < selectedrowsize ; ++i )
+      {
+      uint64_t rownum = selectedrows[ i ] ;
+      double rowscore = 0 ;
+      double dot = 0 ;
+      if( compiled )
+        {
+        const Entry_t* sparserow = &csrentries[ csrrowstart[ rownum ] ] ;
+        dot = compact ? hashkernel( sparserow, compactcofs ) : dotrow( sparserow, foldedcofs ) ;
+        }
+      else
+        {
+        uint32_t rowinfoindex = corpus[ rownum ].rowinfoindex ;
+        uint32_t nword = corpusrowinfo[ rowinfoindex ] ;
+        for( uint32_t r = 1 ; r <= nword ; ++r )
+          {    
+          uint32_t wordind = corpusrowinfo[ rowinfoindex + r ] ;
+          const Entry_t* sparserow = wordrow( wordind ) ;
+          dot += compact ? hashkernel( sparserow, compactcofs ) : dotrow( sparserow, foldedcofs ) ;
+          }
+        }
+
+      if( tanimoto )
+        { 
+        double denom = 1 / ( inputrowmaginv * inputrowmaginv ) + 
+                       1 / ( corpus[ rownum ].rowmaginv * corpus[ rownum ].rowmaginv )
+                       - dot ;
+        rowscore = dot / denom ;
+        }
+      else
+        rowscore = dot * corpus[ rownum ].rowmaginv * inputrowmaginv ;
+
+      if( rowscore >= threshold )
+        {
+        mytops.add( rownum, rowscore ) ;
+        ++abovethreshold ;
+        }
+      
+      ++counter ;
+      } // end of for
+
+    mergetopscores( threadtops, 1, myid, omp_get_num_threads() ) ;
+    } // end of parallel
+
+    threadtops[ 0 ].extract( toprows ) ;
+    scatterweights( inputnnzs, true, compact, context ) ; // zero them out
+    counters.compactquery = compact ;
+    } // End of if
+
+  uint64_t ntoprows = toprows.size() ;
+  result.resize( ntoprows ) ;
+  for( uint64_t i = 0 ; i < ntoprows ; ++i )
+    {
+    result[ i ].part = getcorpustext( toprows[ i ].rownum ) ;
+    result[ i ].row = toprows[ i ].rownum ;
+    result[ i ].score = toprows[ i ].score ;
+    }
 
-  cout<<"Number of row multiplication -> "<<counter<<endl ;
+  counters.rowsscored = counter ;
+  counters.rowsabovethreshold = abovethreshold ;
   return result ;
   }
 
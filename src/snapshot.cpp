@@ -0,0 +1,271 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cosinehelper.h"
+
+using namespace std ;
+
+bool Snapshotmap::open( const char* filename, uint32_t entrybytes, string &error )
+  {
+  close() ;
+  int fd = ::open( filename, O_RDONLY ) ;
+  if( fd < 0 )
+    {
+    error = "file cannot be opened" ;
+    return( false ) ;
+    }
+
+  struct stat filestat ;
+  if( ( fstat( fd, &filestat ) != 0 ) || ( uint64_t( filestat.st_size ) < sizeof( Snapshotheader_t ) ) )
+    {
+    ::close( fd ) ;
+    error = "file is truncated" ;
+    return( false ) ;
+    }
+
+  len = filestat.st_size ;
+  void* mapped = mmap( NULL, len, PROT_READ, MAP_SHARED, fd, 0 ) ;
+  ::close( fd ) ;
+  if( mapped == MAP_FAILED )
+    {
+    error = "file cannot be mapped" ;
+    return( false ) ;
+    }
+
+  base = ( const char* ) mapped ;
+  header = ( const Snapshotheader_t* ) base ;
+  if( memcmp( header->magic, snapshotmagic, sizeof( snapshotmagic ) ) != 0 )
+    error = "magic bytes do not match" ;
+  else if( header->byteorder != snapshotbyteorder )
+    error = "written with another byte order" ;
+  else if( header->version != snapshotversion )
+    error = "version " + to_string( header->version ) + ", this build reads " + to_string( snapshotversion ) ;
+  else if( header->entrybytes != entrybytes )
+    error = "entries of " + to_string( header->entrybytes ) + " bytes, this build uses " + to_string( entrybytes ) ;
+  else
+    return( true ) ;
+
+  close() ;
+  return( false ) ;
+  }
+
+void Snapshotmap::close( void )
+  {
+  if( base != NULL )
+    munmap( ( void* ) base, len ) ;
+  base = NULL ;
+  header = NULL ;
+  len = 0 ;
+  }
+
+bool Snapshotmap::issnapshot( const char* filename )
+  {
+  char magic[ sizeof( snapshotmagic ) ] ;
+  FILE *f = ( strcmp( filename, "-" ) != 0 ) ? fopen( filename, "rb" ) : NULL ;
+  if( f == NULL )
+    return( false ) ;
+
+  bool found = ( fread( magic, 1, sizeof( magic ), f ) == sizeof( magic ) ) &&
+               ( memcmp( magic, snapshotmagic, sizeof( magic ) ) == 0 ) ;
+  fclose( f ) ;
+  return( found ) ;
+  }
+
+// Everything queries read, each array as one section, and the idf
+// counts rows are inserted against
+bool CosineHelper::savesnapshot( const char* path )
+  {
+  if( !anchorwords.isfrozen() )
+    return( false ) ;
+  if( ndeleted > 0 )
+    compactrows() ;
+  if( rowschanged > 0 )
+    rebaseidf() ;
+
+  Snapshotwriter writer ;
+  if( !writer.open( path, sizeof( Entry_t ) ) )
+    return( false ) ;
+
+  Snapshotheader_t &header = writer.header ;
+  header.nbigramcols = nbigramcols ;
+  header.ntrigramcols = ntrigramcols ;
+  header.nwordcols = nwordcols ;
+  header.nmatrixcols = nmatrixcols ;
+  header.totalnnzs = totalnnzs ;
+  header.nrows = corpus.size() ;
+  header.nwords = wordlist.size() ;
+
+  writer.section( idfsection, idf.data(), idf.size() ) ;
+  writer.section( idfcountsection, idfcount.data(), idfcount.size() ) ;
+  writer.section( bigramsection, bigramstodim.data(), bigramstodim.size() ) ;
+  writer.section( trigramsection, trigramstodim.data(), trigramstodim.size() ) ;
+  writer.section( wordsection, wordlist.data(), wordlist.size() ) ;
+  writer.section( wordtextsection, wordtexts.data(), wordtexts.size() ) ;
+  writer.section( wordnnzsection, wordnnzs.data(), wordnnzs.size() ) ;
+
+  vector<Flatword_t> vocabslots ;
+  Vocabulary::flatten( wordlist.size() - 1, [ & ]( uint32_t id, const char* &text, uint32_t &len, uint64_t &offset )
+    {
+    text = wordtext( id ) ;
+    len = strlen( text ) ;
+    offset = wordlist[ id ].wordtext ;
+    }, vocabslots ) ;
+  writer.section( vocabularysection, vocabslots.data(), vocabslots.size() ) ;
+
+  writer.beginsection( corpussection ) ;
+  for( uint64_t s = 0 ; s < corpus.nsegments() ; ++s )
+    writer.write( corpus.segment( s ), corpus.segmentsize( s ) * sizeof( Corpusform_t ) ) ;
+  writer.endsection() ;
+
+  writer.beginsection( rowinfosection ) ;
+  for( uint64_t s = 0 ; s < corpusrowinfo.nsegments() ; ++s )
+    writer.write( corpusrowinfo.segment( s ), corpusrowinfo.segmentsize( s ) * sizeof( uint32_t ) ) ;
+  writer.endsection() ;
+
+  const Mappedarray<uint32_t> &quadcodes = anchorwords.getquadcodes() ;
+  const Mappedarray<uint64_t> &quadstarts = anchorwords.getquadstarts() ;
+  const Mappedarray<Postingblock_t> &quadblocks = anchorwords.getquadblocks() ;
+  const Mappedarray<uint8_t> &quadbytes = anchorwords.getquadbytes() ;
+  const Mappedarray<uint32_t> &discards = anchorwords.getdiscards() ;
+  writer.section( quadcodesection, quadcodes.data(), quadcodes.size() ) ;
+  writer.section( quadstartsection, quadstarts.data(), quadstarts.size() ) ;
+  writer.section( quadblocksection, quadblocks.data(), quadblocks.size() ) ;
+  writer.section( quadbytesection, quadbytes.data(), quadbytes.size() ) ;
+  writer.section( quaddiscardsection, discards.data(), discards.size() ) ;
+  writer.section( emptylinesection, emptylines.data(), emptylines.size() ) ;
+  writer.section( csrstartsection, csrrowstart.data(), csrrowstart.size() ) ;
+  writer.section( csrentrysection, csrentries.data(), csrentries.size() ) ;
+
+  return( writer.close() ) ;
+  }
+
+static bool badsnapshot( const char* what )
+  {
+  cout << makemytimebracketed() << "Error:: snapshot " << what << endl ;
+  return( false ) ;
+  }
+
+// Maps a snapshot and attaches the arrays, the vocabulary included, to
+// its sections.  Nothing is copied.
+bool CosineHelper::loadsnapshot( const char* path )
+  {
+  string error ;
+  if( !snapshot.open( path, sizeof( Entry_t ), error ) )
+    return( badsnapshot( error.c_str() ) ) ;
+
+  const Snapshotheader_t &header = *snapshot.header ;
+  uint64_t nwords = header.nwords ;
+  uint64_t nrows = header.nrows ;
+  uint64_t n ;
+  uint64_t ntext ;
+  uint64_t nnnzs ;
+  uint64_t nrowinfo ;
+  uint64_t nquads ;
+  uint64_t nstarts ;
+  uint64_t nblocks ;
+  uint64_t npostingbytes ;
+  uint64_t ndiscards ;
+
+  nbigramcols = header.nbigramcols ;
+  ntrigramcols = header.ntrigramcols ;
+  nwordcols = header.nwordcols ;
+  nmatrixcols = header.nmatrixcols ;
+  totalnnzs = header.totalnnzs ;
+  if( ( nwords == 0 ) || ( nwordcols != nwords ) )
+    return( badsnapshot( "word count is inconsistent" ) ) ;
+
+  const double* idfs = snapshot.section<double>( idfsection, n ) ;
+  if( ( idfs == NULL ) || ( n != nmatrixcols ) )
+    return( badsnapshot( "idf section is damaged" ) ) ;
+  idf.attach( idfs, n ) ;
+
+  const uint32_t* idfcounts = snapshot.section<uint32_t>( idfcountsection, n ) ;
+  if( ( idfcounts == NULL ) || ( n != nmatrixcols ) )
+    return( badsnapshot( "idf count section is damaged" ) ) ;
+  idfcount.attach( idfcounts, n ) ;
+  idfrows = nrows ;
+
+  const uint32_t* bigrams = snapshot.section<uint32_t>( bigramsection, n ) ;
+  if( bigrams == NULL )
+    return( badsnapshot( "bigram section is damaged" ) ) ;
+  bigramstodim.attach( bigrams, n ) ;
+
+  const uint32_t* trigrams = snapshot.section<uint32_t>( trigramsection, n ) ;
+  if( trigrams == NULL )
+    return( badsnapshot( "trigram section is damaged" ) ) ;
+  trigramstodim.attach( trigrams, n ) ;
+
+  const Wordform_t* words = snapshot.section<Wordform_t>( wordsection, n ) ;
+  const char* texts = snapshot.section<char>( wordtextsection, ntext ) ;
+  const Entry_t* nnzs = snapshot.section<Entry_t>( wordnnzsection, nnnzs ) ;
+  if( ( words == NULL ) || ( texts == NULL ) || ( nnzs == NULL ) || ( n != nwords ) ||
+      ( ntext == 0 ) || ( texts[ ntext - 1 ] != '\0' ) )
+    return( badsnapshot( "word sections are damaged" ) ) ;
+  for( uint64_t i = 0 ; i < nwords ; ++i )
+    if( ( words[ i ].wordtext >= ntext ) || ( words[ i ].rownnzs >= nnnzs ) ||
+        ( nnzs[ words[ i ].rownnzs ] >= nnnzs - words[ i ].rownnzs ) )
+      return( badsnapshot( "word offsets are out of range" ) ) ;
+  wordlist.attach( words, nwords ) ;
+  wordtexts.attach( texts, ntext ) ;
+  wordnnzs.attach( nnzs, nnnzs ) ;
+  for( uint64_t i = nwords - 1 ; i > 0 ; --i )   // Freed by a compaction
+    if( words[ i ].wordtext == words[ 0 ].wordtext )
+      freewords.push_back( i ) ;
+
+  const Flatword_t* vocabslots = snapshot.section<Flatword_t>( vocabularysection, n ) ;
+  if( ( vocabslots == NULL ) || ( n < nwords ) || ( ( n & ( n - 1 ) ) != 0 ) )
+    return( badsnapshot( "vocabulary section is damaged" ) ) ;
+  for( uint64_t i = 0 ; i < n ; ++i )
+    if( ( vocabslots[ i ].id >= nwords ) || ( vocabslots[ i ].text >= ntext ) ||
+        ( vocabslots[ i ].len >= ntext - vocabslots[ i ].text ) )
+      return( badsnapshot( "vocabulary offsets are out of range" ) ) ;
+  vocabulary.attach( vocabslots, n, texts, nwords - 1 ) ;
+
+  const Corpusform_t* rows = snapshot.section<Corpusform_t>( corpussection, n ) ;
+  const uint32_t* rowinfo = snapshot.section<uint32_t>( rowinfosection, nrowinfo ) ;
+  if( ( rows == NULL ) || ( rowinfo == NULL ) || ( n != nrows ) )
+    return( badsnapshot( "corpus sections are damaged" ) ) ;
+  corpus.attach( rows, nrows ) ;
+  corpusrowinfo.attach( rowinfo, nrowinfo ) ;
+
+  const uint32_t* quads = snapshot.section<uint32_t>( quadcodesection, nquads ) ;
+  const uint64_t* quadstarts = snapshot.section<uint64_t>( quadstartsection, nstarts ) ;
+  const Postingblock_t* blocks = snapshot.section<Postingblock_t>( quadblocksection, nblocks ) ;
+  const uint8_t* postings = snapshot.section<uint8_t>( quadbytesection, npostingbytes ) ;
+  const uint32_t* discards = snapshot.section<uint32_t>( quaddiscardsection, ndiscards ) ;
+  if( ( quads == NULL ) || ( quadstarts == NULL ) || ( blocks == NULL ) || ( postings == NULL ) ||
+      ( discards == NULL ) || ( nstarts != nquads + 1 ) || ( quadstarts[ 0 ] != 0 ) ||
+      ( quadstarts[ nquads ] != nblocks ) || ( npostingbytes < postingpadding ) )
+    return( badsnapshot( "anchor sections are damaged" ) ) ;
+  for( uint64_t q = 0 ; q < nquads ; ++q )
+    if( quadstarts[ q ] > quadstarts[ q + 1 ] )
+      return( badsnapshot( "anchor starts are out of order" ) ) ;
+  for( uint64_t b = 0 ; b < nblocks ; ++b )     // Decoding stays inside the bytes
+    if( ( blocks[ b ].n == 0 ) || ( blocks[ b ].n > postingblocksize ) ||
+        ( blocks[ b ].bytes > npostingbytes - postingpadding ) ||
+        ( ( blocks[ b ].n + 2 ) / 4 > npostingbytes - postingpadding - blocks[ b ].bytes ) ||
+        ( postingblocklength( postings + blocks[ b ].bytes, blocks[ b ].n ) > npostingbytes - postingpadding - blocks[ b ].bytes ) )
+      return( badsnapshot( "anchor posting blocks are damaged" ) ) ;
+  anchorwords.attach( quads, quadstarts, nquads, blocks, nblocks, postings, npostingbytes, discards, ndiscards ) ;
+
+  const uint64_t* blanks = snapshot.section<uint64_t>( emptylinesection, n ) ;
+  if( blanks == NULL )
+    return( badsnapshot( "line section is damaged" ) ) ;
+  emptylines.attach( blanks, n ) ;
+
+  const uint64_t* csrstarts = snapshot.section<uint64_t>( csrstartsection, n ) ;
+  const Entry_t* csrs = snapshot.section<Entry_t>( csrentrysection, nnnzs ) ;
+  if( ( csrstarts == NULL ) || ( csrs == NULL ) || ( ( n != 0 ) && ( n != nrows + 1 ) ) )
+    return( badsnapshot( "compiled row sections are damaged" ) ) ;
+  if( n > 0 )
+    {
+    csrrowstart.attach( csrstarts, n ) ;
+    csrentries.attach( csrs, nnnzs ) ;
+    }
+  else if( loadoptions.compiledrows )
+    compilerows() ;
+
+  return( true ) ;
+  }